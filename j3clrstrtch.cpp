@@ -45,10 +45,641 @@ ChannelValue = ( ChannelValue / 255 ) *
 
 #include "opencv2/imgproc.hpp"
 #include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <limits>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <utility>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 #include "opencv2/highgui.hpp"
+#include "opencv2/core/ocl.hpp"
 //#include <chrono>
 #include <opencv2/core/cvdef.h>
 
+#include "j3clrstrtch.hpp"
+
+/**
+ * @brief Runs a kernel templated on the number of channels with the number of channels of an image
+ * This is the only place where the number of channels is checked at runtime, the kernels
+ * are compiled separately for mono and colour images.
+ *
+ * @param cn Number of channels (1 or 3)
+ * @param split Number of groups of rows which are processed in parallel
+ * @param args Arguments for the constructor of the kernel
+ */
+template <template <int> class Kernel, typename... Args>
+void parallelChannels(const int cn, const int split, Args &&... args)
+{
+    CV_Assert(cn == 1 || cn == 3);
+    if (cn == 1)
+        parallelFor(cv::Range(0, split), Kernel<1>(std::forward<Args>(args)...), split);
+    else
+        parallelFor(cv::Range(0, split), Kernel<3>(std::forward<Args>(args)...), split);
+}
+
+/**
+ * @brief Runs a kernel templated on the number of channels and a second type with the number of channels of an image
+ *
+ * @param cn Number of channels (1 or 3)
+ * @param split Number of groups of rows which are processed in parallel
+ * @param args Arguments for the constructor of the kernel
+ */
+template <template <int, typename> class Kernel, typename T, typename... Args>
+void parallelChannels(const int cn, const int split, Args &&... args)
+{
+    CV_Assert(cn == 1 || cn == 3);
+    if (cn == 1)
+        parallelFor(cv::Range(0, split), Kernel<1, T>(std::forward<Args>(args)...), split);
+    else
+        parallelFor(cv::Range(0, split), Kernel<3, T>(std::forward<Args>(args)...), split);
+}
+
+
+/// Context of the kernels of each thread (see setExecutionContext())
+static thread_local ExecutionContext* currentContext = 0;
+/// Set in the threads of the contexts and while a thread runs a loop of a context
+static thread_local bool inLoop = false;
+
+/**
+ * @brief Bind a thread to a set of CPUs (only on Linux)
+ *
+ * @param thread Thread
+ * @param cpus CPUs (nothing is done if empty)
+ */
+static void bindThread(std::thread::native_handle_type thread, const std::vector<int> &cpus)
+{
+#ifdef __linux__
+    if (cpus.empty())
+        return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i = 0; i < cpus.size(); i++)
+    {
+        CPU_SET(cpus[i], &set);
+    }
+    pthread_setaffinity_np(thread, sizeof(set), &set);
+#else
+    (void)thread;
+    (void)cpus;
+#endif
+}
+
+ExecutionContext::ExecutionContext(const int threads, const std::vector<int> &cpus) : cpus(cpus), body(0),
+    stripes(0), next(0), finished(0), generation(0), stop(false)
+{
+    const int n = threads > 0 ? threads : (!cpus.empty() ? (int)cpus.size() :
+                                           std::max(1, (int)std::thread::hardware_concurrency()));
+    // the calling thread runs stripes as well
+    for (int i = 1; i < n; i++)
+    {
+        workers.push_back(std::thread(&ExecutionContext::work, this));
+        bindThread(workers.back().native_handle(), cpus);
+    }
+}
+
+ExecutionContext::~ExecutionContext()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    wake.notify_all();
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        workers[i].join();
+    }
+}
+
+int ExecutionContext::threads() const
+{
+    return (int)workers.size() + 1;
+}
+
+void ExecutionContext::bind() const
+{
+#ifdef __linux__
+    bindThread(pthread_self(), cpus);
+#endif
+}
+
+void ExecutionContext::parallelFor(const cv::Range &range, const cv::ParallelLoopBody &body, const double nstripes)
+{
+    const int length = range.end - range.start;
+    if (length <= 0)
+        return;
+
+    // nested loops and loops started while the threads are busy run on the calling thread
+    std::unique_lock<std::mutex> guard(busy, std::try_to_lock);
+    if (workers.empty() || inLoop || !guard.owns_lock() || length == 1)
+    {
+        body(range);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->body = &body;
+        this->range = range;
+        stripes = std::min(length, nstripes > 0 ? (int)std::ceil(nstripes) : 4 * threads());
+        next = 0;
+        finished = 0;
+        error = std::exception_ptr();
+        generation++;
+    }
+    wake.notify_all();
+
+    inLoop = true;
+    while (runStripe()) {}
+    inLoop = false;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this]() { return finished == stripes; });
+    this->body = 0;
+    if (error)
+        std::rethrow_exception(error);
+}
+
+void ExecutionContext::work()
+{
+    // loops started by the kernels themselves run serially
+    currentContext = this;
+    inLoop = true;
+    size_t seen = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        wake.wait(lock, [&]() { return stop || generation != seen; });
+        if (stop)
+            return;
+        seen = generation;
+        lock.unlock();
+        while (runStripe()) {}
+        lock.lock();
+    }
+}
+
+bool ExecutionContext::runStripe()
+{
+    const cv::ParallelLoopBody* b;
+    cv::Range r;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!body || next >= stripes)
+            return false;
+        const int length = range.end - range.start;
+        r = cv::Range(range.start + (int)((int64_t)length * next / stripes),
+                      range.start + (int)((int64_t)length * (next + 1) / stripes));
+        b = body;
+        next++;
+    }
+
+    std::exception_ptr e;
+    try
+    {
+        (*b)(r);
+    }
+    catch (...)
+    {
+        e = std::current_exception();
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (e && !error)
+        error = e;
+    if (++finished == stripes)
+        done.notify_all();
+    return true;
+}
+
+ExecutionContext* setExecutionContext(ExecutionContext* context)
+{
+    ExecutionContext* previous = currentContext;
+    currentContext = context;
+    return previous;
+}
+
+ExecutionContext* executionContext()
+{
+    return currentContext;
+}
+
+void parallelFor(const cv::Range &range, const cv::ParallelLoopBody &body, const double nstripes)
+{
+    if (currentContext)
+        currentContext->parallelFor(range, body, nstripes);
+    else
+        cv::parallel_for_(range, body, nstripes);
+}
+
+int numThreads()
+{
+    return currentContext ? currentContext->threads() : cv::getNumThreads();
+}
+
+int parseCpuList(const std::string &list, std::vector<int> &cpus)
+{
+    cpus.clear();
+    std::stringstream ss(list);
+    std::string field;
+    while (std::getline(ss, field, ','))
+    {
+        int first, last;
+        char dash;
+        std::stringstream fs(field);
+        if (!(fs >> first) || first < 0)
+            return -1;
+        last = first;
+        if (fs >> dash && (dash != '-' || !(fs >> last) || last < first))
+            return -1;
+        for (int cpu = first; cpu <= last; cpu++)
+        {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus.empty() ? -1 : 0;
+}
+
+/// Switch for the fast approximations (see setFastMath()), atomic as it may be set while
+/// other threads (e.g. of the Python bindings) run steps
+static std::atomic<bool> fastmath(false);
+
+void setFastMath(const bool enable)
+{
+    fastmath = enable;
+}
+
+/// Switch for the sampled histograms of the sky subtraction (see setSampledHists())
+static std::atomic<bool> sampledhists(false);
+
+void setSampledHists(const bool enable)
+{
+    sampledhists = enable;
+}
+
+/// Switch for the OpenCL kernels (see setOpenCL())
+static std::atomic<bool> opencl(false);
+
+/// Optional OpenCL kernels for two steps, versions of ParallelSetMin and ParallelColorCorr with one
+/// work item per pixel, built with -D CN=<channels> and -D REF_T=<type of the reference>
+static const char* const oclSource = R"CL(
+__kernel void j3cs_set_min(__global uchar* dptr, int dstep, int doffset, int rows, int cols,
+                           float4 s, float4 o, float4 l, float4 m, float zx)
+{
+    const int x = get_global_id(0);
+    const int y = get_global_id(1);
+    if (x >= cols || y >= rows)
+        return;
+
+    __global float* p = (__global float*)(dptr + mad24(y, dstep, doffset)) + x * CN;
+    const float S[4] = {s.x, s.y, s.z, s.w}, O[4] = {o.x, o.y, o.z, o.w};
+    const float L[4] = {l.x, l.y, l.z, l.w}, M[4] = {m.x, m.y, m.z, m.w};
+    for (int c = 0; c < CN; c++)
+    {
+        float v = p[c] * S[c] + O[c];
+        v = v < L[c] ? L[c] : v;
+        p[c] = v < M[c] ? M[c] + zx * v : v;
+    }
+}
+
+__kernel void j3cs_color_corr(__global uchar* dptr, int dstep, int doffset, int rows, int cols,
+                              __global const uchar* rptr, int rstep, int roffset,
+                              __global const uchar* kptr, int kstep, int koffset, int tile,
+                              float4 s, float4 o, float4 l, float4 zerosky, float unit, float ref_limit,
+                              float maxlum, float cfactor)
+{
+    const int x = get_global_id(0);
+    const int y = get_global_id(1);
+    if (x >= cols || y >= rows)
+        return;
+
+    __global float* p = (__global float*)(dptr + mad24(y, dstep, doffset)) + x * 3;
+    __global const REF_T* q = (__global const REF_T*)(rptr + mad24(y, rstep, roffset)) + x * 3;
+
+    float b = p[0] * s.x + o.x;
+    float g = p[1] * s.y + o.y;
+    float r = p[2] * s.z + o.z;
+    b = b < l.x ? l.x : b;
+    g = g < l.y ? l.y : g;
+    r = r < l.z ? l.z : r;
+
+    // the reference is at the sky level in the whole tile, only apply the pending transform
+    if (kptr[mad24(y / tile, kstep, koffset) + x / tile])
+    {
+        p[0] = b;
+        p[1] = g;
+        p[2] = r;
+        return;
+    }
+
+    float b_ref = q[0] * unit - zerosky.x;
+    float g_ref = q[1] * unit - zerosky.y;
+    float r_ref = q[2] * unit - zerosky.z;
+    r_ref = r_ref < ref_limit ? ref_limit : r_ref;
+    g_ref = g_ref < ref_limit ? ref_limit : g_ref;
+    b_ref = b_ref < ref_limit ? ref_limit : b_ref;
+
+    float lum = r + g + b;
+    lum = lum < 0.f ? 0.f : lum;
+    const float cfe = (pow(lum / maxlum, 0.2f) + 0.3f) / 1.3f * cfactor;
+
+    if (r >= g && r >= b)
+    {
+        float grratio = g_ref / r_ref / g * r;
+        float brratio = b_ref / r_ref / b * r;
+        grratio = grratio > 1.f ? 1.f : (grratio < 0.2f ? 0.2f : grratio);
+        brratio = brratio > 1.f ? 1.f : (brratio < 0.2f ? 0.2f : brratio);
+        g = g * ((grratio - 1.f) * cfe + 1.f);
+        b = b * ((brratio - 1.f) * cfe + 1.f);
+    }
+    else if (g > r && g >= b)
+    {
+        float rgratio = r_ref / g_ref / r * g;
+        float bgratio = b_ref / g_ref / b * g;
+        rgratio = rgratio > 1.f ? 1.f : (rgratio < 0.2f ? 0.2f : rgratio);
+        bgratio = bgratio > 1.f ? 1.f : (bgratio < 0.2f ? 0.2f : bgratio);
+        r = r * ((rgratio - 1.f) * cfe + 1.f);
+        b = b * ((bgratio - 1.f) * cfe + 1.f);
+    }
+    else
+    {
+        float rbratio = r_ref / b_ref / r * b;
+        float gbratio = g_ref / b_ref / g * b;
+        rbratio = rbratio > 1.f ? 1.f : (rbratio < 0.2f ? 0.2f : rbratio);
+        gbratio = gbratio > 1.f ? 1.f : (gbratio < 0.2f ? 0.2f : gbratio);
+        r = r * ((rbratio - 1.f) * cfe + 1.f);
+        g = g * ((gbratio - 1.f) * cfe + 1.f);
+    }
+
+    p[0] = b;
+    p[1] = g;
+    p[2] = r;
+}
+)CL";
+
+bool setOpenCL(const bool enable)
+{
+    // the steps between the kernels run on the CPU, so on a device with memory of its own
+    // the image would be copied to the device and back for each kernel
+    opencl = enable && cv::ocl::useOpenCL() && cv::ocl::Device::getDefault().hostUnifiedMemory();
+    return opencl;
+}
+
+/**
+ * @brief Converts the first four values of a scalar for an OpenCL kernel argument
+ *
+ * @param v Scalar
+ * @return Vector
+ */
+static cv::Vec4f oclVec(const cv::Scalar &v)
+{
+    return cv::Vec4f((float)v[0], (float)v[1], (float)v[2], (float)v[3]);
+}
+
+/**
+ * @brief Builds an OpenCL kernel of oclSource
+ *
+ * @param name Name of the kernel
+ * @param cn Number of channels of the image
+ * @param refDepth Depth of the reference image (CV_32F or CV_16U)
+ * @return Kernel (empty if it cannot be built)
+ */
+static cv::ocl::Kernel oclKernel(const char* name, const int cn, const int refDepth = CV_32F)
+{
+    // the program is built once for each set of options and cached by OpenCV
+    static const cv::ocl::ProgramSource source(oclSource);
+    std::ostringstream options;
+    options << "-D CN=" << cn << " -D REF_T=" << (refDepth == CV_16U ? "ushort" : "float");
+    return cv::ocl::Kernel(name, source, options.str());
+}
+
+/**
+ * @brief Runs an OpenCL kernel with one work item per pixel and waits for it
+ *
+ * @param kernel Kernel with its arguments
+ * @param size Size of the image
+ * @return true if the kernel ran
+ */
+static bool oclRun(cv::ocl::Kernel &kernel, const cv::Size &size)
+{
+    size_t global[2] = {(size_t)size.width, (size_t)size.height};
+    return kernel.run(2, global, 0, true);
+}
+
+/**
+ * @brief Approximation of log2 for x > 0
+ * The mantissa is reduced to [sqrt(1/2), sqrt(2)) and log2 is evaluated with the series of
+ * atanh up to t^9, the absolute error is below 2e-7 for the mantissa.
+ *
+ * @param x Argument
+ * @return log2(x)
+ */
+static inline float fastLog2(const float x)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    int e = (int)((bits >> 23) & 0xff) - 127;
+    bits = (bits & 0x007fffff) | 0x3f800000;
+    float m;
+    std::memcpy(&m, &bits, sizeof(m));
+    if (m > 1.41421356f)
+    {
+        m *= 0.5f;
+        e++;
+    }
+    const float t = (m - 1.f) / (m + 1.f);
+    const float t2 = t * t;
+    return (float)e + t * (2.885390082f + t2 * (0.961796694f + t2 * (0.577078016f + t2 *
+                           (0.412198583f + t2 * 0.320598898f))));
+}
+
+/**
+ * @brief Approximation of exp2
+ * The fractional part in [-1/2, 1/2] is evaluated with the Taylor series up to the 7th order
+ * (relative error below 1e-7), the integer part is put into the exponent bits.
+ *
+ * @param x Argument (clipped to the range of normal floats)
+ * @return 2^x
+ */
+static inline float fastExp2(float x)
+{
+    x = x < -126.f ? -126.f : (x > 127.f ? 127.f : x);
+    const float fi = std::floor(x + 0.5f);
+    const float f = x - fi;
+    const float p = 1.f + f * (0.693147181f + f * (0.240226507f + f * (0.0555041087f + f * (0.00961812911f +
+                                f * (0.00133335581f + f * (0.000154035304f + f * 0.0000152527338f))))));
+    const uint32_t bits = (uint32_t)((int)fi + 127) << 23;
+    float s;
+    std::memcpy(&s, &bits, sizeof(s));
+    return p * s;
+}
+
+/**
+ * @brief Approximation of pow for x >= 0
+ *
+ * @param x Base
+ * @param y Exponent (> 0)
+ * @return x^y
+ */
+static inline float fastPow(const float x, const float y)
+{
+    return x > 0.f ? fastExp2(y * fastLog2(x)) : 0.f;
+}
+
+/**
+ * @brief Approximation of exp
+ *
+ * @param x Argument
+ * @return e^x
+ */
+static inline float fastExp(const float x)
+{
+    return fastExp2(x * 1.44269504f);
+}
+
+/**
+ * @brief Tone curve X * b * (1/b)^(X^0.4) with b = 12 (see toneCurve())
+ *
+ */
+struct ToneCurve
+{
+    /// ln(1/b)
+    float fac;
+    /// Switch for the fast approximations
+    bool fast;
+
+    /**
+     * @brief Construct a new Tone Curve object
+     *
+     * @param fast Switch for the fast approximations
+     */
+    explicit ToneCurve(const bool fast) : fac(std::log(1.0f / 12.0f)), fast(fast)
+    {}
+
+    /**
+     * @brief Evaluate the curve
+     *
+     * @param x Pixel value
+     * @return Transformed pixel value
+     */
+    inline float operator()(const float x) const
+    {
+        if (fast)
+            return x * 12.f * fastExp(fac * fastPow(x, 0.4f));
+        return x * 12.f * std::exp(fac * std::pow(x, 0.4f));
+    }
+};
+
+/**
+ * @brief S-curve with the normalization of scurve()
+ *
+ */
+struct SCurve
+{
+    /// Factor parameter for the S-curve
+    float xfactor;
+    /// Offset parameter for the S-curve
+    float xoffset;
+    /// Curve at 1 (for the normalization)
+    float scurvemax;
+    /// Normalized curve at 0
+    float scurveminsc;
+    /// Switch for the fast approximations
+    bool fast;
+
+    /**
+     * @brief Construct a new SCurve object
+     *
+     * @param xfactor Factor parameter for the S-curve
+     * @param xoffset Offset parameter for the S-curve
+     * @param fast Switch for the fast approximations
+     */
+    SCurve(const float xfactor, const float xoffset, const bool fast) : xfactor(xfactor), xoffset(xoffset),
+        fast(fast)
+    {
+        float scurvemin =
+            (xfactor / (1.0 + exp(-1.0 * (-xoffset * xfactor))) - (1.0 - xoffset));
+        scurvemax =
+            (xfactor / (1.0 + exp(-1.0 * ((1.0 - xoffset) * xfactor))) -
+             (1.0 - xoffset));
+        scurveminsc = scurvemin / scurvemax;
+    }
+
+    /**
+     * @brief Evaluate the curve
+     *
+     * @param x Pixel value
+     * @return Transformed pixel value
+     */
+    inline float operator()(const float x) const
+    {
+        const float t = -xfactor * (x - xoffset);
+        float v = xfactor / ((fast ? fastExp(t) : std::exp(t)) + 1.f);
+        v = (v - (1.f - xoffset)) / scurvemax;
+        v = (v - scurveminsc) / (1.f - scurveminsc);
+        return v < 0.f ? 0.f : v;
+    }
+};
+
+double fastMathError(const double rootpower, const float xfactor, const float xoffset)
+{
+    const ToneCurve tone(true);
+    const SCurve scurveFast(xfactor, xoffset, true);
+
+    // normalization of the stretch for an image with a pixel at 0 (as after the sky subtraction)
+    const double eps = 1.0 / 65535.0;
+    const double norm = 1. / (1. + 1.0 / 65535.);
+    const double x = 1. / rootpower;
+    double mn = std::pow(eps * norm, x) - 4096.0 / 65535.;
+    mn = mn > 0. ? mn : 0.;
+    float fmn = fastPow((float)eps * (float)norm, (float)x) - 4096.0f / 65535.f;
+    fmn = fmn > 0.f ? fmn : 0.f;
+
+    const double fac = std::log(1.0 / 12.0);
+    const double scurvemax = xfactor / (1.0 + std::exp(-(1.0 - xoffset) * xfactor)) - (1.0 - xoffset);
+    const double scurveminsc = (xfactor / (1.0 + std::exp(xoffset * xfactor)) - (1.0 - xoffset)) / scurvemax;
+
+    double maxerr = 0.;
+    const int n = 4 * 65536;
+    for (int i = 0; i <= n; i++)
+    {
+        const float v = (float)i / n;
+        const double d = v;
+        double err;
+
+        // root stretch
+        const double st = (std::pow((d + eps) * norm, x) - mn) / (1. - mn);
+        const float fst = (fastPow(((float)v + (float)eps) * (float)norm, (float)x) - fmn) / (1.f - fmn);
+        err = std::fabs(fst - st);
+        maxerr = err > maxerr ? err : maxerr;
+
+        // tone curve
+        err = std::fabs(tone(v) - d * 12. * std::exp(fac * std::pow(d, 0.4)));
+        maxerr = err > maxerr ? err : maxerr;
+
+        // S-curve
+        double sc = xfactor / (1.0 + std::exp(-xfactor * (d - xoffset))) - (1.0 - xoffset);
+        sc = (sc / scurvemax - scurveminsc) / (1.0 - scurveminsc);
+        sc = sc > 0. ? sc : 0.;
+        err = std::fabs(scurveFast(v) - sc);
+        maxerr = err > maxerr ? err : maxerr;
+
+        // colour enhancement factor
+        err = std::fabs(fastPow(v, 0.2f) - std::pow(d, 0.2)) / 1.3 * 1.2;
+        maxerr = err > maxerr ? err : maxerr;
+    }
+    return maxerr;
+}
+
 
 void hist(cv::InputArray image, cv::OutputArray hist, const bool blur)
 {
@@ -61,503 +692,2309 @@ void hist(cv::InputArray image, cv::OutputArray hist, const bool blur)
     cv::calcHist(&ima, 1, channels, cv::Mat(), hist, 1, histSize, histRange,
                  uniform, accumulate);
 
-    if (blur)
+    if (blur)
+    {
+        int border = CV_MAJOR_VERSION > 3 ? cv::BORDER_ISOLATED : cv::BORDER_REFLECT;
+        cv::blur(hist, hist, cv::Size(1, 601), cv::Point(-1, -1), border);
+    }
+}
+
+
+SolvedParams::SolvedParams() : replay(false), nextSkysub(0), nextStretch(0), nextColorcorr(0), nextSeed(0)
+{
+}
+
+void SolvedParams::rewind()
+{
+    replay = true;
+    nextSkysub = 0;
+    nextStretch = 0;
+    nextColorcorr = 0;
+    nextSeed = 0;
+}
+
+void SolvedParams::warmStart()
+{
+    seeds.swap(skysubs);
+    skysubs.clear();
+    minima.clear();
+    maxlums.clear();
+    replay = false;
+    nextSkysub = 0;
+    nextStretch = 0;
+    nextColorcorr = 0;
+    nextSeed = 0;
+}
+
+TileIndex::TileIndex() : size(64)
+{
+}
+
+bool TileIndex::empty() const
+{
+    return mins.empty();
+}
+
+BufferPool::BufferPool() : limit((size_t)4 << 30)
+{
+    counters.hits = counters.misses = 0;
+    counters.pooledBytes = counters.outstandingBytes = counters.highWaterBytes = 0;
+}
+
+cv::Mat BufferPool::get(const int rows, const int cols, const int type)
+{
+    cv::Mat mat;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        // the most recently returned buffer first
+        for (std::list<cv::Mat>::reverse_iterator it = free.rbegin(); it != free.rend(); ++it)
+        {
+            if (it->rows == rows && it->cols == cols && it->type() == type)
+            {
+                mat = *it;
+                free.erase(std::next(it).base());
+                counters.pooledBytes -= mat.total() * mat.elemSize();
+                counters.hits++;
+                break;
+            }
+        }
+    }
+
+    if (mat.empty())
+    {
+        mat.create(rows, cols, type);
+        std::lock_guard<std::mutex> lock(mutex);
+        counters.misses++;
+    }
+
+    const size_t bytes = mat.total() * mat.elemSize();
+    std::lock_guard<std::mutex> lock(mutex);
+    outstanding[mat.data] = bytes;
+    counters.outstandingBytes += bytes;
+    counters.highWaterBytes = std::max(counters.highWaterBytes, counters.pooledBytes + counters.outstandingBytes);
+    return mat;
+}
+
+void BufferPool::put(cv::Mat &mat)
+{
+    if (mat.empty())
+        return;
+
+    // only buffers which nobody else refers to and which are a whole allocation can be reused
+    const size_t bytes = mat.total() * mat.elemSize();
+    const bool reusable = mat.u && mat.u->refcount == 1 && mat.isContinuous() && mat.data == mat.datastart &&
+                          (size_t)(mat.dataend - mat.datastart) == bytes;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::map<const uchar*, size_t>::iterator it = outstanding.find(mat.data);
+        if (it != outstanding.end())
+        {
+            counters.outstandingBytes -= it->second;
+            outstanding.erase(it);
+        }
+        if (reusable && bytes <= limit)
+        {
+            free.push_back(mat);
+            counters.pooledBytes += bytes;
+            counters.highWaterBytes = std::max(counters.highWaterBytes,
+                                               counters.pooledBytes + counters.outstandingBytes);
+            trim();
+        }
+    }
+    mat.release();
+}
+
+void BufferPool::put(std::vector<cv::Mat> &mats)
+{
+    for (size_t i = 0; i < mats.size(); i++)
+    {
+        put(mats[i]);
+    }
+    mats.clear();
+}
+
+void BufferPool::setLimit(const size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    limit = bytes;
+    trim();
+}
+
+void BufferPool::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    free.clear();
+    counters.pooledBytes = 0;
+}
+
+BufferPool::Stats BufferPool::stats() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+}
+
+void BufferPool::trim()
+{
+    while (counters.pooledBytes > limit && !free.empty())
+    {
+        counters.pooledBytes -= free.front().total() * free.front().elemSize();
+        free.pop_front();
+    }
+}
+
+BufferPool &bufferPool()
+{
+    static BufferPool pool;
+    return pool;
+}
+
+
+PipelineImage::PipelineImage() : scale(cv::Scalar::all(1.0)), offset(cv::Scalar::all(0.0)),
+    lower(cv::Scalar::all(-std::numeric_limits<double>::infinity())), below(cv::Scalar::all(0.0))
+{
+}
+
+PipelineImage::PipelineImage(const cv::Mat &image) : data(image), scale(cv::Scalar::all(1.0)),
+    offset(cv::Scalar::all(0.0)), lower(cv::Scalar::all(-std::numeric_limits<double>::infinity())),
+    below(cv::Scalar::all(0.0))
+{
+}
+
+bool PipelineImage::pending() const
+{
+    for (int c = 0; c < 4; c++)
+    {
+        if (scale[c] != 1.0 || offset[c] != 0.0 || lower[c] > -std::numeric_limits<double>::infinity())
+            return true;
+    }
+    return false;
+}
+
+void PipelineImage::modified()
+{
+    bufferPool().put(hists);
+    *this = PipelineImage(data);
+}
+
+void PipelineImage::affine(const cv::Scalar &s, const cv::Scalar &o)
+{
+    bufferPool().put(hists);
+    // max(X * a + b, l) * s + o = max(X * a * s + b * s + o, l * s + o) for s > 0
+    for (int c = 0; c < 4; c++)
+    {
+        scale[c] *= s[c];
+        offset[c] = offset[c] * s[c] + o[c];
+        if (lower[c] > -std::numeric_limits<double>::infinity())
+            lower[c] = lower[c] * s[c] + o[c];
+    }
+}
+
+void PipelineImage::clampBelow(const double limit)
+{
+    const int cn = data.channels();
+    if (limit == 0. && (int)hists.size() == cn)
+    {
+        // the pixel values below 0 move to the first bin
+        for (int c = 0; c < cn; c++)
+        {
+            hists[c].at<float>(0) += (float)below[c];
+        }
+        below = cv::Scalar::all(0.);
+    }
+    else
+    {
+        bufferPool().put(hists);
+    }
+    for (int c = 0; c < 4; c++)
+    {
+        lower[c] = lower[c] > limit ? lower[c] : limit;
+    }
+}
+
+
+/**
+ * @brief Class with the code for applying a pending transform to be run by OpenCV's parallel_for_
+ *
+ */
+template <int CN>
+class ParallelAffine : public cv::ParallelLoopBody
+{
+    public:
+        /**
+         * @brief Construct a new Parallel Affine object
+         *
+         * @param src Input image
+         * @param dst Output image (may be the same as src)
+         * @param image Image with the pending transform
+         * @param row_split Number of rows in each group of rows which are processed in parallel
+         */
+        ParallelAffine (const cv::Mat &src, cv::Mat &dst, const PipelineImage &image, const int row_split) :
+            src(src), dst(dst), row_split(row_split)
+        {
+            for (int c = 0; c < 4; c++)
+            {
+                s[c] = (float)image.scale[c];
+                o[c] = (float)image.offset[c];
+                l[c] = (float)image.lower[c];
+            }
+        }
+        virtual void operator ()(const cv::Range &range) const override
+        {
+            for (int n = range.start; n < range.end; n++)
+            {
+                int start = n * row_split;
+                int stop = start + row_split;
+                stop = stop < src.rows ? stop : src.rows;
+
+                for (int row = start; row < stop; row++)
+                {
+                    const float* p = src.ptr<float>(row);
+                    float* q = dst.ptr<float>(row);
+
+                    for (int col = 0; col < src.cols; col++)
+                    {
+                        for (int c = 0; c < CN; c++)
+                        {
+                            float v = *p * s[c] + o[c];
+                            *q = v < l[c] ? l[c] : v;
+                            p++;
+                            q++;
+                        }
+                    }
+                }
+            }
+        }
+        ParallelAffine &operator=(const ParallelAffine &)
+        {
+            return *this;
+        };
+    private:
+        const cv::Mat &src;
+        cv::Mat &dst;
+        float s[4], o[4], l[4];
+        int row_split;
+};
+
+void PipelineImage::apply(cv::OutputArray outImage) const
+{
+    outImage.create(data.size(), data.type());
+    cv::Mat out = outImage.getMat();
+    if (!pending())
+    {
+        if (out.data != data.data) data.copyTo(out);
+        return;
+    }
+
+    const int split = 8;
+    const int row_split = (data.rows + split - 1) / split;
+
+    parallelChannels<ParallelAffine>(data.channels(), split, data, out, *this, row_split);
+}
+
+void PipelineImage::materialize()
+{
+    if (!pending()) return;
+    apply(data);
+    // the effective pixel values and therefore the histograms are unchanged
+    std::vector<cv::Mat> h = hists;
+    cv::Scalar b = below;
+    TileIndex t = effectiveTiles();
+    *this = PipelineImage(data);
+    hists = h;
+    below = b;
+    tiles = t;
+}
+
+PipelineImage PipelineImage::crop(const cv::Rect &rect) const
+{
+    PipelineImage image(bufferPool().get(rect.height, rect.width, data.type()));
+    data(rect).copyTo(image.data);
+    image.scale = scale;
+    image.offset = offset;
+    image.lower = lower;
+    return image;
+}
+
+void PipelineImage::subsample(const int step)
+{
+    if (step <= 1) return;
+    cv::Mat small = bufferPool().get((data.rows + step - 1) / step, (data.cols + step - 1) / step, data.type());
+    cv::resize(data, small, small.size(), 0, 0, cv::INTER_NEAREST);
+    // the full data goes back to the pool unless it is still shared (e.g. by the full image)
+    bufferPool().put(data);
+    data = small;
+    // the histograms of the full image stay valid (up to their normalization), the tiles do not
+    tiles = TileIndex();
+}
+
+void PipelineImage::release()
+{
+    bufferPool().put(data);
+    bufferPool().put(hists);
+    *this = PipelineImage();
+}
+
+TileIndex PipelineImage::effectiveTiles() const
+{
+    if (tiles.empty() || !pending()) return tiles;
+
+    TileIndex t;
+    t.size = tiles.size;
+    t.mins.create(tiles.mins.size(), tiles.mins.type());
+    t.maxs.create(tiles.maxs.size(), tiles.maxs.type());
+
+    // max(X * s + o, l) is monotonic for s > 0
+    const int cn = tiles.mins.channels();
+    for (int row = 0; row < tiles.mins.rows; row++)
+    {
+        for (int col = 0; col < tiles.mins.cols * cn; col++)
+        {
+            const int c = col % cn;
+            float mn = tiles.mins.ptr<float>(row)[col] * scale[c] + offset[c];
+            float mx = tiles.maxs.ptr<float>(row)[col] * scale[c] + offset[c];
+            t.mins.ptr<float>(row)[col] = mn < lower[c] ? lower[c] : mn;
+            t.maxs.ptr<float>(row)[col] = mx < lower[c] ? lower[c] : mx;
+        }
+    }
+    return t;
+}
+
+
+/**
+ * @brief Class with the code for quantizing rows of an image to be run by OpenCV's parallel_for_
+ *
+ */
+template <int CN, typename T>
+class ParallelQuantize : public cv::ParallelLoopBody
+{
+    public:
+        /**
+         * @brief Construct a new Parallel Quantize object
+         *
+         * @param image Input image with the pending transform
+         * @param row0 First row of the image
+         * @param rows Output rows
+         * @param swapRB Switch whether to swap the first and third channel
+         * @param dither Switch for ordered dithering
+         */
+        ParallelQuantize (const PipelineImage &image, const int row0, cv::Mat &rows, const bool swapRB,
+                          const bool dither) : ima(image.data), row0(row0), rows(rows), swapRB(swapRB), dither(dither)
+        {
+            for (int c = 0; c < 4; c++)
+            {
+                s[c] = (float)image.scale[c];
+                o[c] = (float)image.offset[c];
+                l[c] = (float)image.lower[c];
+            }
+        }
+        virtual void operator ()(const cv::Range &range) const override
+        {
+            // 8x8 Bayer matrix
+            static const uchar bayer[8][8] =
+            {
+                { 0, 32,  8, 40,  2, 34, 10, 42},
+                {48, 16, 56, 24, 50, 18, 58, 26},
+                {12, 44,  4, 36, 14, 46,  6, 38},
+                {60, 28, 52, 20, 62, 30, 54, 22},
+                { 3, 35, 11, 43,  1, 33,  9, 41},
+                {51, 19, 59, 27, 49, 17, 57, 25},
+                {15, 47,  7, 39, 13, 45,  5, 37},
+                {63, 31, 55, 23, 61, 29, 53, 21}
+            };
+            const float maxval = sizeof(T) == 1 ? 255.f : 65535.f;
+
+            for (int row = range.start; row < range.end; row++)
+            {
+                const float* p = ima.ptr<float>(row0 + row);
+                T* q = rows.ptr<T>(row);
+                const uchar* b = bayer[(row0 + row) & 7];
+
+                for (int col = 0; col < ima.cols; col++)
+                {
+                    for (int c = 0; c < CN; c++)
+                    {
+                        const int cc = swapRB && CN == 3 ? 2 - c : c;
+                        float v = p[cc] * s[cc] + o[cc];
+                        v = v < l[cc] ? l[cc] : v;
+                        if (dither)
+                            q[c] = cv::saturate_cast<T>(cvFloor(v * maxval + (b[col & 7] + 0.5f) / 64.f));
+                        else
+                            q[c] = cv::saturate_cast<T>(v * maxval);
+                    }
+                    p += CN;
+                    q += CN;
+                }
+            }
+        }
+        ParallelQuantize &operator=(const ParallelQuantize &)
+        {
+            return *this;
+        };
+    private:
+        const cv::Mat &ima;
+        int row0;
+        cv::Mat &rows;
+        bool swapRB, dither;
+        float s[4], o[4], l[4];
+};
+
+/**
+ * @brief Quantizes rows with the kernel for the number of channels of the image
+ *
+ * @param image Input image
+ * @param row0 First row of the image
+ * @param rows Output rows
+ * @param swapRB Switch whether to swap the first and third channel
+ * @param dither Switch for ordered dithering
+ */
+template <typename T>
+static void quantizeRows(const PipelineImage &image, const int row0, cv::Mat &rows, const bool swapRB,
+                         const bool dither)
+{
+    parallelChannels<ParallelQuantize, T>(image.data.channels(), rows.rows, image, row0, rows, swapRB, dither);
+}
+
+void quantize(const PipelineImage &image, const int row0, cv::Mat &rows, const bool swapRB,
+              const bool dither)
+{
+    CV_Assert(rows.channels() == image.data.channels() && rows.cols == image.data.cols);
+    CV_Assert(row0 >= 0 && row0 + rows.rows <= image.data.rows);
+    CV_Assert(image.data.channels() == 1 || image.data.channels() == 3);
+
+    if (rows.depth() == CV_8U)
+    {
+        quantizeRows<uchar>(image, row0, rows, swapRB, dither);
+    }
+    else
+    {
+        CV_Assert(rows.depth() == CV_16U);
+        quantizeRows<ushort>(image, row0, rows, swapRB, dither);
+    }
+}
+
+
+/**
+ * @brief Class with the code for the summary of an image in tiles to be run by OpenCV's parallel_for_
+ * This is the summary of ParallelHist without the binning, for passes which only bin a sample.
+ *
+ */
+template <int CN>
+class ParallelTiles : public cv::ParallelLoopBody
+{
+    public:
+        /**
+         * @brief Construct a new Parallel Tiles object
+         *
+         * @param data Input data (the pending transform is not applied, see PipelineImage::effectiveTiles())
+         * @param tiles Output summary (allocated and initialized by the caller)
+         * @param row_split Number of rows in each group of rows which are processed in parallel (a multiple
+         *        of the tile size)
+         */
+        ParallelTiles (const cv::Mat &data, TileIndex &tiles, const int row_split) : ima(data), tiles(tiles),
+            row_split(row_split)
+        {
+        }
+        virtual void operator ()(const cv::Range &range) const override
+        {
+            for (int n = range.start; n < range.end; n++)
+            {
+                int start = n * row_split;
+                int stop = start + row_split;
+                stop = stop < ima.rows ? stop : ima.rows;
+
+                for (int row = start; row < stop; row++)
+                {
+                    const float* p = ima.ptr<float>(row);
+                    float* tmin = tiles.mins.ptr<float>(row / tiles.size);
+                    float* tmax = tiles.maxs.ptr<float>(row / tiles.size);
+
+                    for (int col0 = 0; col0 < ima.cols; col0 += tiles.size)
+                    {
+                        const int col1 = col0 + tiles.size < ima.cols ? col0 + tiles.size : ima.cols;
+                        float mn[CN], mx[CN];
+                        for (int c = 0; c < CN; c++)
+                        {
+                            mn[c] = tmin[c];
+                            mx[c] = tmax[c];
+                        }
+                        for (int col = col0; col < col1; col++)
+                        {
+                            for (int c = 0; c < CN; c++)
+                            {
+                                mn[c] = *p < mn[c] ? *p : mn[c];
+                                mx[c] = *p > mx[c] ? *p : mx[c];
+                                p++;
+                            }
+                        }
+                        for (int c = 0; c < CN; c++)
+                        {
+                            tmin[c] = mn[c];
+                            tmax[c] = mx[c];
+                        }
+                        tmin += CN;
+                        tmax += CN;
+                    }
+                }
+            }
+        }
+        ParallelTiles &operator=(const ParallelTiles &)
+        {
+            return *this;
+        };
+    private:
+        const cv::Mat &ima;
+        TileIndex &tiles;
+        int row_split;
+};
+
+/**
+ * @brief Allocates the summary of an image in tiles for the passes filling it
+ *
+ * @param data Data of the image
+ * @param tiles Summary with the size of the tiles set
+ * @param row_split Number of rows in each group of rows, rounded up to a multiple of the tile size
+ */
+static void initTiles(const cv::Mat &data, TileIndex &tiles, int &row_split)
+{
+    // each tile has to be in a single group of rows
+    const int size = tiles.size;
+    row_split = (row_split + size - 1) / size * size;
+    cv::Size ntiles((data.cols + size - 1) / size, (data.rows + size - 1) / size);
+    tiles.mins.create(ntiles, CV_MAKETYPE(CV_32F, data.channels()));
+    tiles.maxs.create(ntiles, CV_MAKETYPE(CV_32F, data.channels()));
+    tiles.mins.setTo(cv::Scalar::all(std::numeric_limits<float>::max()));
+    tiles.maxs.setTo(cv::Scalar::all(-std::numeric_limits<float>::max()));
+}
+
+/**
+ * @brief Calculates the summary of an image in tiles without histograms
+ *
+ * @param data Data of the image
+ * @param tiles Output summary
+ */
+static void calcTiles(const cv::Mat &data, TileIndex &tiles)
+{
+    const int split = 8;
+    int row_split = (data.rows + split - 1) / split;
+    initTiles(data, tiles, row_split);
+    parallelChannels<ParallelTiles>(data.channels(), split, data, tiles, row_split);
+}
+
+/**
+ * @brief Class with the code for the histograms of all channels to be run by OpenCV's parallel_for_
+ * The histograms are accumulated for each group of rows and added up at the end, the values
+ * below 0 are counted separately. Optionally the minimum and maximum of the data are
+ * determined in tiles, or only a stratified sample of the pixels is binned.
+ *
+ */
+template <int CN>
+class ParallelHist : public cv::ParallelLoopBody
+{
+    public:
+        /**
+         * @brief Construct a new Parallel Hist object
+         *
+         * @param image Input image with the pending transform, which is applied on the fly
+         * @param hists Output histograms (65536 bins, CV_32F, one for each channel)
+         * @param below Output number of values below 0 for each channel
+         * @param mutex Mutex protecting the output histograms
+         * @param tiles Output summary in tiles (allocated and initialized by the caller, or 0 to skip)
+         * @param row_split Number of rows in each group of rows which are processed in parallel
+         *        (a multiple of the tile size if tiles are summarized)
+         * @param stride Only one pixel in each block of stride x stride pixels is binned (1 for all pixels,
+         *        tiles are only summarized with all pixels)
+         */
+        ParallelHist (const PipelineImage &image, std::vector<cv::Mat> &hists, cv::Scalar &below,
+                      std::mutex &mutex, TileIndex* tiles, const int row_split, const int stride) : ima(image.data),
+            hists(hists), below(below), mutex(mutex), tiles(tiles), row_split(row_split), stride(stride)
+        {
+            for (int c = 0; c < 4; c++)
+            {
+                s[c] = (float)image.scale[c];
+                o[c] = (float)image.offset[c];
+                l[c] = (float)image.lower[c];
+            }
+        }
+        virtual void operator ()(const cv::Range &range) const override
+        {
+            std::vector<int> counts(CN * 65536, 0);
+            int belowcounts[CN] = {0};
+
+            for (int n = range.start; n < range.end; n++)
+            {
+                int start = n * row_split;
+                int stop = start + row_split;
+                stop = stop < ima.rows ? stop : ima.rows;
+
+                for (int row = (start + stride - 1) / stride * stride; row < stop; row += stride)
+                {
+                    // the sampled column moves within the blocks from one row of blocks to the next,
+                    // so that the sample does not follow a column pattern of the sensor
+                    const int col0 = (row / stride * 7) % stride;
+                    const float* p = ima.ptr<float>(row) + col0 * CN;
+                    float* tmin = tiles ? tiles->mins.ptr<float>(row / tiles->size) : 0;
+                    float* tmax = tiles ? tiles->maxs.ptr<float>(row / tiles->size) : 0;
+
+                    for (int col = col0; col < ima.cols; col += stride)
+                    {
+                        const int t = tiles ? col / tiles->size * CN : 0;
+                        for (int c = 0; c < CN; c++)
+                        {
+                            if (tiles)
+                            {
+                                tmin[t + c] = *p < tmin[t + c] ? *p : tmin[t + c];
+                                tmax[t + c] = *p > tmax[t + c] ? *p : tmax[t + c];
+                            }
+                            float v = *p * s[c] + o[c];
+                            v = v < l[c] ? l[c] : v;
+                            // same binning as calcHist for the range [0, 1)
+                            if (v >= 0.f && v < 1.f)
+                                counts[c * 65536 + (int)(v * 65536.f)]++;
+                            else if (v < 0.f)
+                                belowcounts[c]++;
+                            p++;
+                        }
+                        p += (stride - 1) * CN;
+                    }
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            for (int c = 0; c < CN; c++)
+            {
+                float* h = hists[c].ptr<float>(0);
+                const int* cnt = &counts[c * 65536];
+                for (int i = 0; i < 65536; i++)
+                    h[i] += cnt[i];
+                below[c] += belowcounts[c];
+            }
+        }
+        ParallelHist &operator=(const ParallelHist &)
+        {
+            return *this;
+        };
+    private:
+        const cv::Mat &ima;
+        std::vector<cv::Mat> &hists;
+        cv::Scalar &below;
+        std::mutex &mutex;
+        TileIndex* tiles;
+        float s[4], o[4], l[4];
+        int row_split, stride;
+};
+
+/**
+ * @brief Calculates the histograms of all channels in one pass and optionally the summary in tiles
+ *
+ * @param image Input image
+ * @param hists Output histograms
+ * @param below Output number of values below 0 for each channel
+ * @param tiles Output summary (or 0)
+ * @param stride Only one pixel in each block of stride x stride pixels is binned (1 for all pixels)
+ */
+static void calcHists(const PipelineImage &image, std::vector<cv::Mat> &hists, cv::Scalar &below, TileIndex* tiles,
+                      const int stride = 1)
+{
+    CV_Assert(stride >= 1 && (stride == 1 || !tiles));
+    const int cn = image.data.channels();
+    bufferPool().put(hists);
+    hists.resize(cn);
+    for (int c = 0; c < cn; c++)
+    {
+        hists[c] = bufferPool().get(65536, 1, CV_32F);
+        hists[c].setTo(cv::Scalar::all(0.));
+    }
+    below = cv::Scalar::all(0.);
+
+    const int split = 8;
+    int row_split = (image.data.rows + split - 1) / split;
+
+    if (tiles) initTiles(image.data, *tiles, row_split);
+
+    std::mutex mutex;
+    parallelChannels<ParallelHist>(cn, split, image, hists, below, mutex, tiles, row_split, stride);
+}
+
+/// Width of the box filter of blurred histograms in bins
+static const int histBlur = 601;
+
+/**
+ * @brief Blurs histograms with the box filter used for finding the sky level
+ *
+ * @param hists Histograms (blurred in place)
+ */
+static void blurHists(std::vector<cv::Mat> &hists)
+{
+    int border = CV_MAJOR_VERSION > 3 ? cv::BORDER_ISOLATED : cv::BORDER_REFLECT;
+    for (size_t c = 0; c < hists.size(); c++)
+    {
+        cv::blur(hists[c], hists[c], cv::Size(1, histBlur), cv::Point(-1, -1), border);
+    }
+}
+
+void hist(const PipelineImage &image, std::vector<cv::Mat> &hists, const bool blur)
+{
+    const int cn = image.data.channels();
+    if ((int)image.hists.size() == cn)
+    {
+        // known from an earlier pass (e.g. ingestImage or updateHists)
+        bufferPool().put(hists);
+        hists.resize(cn);
+        for (int c = 0; c < cn; c++)
+        {
+            hists[c] = bufferPool().get(65536, 1, CV_32F);
+            image.hists[c].copyTo(hists[c]);
+        }
+    }
+    else
+    {
+        cv::Scalar below;
+        calcHists(image, hists, below, 0);
+    }
+
+    if (blur)
+        blurHists(hists);
+}
+
+void updateHists(PipelineImage &image)
+{
+    if ((int)image.hists.size() == image.data.channels())
+        return;
+
+    // the data does not change with the pending transform, so it has to be summarized in tiles only once
+    std::vector<cv::Mat> hists;
+    cv::Scalar below;
+    calcHists(image, hists, below, image.tiles.empty() ? &image.tiles : 0);
+    image.hists = hists;
+    image.below = below;
+}
+
+void normalizeMinMax(PipelineImage &image)
+{
+    // as cv::normalize, the minimum and maximum are taken over all channels
+    image.materialize();
+
+    double immin, immax;
+    cv::minMaxLoc(image.data.reshape(1), &immin, &immax, 0, 0);
+
+    double s = immax - immin > DBL_EPSILON ? 1. / (immax - immin) : 0.;
+    image.affine(cv::Scalar::all(s), cv::Scalar::all(-immin * s));
+}
+
+
+/**
+ * @brief Class with the code for widening a decoded image to be run by OpenCV's parallel_for_
+ * The minimum, maximum and (for integer types) the histograms of the raw values are
+ * determined in the same pass.
+ *
+ */
+template <int CN, typename T>
+class ParallelIngest : public cv::ParallelLoopBody
+{
+    public:
+        /**
+         * @brief Construct a new Parallel Ingest object
+         *
+         * @param src Decoded input image
+         * @param dst Output image (CV_32F with the same number of channels)
+         * @param counts Output histograms of the raw values (nbins for each channel)
+         * @param nbins Number of histogram bins (0 for no histograms)
+         * @param mins Output minimum of each channel
+         * @param maxs Output maximum of each channel
+         * @param mutex Mutex protecting the outputs
+         * @param row_split Number of rows in each group of rows which are processed in parallel
+         * @param swapRB Switch whether the input is in RGB instead of BGR order
+         */
+        ParallelIngest (const cv::Mat &src, cv::Mat &dst, std::vector<double> &counts, const int nbins,
+                        float* mins, float* maxs, std::mutex &mutex, const int row_split, const bool swapRB) :
+            src(src), dst(dst), counts(counts), nbins(nbins), mins(mins), maxs(maxs), mutex(mutex),
+            row_split(row_split), swapRB(swapRB)
+        {}
+        virtual void operator ()(const cv::Range &range) const override
+        {
+            std::vector<int> localcounts(CN * nbins, 0);
+            float localmin[4], localmax[4];
+            for (int c = 0; c < CN; c++)
+            {
+                localmin[c] = std::numeric_limits<float>::max();
+                localmax[c] = -std::numeric_limits<float>::max();
+            }
+
+            for (int n = range.start; n < range.end; n++)
+            {
+                int start = n * row_split;
+                int stop = start + row_split;
+                stop = stop < src.rows ? stop : src.rows;
+
+                for (int row = start; row < stop; row++)
+                {
+                    const T* p = src.ptr<T>(row);
+                    float* q = dst.ptr<float>(row);
+
+                    for (int col = 0; col < src.cols; col++)
+                    {
+                        for (int c = 0; c < CN; c++)
+                        {
+                            const T raw = p[swapRB && CN == 3 ? 2 - c : c];
+                            float v = (float)raw;
+                            localmin[c] = v < localmin[c] ? v : localmin[c];
+                            localmax[c] = v > localmax[c] ? v : localmax[c];
+                            if (nbins > 0)
+                                localcounts[c * nbins + (int)raw]++;
+                            *q = v;
+                            q++;
+                        }
+                        p += CN;
+                    }
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            for (int c = 0; c < CN; c++)
+            {
+                mins[c] = localmin[c] < mins[c] ? localmin[c] : mins[c];
+                maxs[c] = localmax[c] > maxs[c] ? localmax[c] : maxs[c];
+            }
+            for (size_t i = 0; i < localcounts.size(); i++)
+                counts[i] += localcounts[i];
+        }
+        ParallelIngest &operator=(const ParallelIngest &)
+        {
+            return *this;
+        };
+    private:
+        const cv::Mat &src;
+        cv::Mat &dst;
+        std::vector<double> &counts;
+        int nbins;
+        float* mins;
+        float* maxs;
+        std::mutex &mutex;
+        int row_split;
+        bool swapRB;
+};
+
+/**
+ * @brief Widens rows with the kernel for the number of channels of the image
+ *
+ * @param raw Decoded rows
+ * @param dst Output rows
+ * @param counts Histograms of the raw values
+ * @param nbins Number of histogram bins
+ * @param mins Minimum of each channel
+ * @param maxs Maximum of each channel
+ * @param mutex Mutex protecting the outputs
+ * @param swapRB Switch whether the input is in RGB instead of BGR order
+ */
+template <typename T>
+static void ingestRows(const cv::Mat &raw, cv::Mat &dst, std::vector<double> &counts, const int nbins,
+                       float* mins, float* maxs, std::mutex &mutex, const bool swapRB)
+{
+    const int split = 8;
+    const int row_split = (raw.rows + split - 1) / split;
+
+    parallelChannels<ParallelIngest, T>(raw.channels(), split, raw, dst, counts, nbins, mins, maxs, mutex, row_split,
+                                        swapRB);
+}
+
+IngestStream::IngestStream(const int rows, const int cols, const int channels, const int depth) :
+    data(bufferPool().get(rows, cols, CV_MAKETYPE(CV_32F, channels))), depth(depth),
+    nbins(depth == CV_8U ? 256 : (depth == CV_16U ? 65536 : 0)),
+    counts(channels * (depth == CV_8U ? 256 : (depth == CV_16U ? 65536 : 0)), 0.)
+{
+    CV_Assert(channels == 1 || channels == 3);
+    CV_Assert(depth == CV_8U || depth == CV_16U || depth == CV_32F);
+    for (int c = 0; c < 4; c++)
+    {
+        mins[c] = std::numeric_limits<float>::max();
+        maxs[c] = -std::numeric_limits<float>::max();
+    }
+}
+
+cv::Mat IngestStream::add(const cv::Mat &raw, const int row0, const bool swapRB)
+{
+    CV_Assert(raw.depth() == depth && raw.channels() == data.channels() && raw.cols == data.cols);
+    CV_Assert(row0 >= 0 && row0 + raw.rows <= data.rows);
+
+    cv::Mat dst = data.rowRange(row0, row0 + raw.rows);
+
+    if (depth == CV_8U)
+        ingestRows<uchar>(raw, dst, counts, nbins, mins, maxs, mutex, swapRB);
+    else if (depth == CV_16U)
+        ingestRows<ushort>(raw, dst, counts, nbins, mins, maxs, mutex, swapRB);
+    else
+        ingestRows<float>(raw, dst, counts, nbins, mins, maxs, mutex, swapRB);
+    return dst;
+}
+
+void IngestStream::finish(PipelineImage &image)
+{
+    const int cn = data.channels();
+
+    // as cv::normalize, the minimum and maximum are taken over all channels
+    double immin = mins[0], immax = maxs[0];
+    for (int c = 1; c < cn; c++)
+    {
+        immin = mins[c] < immin ? mins[c] : immin;
+        immax = maxs[c] > immax ? maxs[c] : immax;
+    }
+
+    image = PipelineImage(data);
+    double sc = immax - immin > DBL_EPSILON ? 1. / (immax - immin) : 0.;
+    image.affine(cv::Scalar::all(sc), cv::Scalar::all(-immin * sc));
+
+    if (nbins == 0)
+        return;
+
+    // every raw value falls into exactly one bin of the normalized histogram,
+    // computed with the same arithmetic as ParallelHist
+    const float s = (float)image.scale[0];
+    const float o = (float)image.offset[0];
+    image.hists.resize(cn);
+    for (int c = 0; c < cn; c++)
+    {
+        image.hists[c] = bufferPool().get(65536, 1, CV_32F);
+        image.hists[c].setTo(cv::Scalar::all(0.));
+        float* h = image.hists[c].ptr<float>(0);
+        for (int k = 0; k < nbins; k++)
+        {
+            if (counts[c * nbins + k] == 0.)
+                continue;
+            float v = (float)k * s + o;
+            if (v >= 0.f && v < 1.f)
+                h[(int)(v * 65536.f)] += (float)counts[c * nbins + k];
+        }
+    }
+}
+
+void ingestImage(const cv::Mat &raw, PipelineImage &image)
+{
+    IngestStream ingest(raw.rows, raw.cols, raw.channels(), raw.depth());
+    ingest.add(raw, 0);
+    ingest.finish(image);
+}
+
+/*
+void setBlackPoint(cv::InputArray inImage, cv::OutputArray outImage, float bp)
+{
+    cv::subtract(inImage, cv::Scalar::all(bp), outImage);
+    cv::divide(outImage, cv::Scalar::all(1 - bp), outImage);
+    cv::max(outImage, 0, outImage);
+}*/
+
+
+// Should the split images be used troughout??!
+// would it be benefitial to use calcHist on all channels and
+//    to run through the for loop once?
+//    or to use parallel_for_?
+
+
+/**
+ * @brief Class with the code for finding the maximum luminance to be run by OpenCV's parallel_for_
+ * The luminance is the sum of the channels (clipped to be larger than 0) with the pending transform applied.
+ *
+ */
+class ParallelLumMax : public cv::ParallelLoopBody
+{
+    public:
+        /**
+         * @brief Construct a new Parallel Lum Max object
+         *
+         * @param image Image with the pending transform (CV_32FC3)
+         * @param maxlum Maximum of the luminance
+         * @param mutex Mutex protecting the maximum
+         * @param row_split Number of rows in each group of rows which are processed in parallel
+         */
+        ParallelLumMax (const PipelineImage &image, float &maxlum, std::mutex &mutex, const int row_split) :
+            ima(image.data), maxlum(maxlum), mutex(mutex), row_split(row_split)
+        {
+            for (int c = 0; c < 3; c++)
+            {
+                s[c] = (float)image.scale[c];
+                o[c] = (float)image.offset[c];
+                l[c] = (float)image.lower[c];
+            }
+        }
+        virtual void operator ()(const cv::Range &range) const override
+        {
+            float localmax = 0.;
+
+            for (int n = range.start; n < range.end; n++)
+            {
+                int start = n * row_split;
+                int stop = start + row_split;
+                stop = stop < ima.rows ? stop : ima.rows;
+
+                for (int row = start; row < stop; row++)
+                {
+                    const float* p = ima.ptr<float>(row);
+
+                    for (int col = 0; col < ima.cols; col++)
+                    {
+                        float lum = 0.;
+                        for (int c = 0; c < 3; c++)
+                        {
+                            float v = p[c] * s[c] + o[c];
+                            lum += v < l[c] ? l[c] : v;
+                        }
+                        localmax = lum > localmax ? lum : localmax;
+                        p += 3;
+                    }
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            maxlum = localmax > maxlum ? localmax : maxlum;
+        }
+        ParallelLumMax &operator=(const ParallelLumMax &)
+        {
+            return *this;
+        };
+    private:
+        const cv::Mat &ima;
+        float &maxlum;
+        std::mutex &mutex;
+        float s[3], o[3], l[3];
+        int row_split;
+};
+
+/**
+ * @brief Class with the code for the color correction to be run by OpenCV's parallel_for_
+ * The pending transform of the image is applied on the fly and the colour enhancement factor
+ * is calculated for each pixel from its luminance. In tiles marked to be skipped only the
+ * pending transform is applied.
+ *
+ * @tparam T Type of the reference image (float, or ushort scaled to 65535)
+ */
+template <typename T>
+class ParallelColorCorr : public cv::ParallelLoopBody
+{
+    public:
+        /**
+         * @brief Construct a new Parallel Color Corr object
+         *
+         * @param image Input background subtracted stretched image with the pending transform, the data is overwritten with the result
+         * @param ref Input reference image (not background subtracted yet)
+         * @param zeroskyred Red target sky level that which was used in the background subtraction
+         * @param zeroskygreen Green target sky level that which was used in the background subtraction
+         * @param zeroskyblue Blue target sky level that which was used in the background subtraction
+         * @param ref_limit Lower limit for the values in the reference image
+         * @param maxlum Maximum luminance of the image
+         * @param cfactor Colour enhancement factor for the brightest pixels
+         * @param skip Tiles to be skipped (CV_8U, one element per tile, or empty)
+         * @param tile Size of the tiles in pixels
+         * @param fast Switch for the fast approximation of pow
+         * @param row_split Number of rows in each group of rows which are processed in parallel
+         */
+        ParallelColorCorr (PipelineImage &image, const cv::Mat &ref, const float zeroskyred, const float zeroskygreen,
+                           const float zeroskyblue, const float ref_limit, const float maxlum, const float cfactor,
+                           const cv::Mat &skip, const int tile, const bool fast, const int row_split) : ima(image.data),
+            ref(ref), skip(skip), zeroskyred(zeroskyred), zeroskygreen(zeroskygreen), zeroskyblue(zeroskyblue),
+            ref_limit(ref_limit), maxlum(maxlum), cfactor(cfactor), unit(ref.depth() == CV_16U ? 1.f / 65535.f : 1.f),
+            tile(tile), fast(fast), row_split(row_split)
+        {
+            for (int c = 0; c < 3; c++)
+            {
+                s[c] = (float)image.scale[c];
+                o[c] = (float)image.offset[c];
+                l[c] = (float)image.lower[c];
+            }
+        }
+        virtual void operator ()(const cv::Range &range) const override
+        {
+            for (int n = range.start; n < range.end; n++)
+            {
+                int start = n * row_split;
+                int stop = start + row_split;
+                stop = stop < ima.rows ? stop : ima.rows;
+
+                for (int row = start; row < stop; row++)
+                {
+                    float* p = ima.ptr<float>(row);
+                    const T* q = ref.ptr<T>(row);
+                    const uchar* sk = skip.empty() ? 0 : skip.ptr<uchar>(row / tile);
+
+                    for (int col = 0; col < ima.cols; col++)
+                    {
+                        if (sk && sk[col / tile])
+                        {
+                            // the reference is at the sky level, only apply the pending transform
+                            const int stop_col = std::min((col / tile + 1) * tile, ima.cols);
+                            for (; col < stop_col; col++)
+                            {
+                                for (int c = 0; c < 3; c++)
+                                {
+                                    float v = p[c] * s[c] + o[c];
+                                    p[c] = v < l[c] ? l[c] : v;
+                                }
+                                p += 3;
+                                q += 3;
+                            }
+                            col--;
+                            continue;
+                        }
+
+                        float b = p[0] * s[0] + o[0];
+                        float g = p[1] * s[1] + o[1];
+                        float r = p[2] * s[2] + o[2];
+                        b = b < l[0] ? l[0] : b;
+                        g = g < l[1] ? l[1] : g;
+                        r = r < l[2] ? l[2] : r;
+
+                        float b_ref = q[0] * unit - zeroskyblue;
+                        float g_ref = q[1] * unit - zeroskygreen;
+                        float r_ref = q[2] * unit - zeroskyred;
+
+                        r_ref = r_ref < ref_limit ? ref_limit : r_ref;
+                        g_ref = g_ref < ref_limit ? ref_limit : g_ref;
+                        b_ref = b_ref < ref_limit ? ref_limit : b_ref;
+
+                        float lum = r + g + b;
+                        lum = lum < 0. ? 0. : lum;
+                        const float t = lum / maxlum;
+                        const float cfe = ((fast ? fastPow(t, 0.2f) : std::pow(t, 0.2f)) + 0.3f) / 1.3f * cfactor;
+
+                        if (r >= g && r >= b)
+                        {
+                            float grratio = g_ref / r_ref / g * r;
+                            float brratio = b_ref / r_ref / b * r;
+
+                            grratio = grratio > 1.0 ? 1.0 : (grratio < 0.2 ? 0.2 : grratio);
+                            brratio = brratio > 1.0 ? 1.0 : (brratio < 0.2 ? 0.2 : brratio);
+
+                            g = g * ( (grratio - 1.) * cfe  + 1.) ;
+                            b = b * ( (brratio - 1.) * cfe  + 1.) ;
+                        }
+                        else if (g > r && g >= b)
+                        {
+                            float rgratio = r_ref / g_ref / r * g;
+                            float bgratio = b_ref / g_ref / b * g;
+
+                            rgratio = rgratio > 1.0 ? 1.0 : (rgratio < 0.2 ? 0.2 : rgratio);
+                            bgratio = bgratio > 1.0 ? 1.0 : (bgratio < 0.2 ? 0.2 : bgratio);
+
+                            r = r * ( (rgratio - 1.) * cfe  + 1.) ;
+                            b = b * ( (bgratio - 1.) * cfe  + 1.) ;
+                        }
+                        else
+                        {
+                            float rbratio = r_ref / b_ref / r * b;
+                            float gbratio = g_ref / b_ref / g * b;
+
+                            rbratio = rbratio > 1.0 ? 1.0 : (rbratio < 0.2 ? 0.2 : rbratio);
+                            gbratio = gbratio > 1.0 ? 1.0 : (gbratio < 0.2 ? 0.2 : gbratio);
+
+                            r = r * ( (rbratio - 1.) * cfe  + 1.) ;
+                            g = g * ( (gbratio - 1.) * cfe  + 1.) ;
+                        }
+
+                        p[0] = b;
+                        p[1] = g;
+                        p[2] = r;
+
+                        p += 3;
+                        q += 3;
+                    }
+
+                }
+            }
+        }
+        ParallelColorCorr &operator=(const ParallelColorCorr &)
+        {
+            return *this;
+        };
+    private:
+        cv::Mat &ima;
+        const cv::Mat &ref, &skip;
+        float zeroskyred, zeroskygreen, zeroskyblue, ref_limit, maxlum, cfactor, unit;
+        float s[3], o[3], l[3];
+        int tile;
+        bool fast;
+        int row_split;
+};
+
+/**
+ * @brief Class with the code for setting the minimum to be run by OpenCV's parallel_for_
+ * The pending transform is applied on the fly. For each tile and channel the pixels are
+ * either all above the limit, all below it, or have to be tested one by one. Tiles above the
+ * limit in all channels are skipped if there is no pending transform.
+ *
+ */
+template <int CN>
+class ParallelSetMin : public cv::ParallelLoopBody
+{
+    public:
+        /**
+         * @brief Construct a new Parallel Set Min object
+         * The pixel values in the channels below a limit are set to X = limit + X * zfac
+         *
+         * @param image Image with the pending transform, the data is overwritten with the result
+         * @param state State of each tile and channel (CV_8U with the channels of the image, one element per tile:
+         *        0 test each pixel, 1 all above the limit, 2 all below the limit)
+         * @param tile Size of the tiles in pixels
+         * @param row_split Number of rows in each group of rows which are processed in parallel
+         * @param limits Limits for each channel
+         * @param zfac Dampening factor
+         */
+        ParallelSetMin (PipelineImage &image, const cv::Mat &state, const int tile, const int row_split,
+                        const float* limits, const float zfac) : ima(image.data), state(state), tile(tile),
+            row_split(row_split), identity(!image.pending()), zx(zfac)
+        {
+            for (int c = 0; c < 4; c++)
+            {
+                s[c] = (float)image.scale[c];
+                o[c] = (float)image.offset[c];
+                l[c] = (float)image.lower[c];
+                m[c] = c < 3 ? limits[c] : 0;
+            }
+        }
+
+        virtual void operator ()(const cv::Range &range) const override
+        {
+            for (int n = range.start; n < range.end; n++)
+            {
+                int start = n * row_split;
+                int stop = start + row_split;
+                stop = stop < ima.rows ? stop : ima.rows;
+
+                for (int row = start; row < stop; row++)
+                {
+                    float* p = ima.ptr<float>(row);
+                    const uchar* st = state.ptr<uchar>(row / tile);
+
+                    for (int col0 = 0; col0 < ima.cols; col0 += tile)
+                    {
+                        const uchar* t = st + col0 / tile * CN;
+                        const int col1 = col0 + tile < ima.cols ? col0 + tile : ima.cols;
+
+                        // the pixels of the tile would be written back unchanged
+                        bool above = identity;
+                        for (int c = 0; c < CN; c++)
+                            above = above && t[c] == 1;
+                        if (above)
+                        {
+                            p += (col1 - col0) * CN;
+                            continue;
+                        }
+
+                        for (int col = col0; col < col1; col++)
+                        {
+                            for (int c = 0; c < CN; c++)
+                            {
+                                float v = *p * s[c] + o[c];
+                                v = v < l[c] ? l[c] : v;
+                                if (t[c] == 2 || (t[c] == 0 && v < m[c]))
+                                    v = m[c] + zx * v;
+                                *p = v;
+                                p++;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        ParallelSetMin &operator=(const ParallelSetMin &)
+        {
+            return *this;
+        };
+    private:
+        cv::Mat &ima;
+        const cv::Mat &state;
+        int tile, row_split;
+        bool identity;
+        float s[4], o[4], l[4], m[4];
+        float zx;
+};
+
+
+inline int skyDN(
+    cv::InputArray inHist, const float skylevelfactor, float &skylevel)
+{
+    cv::Mat histH = inHist.getMat();
+
+    cv::Point maxloc;
+    int chistskydn = 0;
+    double histGmax;
+
+    cv::minMaxLoc(histH, 0, &histGmax, 0, &maxloc);
+    if(skylevel < 0)
+    {
+        skylevel = (float)histGmax * skylevelfactor;
+    }
+
+    const float* p = histH.ptr<float>(0, maxloc.y);
+    for (int ih = maxloc.y; ih >= 2; ih--)
     {
-        int border = CV_MAJOR_VERSION > 3 ? cv::BORDER_ISOLATED : cv::BORDER_REFLECT;
-        cv::blur(hist, hist, cv::Size(1, 601), cv::Point(-1, -1), border);
+        float top = *p;
+        p--;
+        float bottom = *p;
+        if (top >= skylevel && bottom <= skylevel)
+        {
+            chistskydn = ih;
+            break;
+        }
     }
+    return chistskydn;
 }
 
-/*
-void setBlackPoint(cv::InputArray inImage, cv::OutputArray outImage, float bp)
-{
-    cv::subtract(inImage, cv::Scalar::all(bp), outImage);
-    cv::divide(outImage, cv::Scalar::all(1 - bp), outImage);
-    cv::max(outImage, 0, outImage);
-}*/
-
-
-// Should the split images be used troughout??!
-// would it be benefitial to use calcHist on all channels and
-//    to run through the for loop once?
-//    or to use parallel_for_?
-
 
 /**
- * @brief Class with the code for the color correction to be run by OpenCV's parallel_for_
+ * @brief Class with the code for applying a curve to each pixel value to be run by OpenCV's parallel_for_
+ * The pending transform is applied before the curve.
  *
  */
-class ParallelColorCorr : public cv::ParallelLoopBody
+template <int CN, typename Curve>
+class ParallelCurve : public cv::ParallelLoopBody
 {
     public:
         /**
-         * @brief Construct a new Parallel Color Corr object
+         * @brief Construct a new Parallel Curve object
          *
-         * @param r_bg Input background subtracted stretched red iamge
-         * @param g_bg Input background subtracted stretched green iamge
-         * @param b_bg Input background subtracted stretched blue iamge
-         * @param r_bg_ref Input background subtracted red reference iamge
-         * @param g_bg_ref Input background subtracted green reference iamge
-         * @param b_bg_ref Input background subtracted blue reference iamge
-         * @param cfe Input matrix with the color correction factor (depending on user choice and luminosity of the pixel)
-         * @param zeroskyred Red target sky level that which was used in the background subtraction
-         * @param zeroskygreen Green target sky level that which was used in the background subtraction
-         * @param zeroskyblue Blue target sky level that which was used in the background subtraction
-         * @param ref_limit Lower limit for the values in the reference image
-         * @param row_split Number of groups of rows which can be processed in parallel
+         * @param image Image with the pending transform, the data is overwritten with the result
+         * @param curve Curve
+         * @param row_split Number of rows in each group of rows which are processed in parallel
          */
-        ParallelColorCorr (cv::Mat &r_bg, cv::Mat &g_bg, cv::Mat &b_bg, cv::Mat &r_bg_ref, cv::Mat &g_bg_ref, cv::Mat &b_bg_ref,
-                           cv::Mat &cfe, const float zeroskyred, const float zeroskygreen, const float zeroskyblue, const float ref_limit,
-                           const int row_split) : r_bg(r_bg), g_bg(g_bg), b_bg(b_bg), r_bg_ref(r_bg_ref), g_bg_ref(g_bg_ref), b_bg_ref(b_bg_ref),
-            cfe(cfe), zeroskyred(zeroskyred), zeroskygreen(zeroskygreen), zeroskyblue(zeroskyblue), ref_limit(ref_limit),
-            row_split(row_split)
-        {}
+        ParallelCurve (PipelineImage &image, const Curve &curve, const int row_split) : ima(image.data),
+            curve(curve), row_split(row_split)
+        {
+            for (int c = 0; c < 4; c++)
+            {
+                s[c] = (float)image.scale[c];
+                o[c] = (float)image.offset[c];
+                l[c] = (float)image.lower[c];
+            }
+        }
         virtual void operator ()(const cv::Range &range) const override
         {
             for (int n = range.start; n < range.end; n++)
             {
                 int start = n * row_split;
                 int stop = start + row_split;
-                stop = stop < r_bg.rows ? stop : r_bg.rows;
+                stop = stop < ima.rows ? stop : ima.rows;
 
                 for (int row = start; row < stop; row++)
                 {
-                    float* r = r_bg.ptr<float>(row);
-                    float* g = g_bg.ptr<float>(row);
-                    float* b = b_bg.ptr<float>(row);
+                    float* p = ima.ptr<float>(row);
+
+                    for (int col = 0; col < ima.cols; col++)
+                    {
+                        for (int c = 0; c < CN; c++)
+                        {
+                            float v = *p * s[c] + o[c];
+                            v = v < l[c] ? l[c] : v;
+                            *p = curve(v);
+                            p++;
+                        }
+                    }
+                }
+            }
+        }
+        ParallelCurve &operator=(const ParallelCurve &)
+        {
+            return *this;
+        };
+    private:
+        cv::Mat &ima;
+        const Curve &curve;
+        float s[4], o[4], l[4];
+        int row_split;
+};
 
-                    float* r_ref = r_bg_ref.ptr<float>(row);
-                    float* g_ref = g_bg_ref.ptr<float>(row);
-                    float* b_ref = b_bg_ref.ptr<float>(row);
+/**
+ * @brief Applies a curve with the kernel for the number of channels of the image
+ *
+ * @param image Image with the pending transform
+ * @param curve Curve
+ */
+template <typename Curve>
+static void curveRows(PipelineImage &image, const Curve &curve)
+{
+    const int split = 8;
+    const int row_split = (image.data.rows + split - 1) / split;
 
-                    float* cfef = cfe.ptr<float>(row);
+    parallelChannels<ParallelCurve, Curve>(image.data.channels(), split, image, curve, row_split);
+    image.modified();
+}
 
-                    for (int col = 0; col < r_bg.cols; col++)
-                    {
-                        *r_ref -= zeroskyred;
-                        *g_ref -= zeroskygreen;
-                        *b_ref -= zeroskyblue;
+void toneCurve(cv::InputArray inImage, cv::OutputArray outImage)
+{
+    /// X*b*(1/12.)^(X^0.4)
+    /// uses: b^z = exp( z * ln b )
+    float fac = log(1.0 / 12.0);
+    float b = 12.0;
 
-                        *r_ref = *r_ref < ref_limit ? ref_limit : *r_ref;
-                        *g_ref = *g_ref < ref_limit ? ref_limit : *g_ref;
-                        *b_ref = *b_ref < ref_limit ? ref_limit : *b_ref;
+    cv::Mat tmpImage, tmpImage3; // TBD UMat or Mat?
+    cv::pow(inImage, 0.4, tmpImage3);
+    cv::multiply(tmpImage3, fac, tmpImage);
+    cv::exp(tmpImage, tmpImage3);
+    cv::multiply(inImage, tmpImage3, tmpImage);
+    cv::multiply(tmpImage, b, outImage);
+}
 
-                        if (*r >= *g && *r >= *b)
-                        {
-                            float grratio = *g_ref / *r_ref / *g * *r;
-                            float brratio = *b_ref / *r_ref / *b * *r;
 
-                            grratio = grratio > 1.0 ? 1.0 : (grratio < 0.2 ? 0.2 : grratio);
-                            brratio = brratio > 1.0 ? 1.0 : (brratio < 0.2 ? 0.2 : brratio);
+void toneCurve(PipelineImage &image)
+{
+    curveRows(image, ToneCurve(fastmath));
+}
 
-                            *g = *g * ( (grratio - 1.) * *cfef  + 1.) ;
-                            *b = *b * ( (brratio - 1.) * *cfef  + 1.) ;
-                        }
-                        else if (*g > *r && *g >= *b)
-                        {
-                            float rgratio = *r_ref / *g_ref / *r * *g;
-                            float bgratio = *b_ref / *g_ref / *b * *g;
 
-                            rgratio = rgratio > 1.0 ? 1.0 : (rgratio < 0.2 ? 0.2 : rgratio);
-                            bgratio = bgratio > 1.0 ? 1.0 : (bgratio < 0.2 ? 0.2 : bgratio);
+/**
+ * @brief Expected error of the sky levels found in blurred histograms of a sample of the pixels
+ * The number of samples in the blur window at the sky level has a Poisson error of its square root,
+ * which shifts the crossing of the sky level by that error divided by the slope of the histogram.
+ * The sky level is taken from the green channel as in skySubStep().
+ *
+ * @param hists Blurred histograms of the sample
+ * @param skylevelfactor Skylevel will be considered to be the skylevelfactor times the value corresponding to the histogram maximum
+ * @return Largest expected error over the channels in bins (infinity if a sky level is not found
+ *         or a second peak almost reaches the maximum)
+ */
+static double skySampleError(const std::vector<cv::Mat> &hists, const float skylevelfactor)
+{
+    const double unusable = std::numeric_limits<double>::infinity();
+    const cv::Rect roi = cv::Rect(0, 400, 1, 65100);
+    const int cn = (int)hists.size();
+    const int order[3] = {1, 2, 0};
+
+    float skylevel = -1.;
+    double error = 0.;
+    for (int i = 0; i < cn; i++)
+    {
+        const cv::Mat h = hists[cn == 3 ? order[i] : i](roi);
+
+        // with another sample a second peak of about the same height could become the maximum
+        cv::Point maxloc;
+        double peak, second = 0., m;
+        cv::minMaxLoc(h, 0, &peak, 0, &maxloc);
+        const int lo = std::max(maxloc.y - histBlur, 0), hi = std::min(maxloc.y + histBlur, h.rows);
+        if (lo > 0)
+        {
+            cv::minMaxLoc(h.rowRange(0, lo), 0, &m);
+            second = std::max(second, m);
+        }
+        if (hi < h.rows)
+        {
+            cv::minMaxLoc(h.rowRange(hi, h.rows), 0, &m);
+            second = std::max(second, m);
+        }
+        if (peak <= 0. || second > 0.9 * peak)
+            return unusable;
+
+        const int k = skyDN(h, skylevelfactor, skylevel);
+        if (k == 0)
+            return unusable;
+
+        // samples in the blur window at the sky level and their change per bin
+        const int d = histBlur / 4;
+        const int k0 = std::max(k - d, 0), k1 = std::min(k + d, h.rows - 1);
+        const double n = skylevel * histBlur;
+        const double slope = (h.at<float>(k1) - h.at<float>(k0)) / (k1 - k0) * histBlur;
+        if (slope <= 0.)
+            return unusable;
+        error = std::max(error, std::sqrt(n) / slope);
+    }
+    return error;
+}
 
-                            *r = *r * ( (rgratio - 1.) * *cfef  + 1.) ;
-                            *b = *b * ( (bgratio - 1.) * *cfef  + 1.) ;
-                        }
-                        else
-                        {
-                            float rbratio = *r_ref / *b_ref / *r * *b;
-                            float gbratio = *g_ref / *b_ref / *g * *b;
+/**
+ * @brief Blurred histograms for an iteration of the sky subtraction
+ * Known histograms of the image are used. Otherwise, with sampled histograms switched on (see
+ * setSampledHists()) and a large image, the histograms are estimated from one pixel in each block of
+ * about a million blocks. The blocks are made smaller until the expected error of the sky level is
+ * at most 2 (in 16bit). If that fails, the full histograms are calculated and kept in the image,
+ * e.g. for the display. The summary in tiles is always determined from all pixels.
+ *
+ * @param image Image with the pending transform
+ * @param hists Output blurred histograms
+ * @param skylevelfactor Skylevel will be considered to be the skylevelfactor times the value corresponding to the histogram maximum
+ */
+static void skyHists(PipelineImage &image, std::vector<cv::Mat> &hists, const float skylevelfactor)
+{
+    const double maxError = 2.;
+    const double samples = 1 << 20;
 
-                            rbratio = rbratio > 1.0 ? 1.0 : (rbratio < 0.2 ? 0.2 : rbratio);
-                            gbratio = gbratio > 1.0 ? 1.0 : (gbratio < 0.2 ? 0.2 : gbratio);
+    if (sampledhists && (int)image.hists.size() != image.data.channels())
+    {
+        // the sample leaves out the summary for skipping tiles in colorcorr and setMin, it is
+        // determined once for the data in a pass without binning
+        if (image.tiles.empty()) calcTiles(image.data, image.tiles);
+
+        const double pixels = (double)image.data.rows * image.data.cols;
+        for (int stride = (int)std::sqrt(pixels / samples); stride >= 2; stride /= 2)
+        {
+            cv::Scalar below;
+            calcHists(image, hists, below, 0, stride);
+            blurHists(hists);
+            if (skySampleError(hists, skylevelfactor) <= maxError)
+                return;
+        }
+    }
+
+    updateHists(image);
+    hist(image, hists, true);
+}
+
+/**
+ * @brief One iteration of the sky subtraction for a single channel
+ *
+ * @param histh Blurred histogram
+ * @param skylevelfactor Skylevel will be considered to be the skylevelfactor times the value corresponding to the histogram maximum
+ * @param sky Target sky value (in 16bit, i.e. between 0 and 65535)
+ * @param s Output scale
+ * @param o Output offset
+ * @return true if the sky level is within 5 of the target (s and o are not set)
+ */
+static bool skySubStep1Ch(const cv::Mat &histh, const float skylevelfactor, const float sky, cv::Scalar &s,
+                          cv::Scalar &o)
+{
+    cv::Rect roi = cv::Rect(0, 400, 1, 65100);
+    cv::Mat hist_cropped = histh(roi);
+
+    float skylevel = -1.;
+    int chistskydn;
+    chistskydn = skyDN(hist_cropped, skylevelfactor, skylevel) + 400;
+
+    if (pow(chistskydn - sky, 2) <= 25)
+        return true;
+
+    float chistskysub1 = (chistskydn - sky ) / 65535.;
+
+    float cfscale = 1.0 / (1.0 - chistskysub1);
+
+    s = cv::Scalar::all(cfscale);
+    o = cv::Scalar::all(-chistskysub1 * cfscale);
+    return false;
+}
+
+void CVskysub1Ch(PipelineImage &image, const float skylevelfactor, const float sky, const bool out)
+{
+    if(out) std::cout << "  Sky sub iteration " << std::flush;
+    std::vector<cv::Mat> histh;
+    for (int i = 1; i <= 25; i++)
+    {
+        if(out) std::cout << "|" << std::flush;
+
+        // unless they are sampled, the histograms stay cached in the image, e.g. for the display
+        skyHists(image, histh, skylevelfactor);
+
+        cv::Scalar s, o;
+        if (skySubStep1Ch(histh[0], skylevelfactor, sky, s, o))
+            break;
+
+        image.affine(s, o);
+    }
+    if(out) std::cout << std::endl;
+    bufferPool().put(histh);
+
+    image.clampBelow(0.0);
+}
+
+void CVskysub1Ch(cv::InputArray inImage, cv::OutputArray outImage,
+                 const float skylevelfactor, const float sky, const bool out)
+{
+    PipelineImage image(inImage.getMat());
+    CVskysub1Ch(image, skylevelfactor, sky, out);
+    image.apply(outImage);
+}
+
+/**
+ * @brief One iteration of the sky subtraction for the three channels
+ *
+ * @param bgr_hists Blurred histograms of the blue, green and red channel
+ * @param skylevelfactor Skylevel will be considered to be the skylevelfactor times the value corresponding to the histogram maximum
+ * @param skyLR Target red sky value (in 16bit, i.e. between 0 and 65535)
+ * @param skyLG Target green sky value (in 16bit, i.e. between 0 and 65535)
+ * @param skyLB Target blue sky value (in 16bit, i.e. between 0 and 65535)
+ * @param i Number of the iteration (starting with 1)
+ * @param warn Switch for warnings if the sky level is not found
+ * @param s Output scale for each channel
+ * @param o Output offset for each channel
+ * @return true if the sky levels are within 5 of the targets (s and o are not set)
+ */
+static bool skySubStep(const std::vector<cv::Mat> &bgr_hists, const float skylevelfactor, const float skyLR,
+                       const float skyLG, const float skyLB, const int i, const bool warn, cv::Scalar &s,
+                       cv::Scalar &o)
+{
+    // Histrograms are igroring the first 400 and last about 400 bins
+    // to avoid problems with saturated or clipped pixels
+    cv::Rect roi = cv::Rect(0, 400, 1, 65100);
+    cv::Mat r_hist_cropped = bgr_hists[2](roi);
+    cv::Mat g_hist_cropped = bgr_hists[1](roi);
+    cv::Mat b_hist_cropped = bgr_hists[0](roi);
+
+    float skylevel = -1.;
+    int chistredskydn, chistgreenskydn, chistblueskydn;
+
+    // Green is the reference channel
+    // offset the value by 400 to account fot the clipping of the histogram above
+    chistgreenskydn = skyDN(g_hist_cropped, skylevelfactor, skylevel) + 400;
+    chistredskydn = skyDN(r_hist_cropped, skylevelfactor, skylevel) + 400;
+    chistblueskydn = skyDN(b_hist_cropped, skylevelfactor, skylevel) + 400;
+
+    if (  warn && i > 1 && (chistredskydn == 400 ))
+    {
+        std::cout << "    WARNING: histogram sky level red not found" << std::endl;
+        //std::cout << "    Try increasing the -zerosky values" << std::endl;
+        // break;
+    }
+    if (  warn && i > 1 && chistgreenskydn == 400)
+    {
+        std::cout << "    WARNING: histogram sky level green not found" << std::endl;
+        //std::cout << "    Try increasing the -zerosky values" << std::endl;
+        // break;
+    }
+    if (  warn && i > 1 && (chistblueskydn == 400))
+    {
+        std::cout << "    WARNING: histogram sky level blue not found" << std::endl;
+        //std::cout << "    Try increasing the -zerosky values" << std::endl;
+        // break;
+    }
+
+    // Condition to stop when the value is within 5 pxiels after the first iteration
+    if (pow(chistgreenskydn - skyLG, 2) <= 25 &&
+            pow(chistredskydn - skyLR, 2) <= 25 &&
+            pow(chistblueskydn - skyLB, 2) <= 25 && i > 1)
+        return true;
+
+    float chistredskysub1 = (chistredskydn - skyLR) / 65535.;
+    float chistgreenskysub1 = (chistgreenskydn - skyLG) / 65535.;
+    float chistblueskysub1 = (chistblueskydn - skyLB) / 65535.;
+
+    // normalizatons
+    float cfscalered = 1.0 / (1.0 - chistredskysub1);
+    float cfscalegreen = 1.0 / (1.0 - chistgreenskysub1);
+    float cfscaleblue = 1.0 / (1.0 - chistblueskysub1);
+
+    s = cv::Scalar(cfscaleblue, cfscalegreen, cfscalered);
+    o = cv::Scalar(-chistblueskysub1 * cfscaleblue, -chistgreenskysub1 * cfscalegreen,
+                   -chistredskysub1 * cfscalered);
+    return false;
+}
+
+// TBD UMat or Mat?
+void CVskysub(PipelineImage &image, const float skylevelfactor, const float skyLR,
+              const float skyLG, const float skyLB, const bool out)
+{
+    if(image.data.channels() == 1)
+    {
+        CVskysub1Ch(image, skylevelfactor, skyLR);
+        return;
+    }
+
+    if(out) std::cout << "    Sky sub iteration " << std::flush;
+    std::vector<cv::Mat> bgr_hists;
+    for (int i = 1; i <= 25; i++)
+    {
+        if(out) std::cout << "|" << std::flush;
+        // histograms use 65535 bins corresponding to 16bits (pixel values should be in the range from 0 to 1)
+        // all channels are binned in the same pass, with the pending transform applied on the fly
+        // unless they are sampled, the histograms stay cached in the image, e.g. for the display
+        skyHists(image, bgr_hists, skylevelfactor);
+
+        cv::Scalar s, o;
+        if (skySubStep(bgr_hists, skylevelfactor, skyLR, skyLG, skyLB, i, true, s, o))
+            break;
+
+        // X = (X - sub) * scale, only the pending transform is updated
+        image.affine(s, o);
+    }
+    if(out) std::cout << std::endl;
+    bufferPool().put(bgr_hists);
+
+    image.clampBelow(0.0);
+}
+
+void CVskysub(PipelineImage &image, PipelineImage &roi, const float skylevelfactor, const float skyLR,
+              const float skyLG, const float skyLB, const bool out, SolvedParams *params)
+{
+    cv::Scalar s = cv::Scalar::all(1.), o = cv::Scalar::all(0.);
+    if (params && params->replay)
+    {
+        s = params->skysubs.at(params->nextSkysub).first;
+        o = params->skysubs.at(params->nextSkysub).second;
+        params->nextSkysub++;
+        image.affine(s, o);
+        image.clampBelow(0.0);
+    }
+    else
+    {
+        const cv::Scalar s0 = image.scale, o0 = image.offset;
+        if (params && params->nextSeed < params->seeds.size())
+        {
+            image.affine(params->seeds[params->nextSeed].first, params->seeds[params->nextSeed].second);
+            params->nextSeed++;
+        }
+        CVskysub(image, skylevelfactor, skyLR, skyLG, skyLB, out);
+
+        // the subtraction is the affine step between the transforms before and after it,
+        // followed by the clamp at 0
+        for (int c = 0; c < image.data.channels(); c++)
+        {
+            if (s0[c] == 0.) continue;
+            s[c] = image.scale[c] / s0[c];
+            o[c] = image.offset[c] - o0[c] * s[c];
+        }
+        if (params) params->skysubs.push_back(std::make_pair(s, o));
+    }
+
+    if (roi.data.empty()) return;
+    roi.affine(s, o);
+    roi.clampBelow(0.0);
+}
+
+void CVskysub(cv::InputArray inImage, cv::OutputArray outImage,
+              const float skylevelfactor, const float skyLR,
+              const float skyLG,
+              const float skyLB, const bool out)
+{
+    PipelineImage image(inImage.getMat());
+    CVskysub(image, skylevelfactor, skyLR, skyLG, skyLB, out);
+    image.apply(outImage);
+}
+
+
+StretchSettings::StretchSettings() : skylevelfactor(0.06), skyLR(4096.0), skyLG(4096.0), skyLB(4096.0),
+    rootiter(1), rootpower2(0.), scurveiter(0), scurvepower1(5.0), scurveoffset1(0.42), scurvepower2(3.0),
+    scurveoffset2(0.22)
+{
+}
+
+/**
+ * @brief Pixel values of the occupied histogram bins with their counts
+ *
+ */
+struct BinValues
+{
+    /// Number of channels
+    int cn;
+    /// Pixel values for each channel
+    std::vector<float> values[3];
+    /// Number of pixels with these values
+    std::vector<float> counts[3];
+};
+
+/**
+ * @brief Gets the values of the occupied bins of histograms (at the bin centres)
+ *
+ * @param hists Histograms with 65536 bins
+ * @param bins Output values with their counts
+ */
+static void binValues(const std::vector<cv::Mat> &hists, BinValues &bins)
+{
+    bins.cn = (int)hists.size();
+    for (int c = 0; c < bins.cn; c++)
+    {
+        const float* h = hists[c].ptr<float>(0);
+        for (int k = 0; k < 65536; k++)
+        {
+            if (h[k] == 0.f)
+                continue;
+            bins.values[c].push_back(((float)k + 0.5f) / 65536.f);
+            bins.counts[c].push_back(h[k]);
+        }
+    }
+}
+
+/**
+ * @brief Predicts the blurred histograms of the values after an affine transform (as hist() would calculate them)
+ *
+ * @param bins Values with their counts
+ * @param s Scale for each channel
+ * @param o Offset for each channel
+ * @param hists Output histograms
+ */
+static void binHists(const BinValues &bins, const cv::Scalar &s, const cv::Scalar &o, std::vector<cv::Mat> &hists)
+{
+    hists.resize(bins.cn);
+    int border = CV_MAJOR_VERSION > 3 ? cv::BORDER_ISOLATED : cv::BORDER_REFLECT;
+    for (int c = 0; c < bins.cn; c++)
+    {
+        hists[c] = cv::Mat::zeros(65536, 1, CV_32F);
+        float* h = hists[c].ptr<float>(0);
+        for (size_t k = 0; k < bins.values[c].size(); k++)
+        {
+            const float v = bins.values[c][k] * (float)s[c] + (float)o[c];
+            if (v >= 0.f && v < 1.f)
+                h[(int)(v * 65536.f)] += bins.counts[c][k];
+        }
+        cv::blur(hists[c], hists[c], cv::Size(1, 601), cv::Point(-1, -1), border);
+    }
+}
+
+/**
+ * @brief Predicts the values after the sky subtraction (see CVskysub())
+ *
+ * @param bins Values with their counts, transformed in place
+ * @param settings Settings with the sky parameters
+ */
+static void predictSkysub(BinValues &bins, const StretchSettings &settings)
+{
+    cv::Scalar scale = cv::Scalar::all(1.0), offset = cv::Scalar::all(0.0);
+    for (int i = 1; i <= 25; i++)
+    {
+        std::vector<cv::Mat> hists;
+        binHists(bins, scale, offset, hists);
+
+        cv::Scalar s, o;
+        bool done = bins.cn == 1 ? skySubStep1Ch(hists[0], settings.skylevelfactor, settings.skyLR, s, o) :
+                    skySubStep(hists, settings.skylevelfactor, settings.skyLR, settings.skyLG, settings.skyLB, i,
+                               false, s, o);
+        if (done)
+            break;
+
+        for (int c = 0; c < bins.cn; c++)
+        {
+            scale[c] *= s[c];
+            offset[c] = offset[c] * s[c] + o[c];
+        }
+    }
+
+    for (int c = 0; c < bins.cn; c++)
+    {
+        for (size_t k = 0; k < bins.values[c].size(); k++)
+        {
+            const float v = bins.values[c][k] * (float)scale[c] + (float)offset[c];
+            bins.values[c][k] = v < 0.f ? 0.f : v;
+        }
+    }
+}
+
+/**
+ * @brief Predicts the values after the root stretch (see stretching())
+ *
+ * @param bins Values with their counts, transformed in place
+ * @param rootpower Root power of the stretch
+ */
+static void predictStretch(BinValues &bins, const double rootpower)
+{
+    const float eps = 1.0 / 65535.0;
+    const float norm = 1. / (1. + 1.0 / 65535.);
+    const float x = 1. / rootpower;
+
+    float immin = std::numeric_limits<float>::max();
+    for (int c = 0; c < bins.cn; c++)
+    {
+        for (size_t k = 0; k < bins.values[c].size(); k++)
+        {
+            float &v = bins.values[c][k];
+            v = std::pow((v + eps) * norm, x);
+            immin = v < immin ? v : immin;
+        }
+    }
+
+    double mn = immin - 4096.0 / 65535.;
+    mn = mn > 0. ? mn : 0.;
+    for (int c = 0; c < bins.cn; c++)
+    {
+        for (size_t k = 0; k < bins.values[c].size(); k++)
+        {
+            bins.values[c][k] = (bins.values[c][k] - mn) / (1. - mn);
+        }
+    }
+}
+
+/**
+ * @brief Predicts the value of a percentile over all channels
+ *
+ * @param bins Values with their counts
+ * @param percentile Percentile (in %)
+ * @return Value of the percentile (at the centre of its 16 bit bin)
+ */
+static double predictPercentile(const BinValues &bins, const double percentile)
+{
+    std::vector<double> h(65536, 0.);
+    double total = 0.;
+    for (int c = 0; c < bins.cn; c++)
+    {
+        for (size_t k = 0; k < bins.values[c].size(); k++)
+        {
+            float v = bins.values[c][k];
+            int bin = v <= 0.f ? 0 : (v >= 1.f ? 65535 : (int)(v * 65536.f));
+            h[bin] += bins.counts[c][k];
+            total += bins.counts[c][k];
+        }
+    }
 
-                            *r = *r * ( (rbratio - 1.) * *cfef  + 1.) ;
-                            *g = *g * ( (gbratio - 1.) * *cfef  + 1.) ;
-                        }
+    double sum = 0.;
+    for (int k = 0; k < 65536; k++)
+    {
+        sum += h[k];
+        if (sum >= percentile / 100. * total)
+            return (k + 0.5) / 65536.;
+    }
+    return 1.;
+}
 
-                        r++;
-                        g++;
-                        b++;
-                        r_ref++;
-                        g_ref++;
-                        b_ref++;
-                        cfef++;
-                    }
+double autoRootpower(const PipelineImage &image, const StretchSettings &settings, const double percentile,
+                     const double target)
+{
+    std::vector<cv::Mat> hists;
+    hist(image, hists, false);
+    BinValues input;
+    binValues(hists, input);
+
+    // the percentile increases with the root power, so it is found by bisection (in log space)
+    double lo = std::log(1.), hi = std::log(1000.);
+    for (int n = 0; n < 30; n++)
+    {
+        const double rootpower = std::exp(0.5 * (lo + hi));
+        BinValues bins = input;
 
+        for (int i = 0; i < settings.rootiter; i++)
+        {
+            predictStretch(bins, i == 1 && settings.rootpower2 > 0. ? settings.rootpower2 : rootpower);
+            predictSkysub(bins, settings);
+        }
+        for (int i = 0; i < settings.scurveiter; i++)
+        {
+            SCurve curve(i % 2 == 0 ? settings.scurvepower1 : settings.scurvepower2,
+                         i % 2 == 0 ? settings.scurveoffset1 : settings.scurveoffset2, false);
+            for (int c = 0; c < bins.cn; c++)
+            {
+                for (size_t k = 0; k < bins.values[c].size(); k++)
+                {
+                    bins.values[c][k] = curve(bins.values[c][k]);
                 }
             }
+            predictSkysub(bins, settings);
         }
-        ParallelColorCorr &operator=(const ParallelColorCorr &)
-        {
-            return *this;
-        };
-    private:
-        cv::Mat &r_bg, &g_bg, &b_bg, &r_bg_ref, &g_bg_ref, &b_bg_ref, &cfe;
-        float zeroskyred, zeroskygreen, zeroskyblue, ref_limit;
-        int row_split;
-};
+
+        if (predictPercentile(bins, percentile) < target)
+            lo = std::log(rootpower);
+        else
+            hi = std::log(rootpower);
+    }
+    return std::exp(0.5 * (lo + hi));
+}
+
 
 /**
- * @brief Class with the code for setting the minimum to be run by OpenCV's parallel_for_
+ * @brief Class with the code for the root stretch to be run by OpenCV's parallel_for_
+ * The pending transform is applied before the root and the minimum of the result is determined.
+ * The root is calculated in single precision (see takeRoot()).
  *
  */
-class ParallelSetMin : public cv::ParallelLoopBody
+template <int CN>
+class ParallelStretch : public cv::ParallelLoopBody
 {
     public:
         /**
-         * @brief Construct a new Parallel Set Min object
-         * The pixel values in the channels below a limit are damped by X = X * limit * zfac
+         * @brief Construct a new Parallel Stretch object
          *
-         * @param rbg Red input image
-         * @param gbg Green input image
-         * @param bbg Blue input image
-         * @param rowsplit Number of groups of rows to be processes in parallel
-         * @param mr Red limit
-         * @param mg Grren limit
-         * @param mb Blue limit
-         * @param zfac Dampening factor
+         * @param image Image with the pending transform, the data is overwritten with the result
+         * @param x Exponent of the stretch (1/rootpower)
+         * @param immin Minimum of the result
+         * @param mutex Mutex protecting the minimum
+         * @param fast Switch for the fast approximation of pow
+         * @param row_split Number of rows in each group of rows which are processed in parallel
          */
-        ParallelSetMin ( cv::Mat &rbg, cv::Mat &gbg, cv::Mat &bbg, const int rowsplit, const float mr,  const float mg,
-                         const float mb, const float zfac) : r_bg(rbg), g_bg(gbg), b_bg(bbg), row_split(rowsplit), minr(mr), ming(mg), minb(mb),
-            zx(zfac)
+        ParallelStretch (PipelineImage &image, const float x, float &immin, std::mutex &mutex, const bool fast,
+                         const int row_split) : ima(image.data), x(x), immin(immin), mutex(mutex), fast(fast),
+            row_split(row_split)
         {
+            for (int c = 0; c < 4; c++)
+            {
+                s[c] = (float)image.scale[c];
+                o[c] = (float)image.offset[c];
+                l[c] = (float)image.lower[c];
+            }
         }
-
         virtual void operator ()(const cv::Range &range) const override
         {
+            const float eps = 1.0f / 65535.0f;
+            const float norm = 1.f / (1.f + 1.0f / 65535.f);
+            float localmin = std::numeric_limits<float>::max();
+
             for (int n = range.start; n < range.end; n++)
             {
                 int start = n * row_split;
                 int stop = start + row_split;
-                stop = stop < r_bg.rows ? stop : r_bg.rows;
+                stop = stop < ima.rows ? stop : ima.rows;
 
                 for (int row = start; row < stop; row++)
                 {
-                    float* r = r_bg.ptr<float>(row);
-                    float* g = g_bg.ptr<float>(row);
-                    float* b = b_bg.ptr<float>(row);
-
-
+                    float* p = ima.ptr<float>(row);
 
-                    for (int col = 0; col < r_bg.cols; col++)
+                    for (int col = 0; col < ima.cols; col++)
                     {
-                        if ( *r < minr ) minr * zx * *r;
-                        if ( *g < minr ) ming * zx * *g;
-                        if ( *b < minr ) minb * zx * *b;
-
-                        r++;
-                        g++;
-                        b++;
+                        for (int c = 0; c < CN; c++)
+                        {
+                            float v = *p * s[c] + o[c];
+                            v = v < l[c] ? l[c] : v;
+                            if (fast)
+                                v = fastPow((v + eps) * norm, x);
+                            else
+                                v = std::pow((v + eps) * norm, x);
+                            localmin = v < localmin ? v : localmin;
+                            *p = v;
+                            p++;
+                        }
                     }
-
                 }
             }
-        }
 
-        ParallelSetMin &operator=(const ParallelSetMin &)
+            std::lock_guard<std::mutex> lock(mutex);
+            immin = localmin < immin ? localmin : immin;
+        }
+        ParallelStretch &operator=(const ParallelStretch &)
         {
             return *this;
         };
     private:
-        cv::Mat &r_bg, &g_bg, &b_bg;
+        cv::Mat &ima;
+        float x;
+        float &immin;
+        std::mutex &mutex;
+        bool fast;
+        float s[4], o[4], l[4];
         int row_split;
-        float minr, ming, minb, zx;
 };
 
+/**
+ * @brief Runs the root stretch with the kernel for the number of channels of the image
+ *
+ * @param image Image with the pending transform
+ * @param x Exponent of the stretch (1/rootpower)
+ * @param immin Minimum of the result
+ */
+static void stretchRows(PipelineImage &image, const float x, float &immin)
+{
+    const int split = 8;
+    const int row_split = (image.data.rows + split - 1) / split;
+
+    std::mutex mutex;
+    parallelChannels<ParallelStretch>(image.data.channels(), split, image, x, immin, mutex, fastmath, row_split);
+}
 
-inline int skyDN(
-    cv::InputArray inHist, const float skylevelfactor, float &skylevel)
+/**
+ * @brief Takes the root of an image, the normalization is left to normalizeRoot()
+ *
+ * @param image Image, holds the root without a pending transform afterwards
+ * @param rootpower Root power of the stretch
+ * @return double Offset of the normalization
+ */
+static double takeRoot(PipelineImage &image, const double rootpower)
 {
-    cv::Mat histH = inHist.getMat();
+    float immin = std::numeric_limits<float>::max();
 
-    cv::Point maxloc;
-    int chistskydn = 0;
-    double histGmax;
+    // The root is calculated in single precision for all root powers. Compared to the
+    // calculation in double precision the normalized result differs by less than 1e-6
+    // (about 0.06 of a 16 bit step) for root powers up to 1000, as powf is accurate to
+    // about one ulp and the normalization amplifies that by at most 1 / (4096 / 65535).
+    stretchRows(image, 1.f / (float)rootpower, immin);
 
-    cv::minMaxLoc(histH, 0, &histGmax, 0, &maxloc);
-    if(skylevel < 0)
-    {
-        skylevel = (float)histGmax * skylevelfactor;
-    }
+    double mn = immin - 4096.0 / 65535.;
+    mn = mn > 0. ? mn : 0.;
 
-    const float* p = histH.ptr<float>(0, maxloc.y);
-    for (int ih = maxloc.y; ih >= 2; ih--)
-    {
-        float top = *p;
-        p--;
-        float bottom = *p;
-        if (top >= skylevel && bottom <= skylevel)
-        {
-            chistskydn = ih;
-            break;
-        }
-    }
-    return chistskydn;
+    image = PipelineImage(image.data);
+    return mn;
 }
 
-
-void toneCurve(cv::InputArray inImage, cv::OutputArray outImage)
+/**
+ * @brief Sets the normalization of the root as pending transform
+ *
+ * @param image Image holding the root
+ * @param mn Offset of the normalization
+ */
+static void normalizeRoot(PipelineImage &image, const double mn)
 {
-    /// X*b*(1/12.)^(X^0.4)
-    /// uses: b^z = exp( z * ln b )
-    float fac = log(1.0 / 12.0);
-    float b = 12.0;
-
-    cv::Mat tmpImage, tmpImage3; // TBD UMat or Mat?
-    cv::pow(inImage, 0.4, tmpImage3);
-    cv::multiply(tmpImage3, fac, tmpImage);
-    cv::exp(tmpImage, tmpImage3);
-    cv::multiply(inImage, tmpImage3, tmpImage);
-    cv::multiply(tmpImage, b, outImage);
+    image.affine(cv::Scalar::all(1. / (1. - mn)), cv::Scalar::all(-mn / (1. - mn)));
 }
 
-
-void CVskysub1Ch(cv::InputArray inImage, cv::OutputArray outImage,
-                 const float skylevelfactor, const float sky = 4096.0, const bool out = false)
+void stretching(PipelineImage &image, const double rootpower)
 {
-    if(out) std::cout << "  Sky sub iteration " << std::flush;
-    for (int i = 1; i <= 25; i++)
-    {
-        if(out) std::cout << "|" << std::flush;
-
-        cv::Mat histh;
-        hist(inImage, histh, true);
-
-        cv::Rect roi = cv::Rect(0, 400, 1, 65100);
-        cv::Mat hist_cropped = histh(roi);
-
-        float skylevel = -1.;
-        int chistskydn;
-        chistskydn = skyDN(hist_cropped, skylevelfactor, skylevel) + 400;
-
-        if (pow(chistskydn - sky, 2) <= 25)
-            break;
-
-        float chistskysub1 = (chistskydn - sky ) / 65535.;
-
-        float cfscale = 1.0 / (1.0 - chistskysub1);
-
-        cv::subtract(inImage, chistskysub1, outImage);
-        cv::multiply(outImage, cfscale, outImage);
-    }
-    if(out) std::cout << std::endl;
-
-    cv::max(outImage, 0.0, outImage);
+    // the data now holds the root, the normalization stays pending
+    normalizeRoot(image, takeRoot(image, rootpower));
 }
 
-// TBD UMat or Mat?
-void CVskysub(cv::InputArray inImage, cv::OutputArray outImage,
-              const float skylevelfactor, const float skyLR = 4096.0,
-              const float skyLG = 4096.0,
-              const float skyLB = 4096.0, const bool out = false)
+void stretching(PipelineImage &image, PipelineImage &roi, const double rootpower, SolvedParams *params)
 {
-    if(inImage.channels() == 1)
+    double mn = takeRoot(image, rootpower);
+    if (!roi.data.empty())
     {
-        CVskysub1Ch(inImage,  outImage, skylevelfactor, skyLR);
-        return;
+        // a subsampled image can miss the darkest pixel of the crop
+        const double roimn = takeRoot(roi, rootpower);
+        mn = roimn < mn ? roimn : mn;
     }
-
-    std::vector<cv::Mat> bgr_planes(3);
-
-    cv::split(inImage, bgr_planes);
-
-    cv::Mat r = bgr_planes[2];
-    cv::Mat g = bgr_planes[1];
-    cv::Mat b = bgr_planes[0];
-
-    if(out) std::cout << "    Sky sub iteration " << std::flush;
-    for (int i = 1; i <= 25; i++)
+    if (params && params->replay)
     {
-        if(out) std::cout << "|" << std::flush;
-        cv::Mat r_hist, g_hist, b_hist;
-        // histograms use 65535 bins corresponding to 16bits (pixel values should be in the range from 0 to 1)
-        hist(r, r_hist, true);
-        hist(g, g_hist, true);
-        hist(b, b_hist, true);
-
-        // Histrograms are igroring the first 400 and last about 400 bins
-        // to avoid problems with saturated or clipped pixels
-        cv::Rect roi = cv::Rect(0, 400, 1, 65100);
-        cv::Mat r_hist_cropped = r_hist(roi);
-        cv::Mat g_hist_cropped = g_hist(roi);
-        cv::Mat b_hist_cropped = b_hist(roi);
-
-        float skylevel = -1.;
-        int chistredskydn, chistgreenskydn, chistblueskydn;
-
-        // Green is the reference channel
-        // offset the value by 400 to account fot the clipping of the histogram above
-        chistgreenskydn = skyDN(g_hist_cropped, skylevelfactor, skylevel) + 400;
-
-        //parallel_for_(cv::Range(0, 2), [&](const cv::Range& range){
-        //for (int n = range.start; n < range.end; n++)
-        //{
-        //    if(n==1) {
-        chistredskydn = skyDN(r_hist_cropped, skylevelfactor, skylevel) + 400;
-        //    } else {
-        chistblueskydn = skyDN(b_hist_cropped, skylevelfactor, skylevel) + 400;
-        //}
-        //}},2.);
-        if (  i > 1 && (chistredskydn == 400 ))
-        {
-            std::cout << "    WARNING: histogram sky level red not found" << std::endl;
-            //std::cout << "    Try increasing the -zerosky values" << std::endl;
-            // break;
-        }
-        if (  i > 1 && chistgreenskydn == 400)
-        {
-            std::cout << "    WARNING: histogram sky level green not found" << std::endl;
-            //std::cout << "    Try increasing the -zerosky values" << std::endl;
-            // break;
-        }
-        if (  i > 1 && (chistblueskydn == 400))
-        {
-            std::cout << "    WARNING: histogram sky level blue not found" << std::endl;
-            //std::cout << "    Try increasing the -zerosky values" << std::endl;
-            // break;
-        }
-
-        // Condition to stop when the value is within 5 pxiels after the first iteration
-        if (pow(chistgreenskydn - skyLG, 2) <= 25 &&
-                pow(chistredskydn - skyLR, 2) <= 25 &&
-                pow(chistblueskydn - skyLB, 2) <= 25 && i > 1)
-            break;
-
-        float chistredskysub1 = (chistredskydn - skyLR) / 65535.;
-        float chistgreenskysub1 = (chistgreenskydn - skyLG) / 65535.;
-        float chistblueskysub1 = (chistblueskydn - skyLB) / 65535.;
-
-        // normalizatons
-        float cfscalered = 1.0 / (1.0 - chistredskysub1);
-        float cfscalegreen = 1.0 / (1.0 - chistgreenskysub1);
-        float cfscaleblue = 1.0 / (1.0 - chistblueskysub1);
-
-        cv::subtract(r, chistredskysub1, r);
-        cv::multiply(r, cfscalered, r);
-        cv::subtract(g, chistgreenskysub1, g);
-        cv::multiply(g, cfscalegreen, g);
-        cv::subtract(b, chistblueskysub1, b);
-        cv::multiply(b, cfscaleblue, b);
+        mn = params->minima.at(params->nextStretch++);
+    }
+    else if (params)
+    {
+        params->minima.push_back(mn);
     }
-    if(out) std::cout << std::endl;
-
-    std::vector<cv::Mat> channels;
-    channels.push_back(b);
-    channels.push_back(g);
-    channels.push_back(r);
 
-    cv::merge(channels, outImage);
-    cv::max(outImage, 0.0, outImage);
+    normalizeRoot(image, mn);
+    if (!roi.data.empty()) normalizeRoot(roi, mn);
 }
 
-
 void stretching(
     cv::InputArray inImageA, cv::OutputArray outImage, const double rootpower)
 {
-    double x = 1. / rootpower;
-
-    cv::Mat dim;
-    // For high root powers use double precision
-    if (rootpower > 30.)
-    {
-        cv::Mat inImage = inImageA.getMat();
-        inImage.convertTo(dim, CV_64F);
-    }
-    else
-    {
-        dim = inImageA.getMat();
-    }
-
-    cv::add(dim, 1.0 / 65535.0, dim);
-    cv::divide(dim, (1. + 1.0 / 65535.), dim);
-    cv::pow(dim, x, dim);
-
-    double immin;
-    cv::minMaxLoc(dim, &immin, 0, 0, 0);
-
-    immin -= 4096.0 / 65535.;
-    immin = immin > 0. ? immin : 0.;
+    PipelineImage image(inImageA.getMat().clone());
+    stretching(image, rootpower);
+    image.apply(outImage);
+}
 
-    cv::subtract(dim, immin, dim);
-    cv::divide(dim, (1. - immin), dim);
+/// Maximum width of the images shown by showHist()
+static const int previewWidth = 1200;
 
-    if (rootpower > 30.)
+/**
+ * @brief Shows an image with its histograms below it and waits for a key
+ *
+ * @param im Image (CV_32F with 1 or 3 channels)
+ * @param hists Histograms with 256 bins for the range from 0 to 1, one for each channel
+ * @param window Name of the window
+ */
+static void drawHist(const cv::Mat &im, std::vector<cv::Mat> hists, const char* window)
+{
+    cv::Mat src = im;
+    if (src.channels() == 1)
     {
-        dim.convertTo(outImage, CV_32F);
+        cv::cvtColor(src, src, cv::COLOR_GRAY2BGR);
     }
-    else
+    int histSize = 256;
+    int hist_w = src.cols, hist_h = 400;
+    int bin_w = cvRound( (double) hist_w / (double) histSize );
+    cv::Mat histImage( hist_h, hist_w, CV_32FC3, cv::Scalar( 0, 0, 0) );
+    // blue, green and red, or white for mono images
+    const cv::Scalar colours[3] = {cv::Scalar(1, 0, 0), cv::Scalar(0, 1, 0), cv::Scalar(0, 0, 1)};
+    for (size_t c = 0; c < hists.size(); c++)
     {
-        dim.copyTo(outImage);
+        cv::normalize(hists[c], hists[c], 0, histImage.rows, cv::NORM_MINMAX, -1, cv::Mat() );
+        const cv::Scalar colour = hists.size() == 1 ? cv::Scalar(1, 1, 1) : colours[c];
+        for( int i = 1; i < histSize; i++ )
+        {
+            line( histImage, cv::Point( bin_w * (i - 1), hist_h - cvRound(hists[c].at<float>(i - 1)) ),
+                  cv::Point( bin_w * (i), hist_h - cvRound(hists[c].at<float>(i)) ),
+                  colour, 2, 8, 0  );
+        }
     }
+    cv::Mat dst;
+    cv::vconcat(src, histImage, dst);
+    cv::namedWindow( window, cv::WINDOW_AUTOSIZE | cv::WINDOW_NORMAL);
+    cv::imshow(window, dst );
+    std::cout << "    Hit a key to continue (with the image window being active)..." << std::endl;
+    cv::waitKey(0);
+    cv::destroyAllWindows();
 }
 
 void showHist(cv::InputArray im, const char* window)
 {
     cv::Mat src = im.getMat();
-    std::vector<cv::Mat> bgr_planes;
-    cv::split( src, bgr_planes );
+    std::vector<cv::Mat> planes;
+    cv::split( src, planes );
     int histSize = 256;
     float range[] = { 0, 1 }; //the upper boundary is exclusive
     const float* histRange = { range };
     bool uniform = true, accumulate = false;
-    cv::Mat b_hist, g_hist, r_hist;
-    calcHist( &bgr_planes[0], 1, 0, cv::Mat(), b_hist, 1, &histSize, &histRange, uniform, accumulate );
-    calcHist( &bgr_planes[1], 1, 0, cv::Mat(), g_hist, 1, &histSize, &histRange, uniform, accumulate );
-    calcHist( &bgr_planes[2], 1, 0, cv::Mat(), r_hist, 1, &histSize, &histRange, uniform, accumulate );
-    int hist_w = src.cols, hist_h = 400;
-    int bin_w = cvRound( (double) hist_w / (double) histSize );
-    cv::Mat histImage( hist_h, hist_w, CV_32FC3, cv::Scalar( 0, 0, 0) );
-    cv::normalize(b_hist, b_hist, 0, histImage.rows, cv::NORM_MINMAX, -1, cv::Mat() );
-    cv::normalize(g_hist, g_hist, 0, histImage.rows, cv::NORM_MINMAX, -1, cv::Mat() );
-    cv::normalize(r_hist, r_hist, 0, histImage.rows, cv::NORM_MINMAX, -1, cv::Mat() );
-    for( int i = 1; i < histSize; i++ )
-    {
-        line( histImage, cv::Point( bin_w * (i - 1), hist_h - cvRound(b_hist.at<float>(i - 1)) ),
-              cv::Point( bin_w * (i), hist_h - cvRound(b_hist.at<float>(i)) ),
-              cv::Scalar( 1, 0, 0), 2, 8, 0  );
-        line( histImage, cv::Point( bin_w * (i - 1), hist_h - cvRound(g_hist.at<float>(i - 1)) ),
-              cv::Point( bin_w * (i), hist_h - cvRound(g_hist.at<float>(i)) ),
-              cv::Scalar( 0, 1, 0), 2, 8, 0  );
-        line( histImage, cv::Point( bin_w * (i - 1), hist_h - cvRound(r_hist.at<float>(i - 1)) ),
-              cv::Point( bin_w * (i), hist_h - cvRound(r_hist.at<float>(i)) ),
-              cv::Scalar( 0, 0, 1), 2, 8, 0  );
+    std::vector<cv::Mat> hists(planes.size());
+    for (size_t c = 0; c < planes.size(); c++)
+    {
+        calcHist( &planes[c], 1, 0, cv::Mat(), hists[c], 1, &histSize, &histRange, uniform, accumulate );
     }
-    cv::Mat dst;
-    cv::vconcat(im, histImage, dst);
-    cv::namedWindow( window, cv::WINDOW_AUTOSIZE | cv::WINDOW_NORMAL);
-    cv::imshow(window, dst );
-    std::cout << "    Hit a key to continue (with the image window being active)..." << std::endl;
-    cv::waitKey(0);
-    cv::destroyAllWindows();
+
+    cv::Mat preview = src;
+    if (src.cols > previewWidth)
+    {
+        const double f = (double)previewWidth / src.cols;
+        cv::resize(src, preview, cv::Size(), f, f, cv::INTER_AREA);
+    }
+    drawHist(preview, hists, window);
 }
 
-void setMin(cv::InputArray inImage, cv::OutputArray outImage, const float minr, const float ming, const float minb)
+void showHist(const PipelineImage &image, const char* window)
 {
-    std::vector<cv::Mat> bgr_planes(3);
+    // the histograms of the last pass (if known), re-binned from 65536 to 256 bins
+    std::vector<cv::Mat> hists;
+    hist(image, hists, false);
+    for (size_t c = 0; c < hists.size(); c++)
+    {
+        cv::Mat h = cv::Mat::zeros(256, 1, CV_32F);
+        const float* src = hists[c].ptr<float>(0);
+        for (int i = 0; i < 65536; i++)
+            h.at<float>(i / 256) += src[i];
+        hists[c] = h;
+    }
 
-    cv::split(inImage, bgr_planes);
+    // the preview is downsampled before the pending transform is applied
+    PipelineImage preview(image.data);
+    if (image.data.cols > previewWidth)
+    {
+        const double f = (double)previewWidth / image.data.cols;
+        cv::resize(image.data, preview.data, cv::Size(), f, f, cv::INTER_AREA);
+    }
+    preview.scale = image.scale;
+    preview.offset = image.offset;
+    preview.lower = image.lower;
+    cv::Mat im;
+    preview.apply(im);
+    drawHist(im, hists, window);
+}
 
-    cv::Mat r_bg = bgr_planes[2];
-    cv::Mat g_bg = bgr_planes[1];
-    cv::Mat b_bg = bgr_planes[0];
+void setMin(cv::InputArray inImage, cv::OutputArray outImage, const float minr, const float ming, const float minb)
+{
+    PipelineImage image(inImage.getMat().clone());
+    setMin(image, minr, ming, minb);
+    image.apply(outImage);
+}
 
+void setMin(PipelineImage &image, const float minr, const float ming, const float minb)
+{
     const float zx = 0.2;  // keep some of the low level, which is noise, so it looks more natural.
 
-    cv::setNumThreads(-1);
+    const int cn = image.data.channels();
+    const float limits[3] = {cn == 1 ? minr : minb, ming, minr};
 
-    const int split = 7;
-    const int row_split = r_bg.rows / split;
+    // classify the tiles, without a summary each pixel is tested
+    const TileIndex tiles = image.effectiveTiles();
+    const int tile = tiles.empty() ? image.data.rows + image.data.cols : tiles.size;
+    cv::Mat state = cv::Mat::zeros(tiles.empty() ? cv::Size(1, 1) : tiles.mins.size(), CV_MAKETYPE(CV_8U, cn));
+    bool unchanged = !image.pending();
+    if (!tiles.empty())
+    {
+        for (int row = 0; row < state.rows; row++)
+        {
+            const float* mn = tiles.mins.ptr<float>(row);
+            const float* mx = tiles.maxs.ptr<float>(row);
+            uchar* st = state.ptr<uchar>(row);
+            for (int i = 0; i < state.cols * cn; i++)
+            {
+                st[i] = mn[i] >= limits[i % cn] ? 1 : (mx[i] < limits[i % cn] ? 2 : 0);
+                unchanged = unchanged && st[i] == 1;
+            }
+        }
+    }
+    else
+    {
+        unchanged = false;
+    }
+    if (unchanged) return;
 
-    ParallelSetMin parallelSetMin(r_bg, g_bg, b_bg, row_split, minr, ming, minb, zx);
-    parallel_for_(cv::Range(0, split + 1), parallelSetMin, 8);
+    if (opencl)
+    {
+        // the device tests each pixel instead of classifying tiles
+        cv::ocl::Kernel kernel = oclKernel("j3cs_set_min", cn);
+        if (!kernel.empty())
+        {
+            cv::UMat data = image.data.getUMat(cv::ACCESS_RW);
+            kernel.args(cv::ocl::KernelArg::ReadWrite(data), oclVec(image.scale), oclVec(image.offset),
+                        oclVec(image.lower), cv::Vec4f(limits[0], limits[1], limits[2], 0.f), zx);
+            if (oclRun(kernel, image.data.size()))
+            {
+                image.modified();
+                return;
+            }
+        }
+    }
 
-    std::vector<cv::Mat> channels;
-    channels.push_back(b_bg);
-    channels.push_back(g_bg);
-    channels.push_back(r_bg);
+    const int split = 8;
+    const int row_split = (image.data.rows + split - 1) / split;
 
-    cv::merge(channels, outImage);
+    parallelChannels<ParallelSetMin>(cn, split, image, state, tile, row_split, limits, zx);
+    image.modified();
 }
 
 void scurve(cv::InputArray inImage, cv::OutputArray outImage, const float xfactor,
@@ -588,78 +3025,168 @@ void scurve(cv::InputArray inImage, cv::OutputArray outImage, const float xfacto
     cv::max(outImage, 0.0, outImage);
 }
 
-
-void colorcorr(cv::InputArray inImage, cv::InputArray ref, cv::OutputArray outImage, const float skyLR = 4096.0,
-               const float skyLG = 4096.0,
-               const float skyLB = 4096.0,
-               const float colorenhance =
-                   1.0, const bool verbose = false) // possibly merge colorenhance with colorfactor?!?
+void scurve(PipelineImage &image, const float xfactor, const float xoffset)
 {
-    if(verbose) std::cout << "    Color correction " << std::flush;
+    curveRows(image, SCurve(xfactor, xoffset, fastmath));
+}
+
 
-    cv::Mat inIma = inImage.getMat();
+void colorcorr(cv::InputArray inImage, cv::InputArray ref, cv::OutputArray outImage, const float skyLR,
+               const float skyLG,
+               const float skyLB,
+               const float colorenhance,
+               const bool verbose) // possibly merge colorenhance with colorfactor?!?
+{
+    PipelineImage image(inImage.getMat().clone());
+    colorcorr(image, ref, skyLR, skyLG, skyLB, colorenhance, verbose, TileIndex());
+    image.apply(outImage);
+}
 
-    cv::Mat bgr_planes[3];
-    cv::split(inIma, bgr_planes);
-    cv::Mat r_bg = bgr_planes[2];
-    cv::Mat g_bg = bgr_planes[1];
-    cv::Mat b_bg = bgr_planes[0];
+/**
+ * @brief Maximum luminance (sum of the channels) of an image with the pending transform applied
+ *
+ * @param image Image (CV_32FC3)
+ * @return float Maximum luminance
+ */
+static float lumMax(const PipelineImage &image)
+{
+    const int split = 8;
+    const int row_split = (image.data.rows + split - 1) / split;
+
+    float maxlum = 0.;
+    std::mutex mutex;
+    ParallelLumMax parallelLumMax(image, maxlum, mutex, row_split);
+    parallelFor(cv::Range(0, split), parallelLumMax, split);
+    return maxlum;
+}
 
-    cv::Mat rf = ref.getMat();
-    cv::Mat bgr_planes_ref[3];
-    cv::split(rf, bgr_planes_ref);
+/**
+ * @brief Applies the colour correction with a given maximum luminance
+ *
+ * @param image Image (background subtracted and stretched)
+ * @param rf Reference image for the colours
+ * @param skyLR Red target sky level
+ * @param skyLG Green target sky level
+ * @param skyLB Blue target sky level
+ * @param colorenhance Colour enhancement factor
+ * @param maxlum Maximum luminance used for the normalization of the luminance
+ * @param refTiles Summary of the reference image
+ */
+static void colorcorrLum(PipelineImage &image, const cv::Mat &rf, const float skyLR, const float skyLG,
+                         const float skyLB, const float colorenhance, const float maxlum,
+                         const TileIndex &refTiles)
+{
 
     float zeroskyred = skyLR / 65535.0;
     float zeroskygreen = skyLG / 65535.0;
     float zeroskyblue = skyLB / 65535.0;
 
-    if(verbose) std::cout << "|" << std::flush;
+    const int split = 8;
+    const int row_split = (image.data.rows + split - 1) / split;
 
-    cv::Mat tmp, lum;
-    cv::add(r_bg, g_bg, lum);
-    cv::add(lum, b_bg, tmp);
-    cv::max(tmp, 0.0, lum);
+    const float cfactor = 1.2;
+    const float ref_limit = 10. / 65535.;
 
-    double maxlum;
-    cv::minMaxLoc(lum, 0, &maxlum, 0, 0);
-    cv::divide(lum, maxlum, tmp);
-    cv::pow(tmp, 0.2, lum);
-    cv::add(lum, 0.3, tmp);
-    cv::divide(tmp, 1.3, lum);
+    // Where the reference is clipped to ref_limit in all channels the colour ratios saturate
+    // at 1 and the pixels are not changed
+    cv::Mat skip;
+    if (!refTiles.empty())
+    {
+        skip.create(refTiles.maxs.size(), CV_8U);
+        const float zerosky[3] = {zeroskyblue, zeroskygreen, zeroskyred};
+        for (int row = 0; row < skip.rows; row++)
+        {
+            const float* mx = refTiles.maxs.ptr<float>(row);
+            uchar* sk = skip.ptr<uchar>(row);
+            for (int col = 0; col < skip.cols; col++)
+            {
+                sk[col] = mx[0] - zerosky[0] <= ref_limit && mx[1] - zerosky[1] <= ref_limit &&
+                          mx[2] - zerosky[2] <= ref_limit;
+                mx += 3;
+            }
+        }
+    }
 
-    const float cfactor = 1.2;
-    if(verbose) std::cout << "|" << std::flush;
+    CV_Assert(rf.type() == CV_32FC3 || rf.type() == CV_16UC3);
+    if (opencl)
+    {
+        cv::ocl::Kernel kernel = oclKernel("j3cs_color_corr", 3, rf.depth());
+        if (!kernel.empty())
+        {
+            // without a summary a single tile covers the image and is never skipped
+            const cv::Mat sk = skip.empty() ? cv::Mat::zeros(1, 1, CV_8U) : skip;
+            const int tile = skip.empty() ? image.data.rows + image.data.cols : refTiles.size;
+            cv::UMat data = image.data.getUMat(cv::ACCESS_RW);
+            cv::UMat ref = rf.getUMat(cv::ACCESS_READ);
+            cv::UMat tiles = sk.getUMat(cv::ACCESS_READ);
+            kernel.args(cv::ocl::KernelArg::ReadWrite(data), cv::ocl::KernelArg::ReadOnlyNoSize(ref),
+                        cv::ocl::KernelArg::ReadOnlyNoSize(tiles), tile,
+                        oclVec(image.scale), oclVec(image.offset), oclVec(image.lower),
+                        cv::Vec4f(zeroskyblue, zeroskygreen, zeroskyred, 0.f),
+                        rf.depth() == CV_16U ? 1.f / 65535.f : 1.f, ref_limit, maxlum, cfactor * colorenhance);
+            if (oclRun(kernel, image.data.size()))
+            {
+                image.modified();
+                return;
+            }
+        }
+    }
 
-    cv::Mat cfe;
-    cv::multiply(lum, cfactor * colorenhance, cfe);
+    if (rf.depth() == CV_16U)
+    {
+        ParallelColorCorr<ushort> parallelColorCorr(image, rf, zeroskyred, zeroskygreen, zeroskyblue, ref_limit,
+                maxlum, cfactor * colorenhance, skip, refTiles.size, fastmath, row_split);
+        parallelFor(cv::Range(0, split), parallelColorCorr, split);
+    }
+    else
+    {
+        ParallelColorCorr<float> parallelColorCorr(image, rf, zeroskyred, zeroskygreen, zeroskyblue, ref_limit,
+                maxlum, cfactor * colorenhance, skip, refTiles.size, fastmath, row_split);
+        parallelFor(cv::Range(0, split), parallelColorCorr, split);
+    }
+    image.modified();
+}
 
-    const float ref_limit = 10. / 65535.;
+void colorcorr(PipelineImage &image, cv::InputArray ref, const float skyLR, const float skyLG,
+               const float skyLB, const float colorenhance, const bool verbose, const TileIndex &refTiles)
+{
+    if(verbose) std::cout << "    Color correction " << std::flush;
 
-    cv::setNumThreads(-1);
+    if(verbose) std::cout << "|" << std::flush;
+    const float maxlum = lumMax(image);
+    if(verbose) std::cout << "|" << std::flush;
 
-    const int split = 7;
-    const int row_split = r_bg.rows / split;
+    colorcorrLum(image, ref.getMat(), skyLR, skyLG, skyLB, colorenhance, maxlum, refTiles);
 
-    cv::Mat r_bg_ref = bgr_planes_ref[2];
-    cv::Mat g_bg_ref = bgr_planes_ref[1];
-    cv::Mat b_bg_ref = bgr_planes_ref[0];
+    if(verbose) std::cout << "|" << std::flush;
+    if(verbose) std::cout << std::endl;
+}
 
-    ParallelColorCorr parallelColorCorr(r_bg, g_bg, b_bg, r_bg_ref, g_bg_ref, b_bg_ref, cfe, zeroskyred, zeroskygreen,
-                                        zeroskyblue, ref_limit, row_split);
-    parallel_for_(cv::Range(0, split + 1), parallelColorCorr, 8);
+void colorcorr(PipelineImage &image, cv::InputArray ref, PipelineImage &roi, cv::InputArray roiRef,
+               const float skyLR, const float skyLG, const float skyLB, const float colorenhance,
+               const bool verbose, const TileIndex &refTiles, SolvedParams *params)
+{
+    if(verbose) std::cout << "    Color correction " << std::flush;
 
+    if(verbose) std::cout << "|" << std::flush;
+    float maxlum;
+    if (params && params->replay)
+    {
+        maxlum = params->maxlums.at(params->nextColorcorr++);
+    }
+    else
+    {
+        // a subsampled image can miss the brightest pixel of the crop
+        maxlum = lumMax(image);
+        if (!roi.data.empty()) maxlum = std::max(maxlum, lumMax(roi));
+        if (params) params->maxlums.push_back(maxlum);
+    }
     if(verbose) std::cout << "|" << std::flush;
 
-    std::vector<cv::Mat> channels;
-    channels.push_back(b_bg);
-    channels.push_back(g_bg);
-    channels.push_back(r_bg);
+    colorcorrLum(image, ref.getMat(), skyLR, skyLG, skyLB, colorenhance, maxlum, refTiles);
+    if (!roi.data.empty())
+        colorcorrLum(roi, roiRef.getMat(), skyLR, skyLG, skyLB, colorenhance, maxlum, TileIndex());
 
-    cv::merge(channels, outImage) ;
+    if(verbose) std::cout << "|" << std::flush;
     if(verbose) std::cout << std::endl;
 }
-
-//auto start = std::chrono::steady_clock::now();
-//auto end = std::chrono::steady_clock::now();
-//auto diff = end - start;
-//std::cout << std::chrono::duration <double, std::milli> (diff).count() << " ms" << std::endl;
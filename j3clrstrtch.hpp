@@ -37,6 +37,440 @@
 
 #include "opencv2/core.hpp"
 
+#include <condition_variable>
+#include <exception>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Coarse summary of an image with the minimum and maximum of each channel in square tiles
+ * Kernels use it to take a cheap path for tiles which they would not change.
+ */
+struct TileIndex
+{
+    /// Size of the tiles in pixels
+    int size;
+    /// Minimum of each channel in each tile (CV_32F with the channels of the image, one element per tile)
+    cv::Mat mins;
+    /// Maximum of each channel in each tile
+    cv::Mat maxs;
+
+    /**
+     * @brief Construct an empty index with 64x64 pixel tiles
+     */
+    TileIndex();
+
+    /**
+     * @brief Check whether the index is known
+     *
+     * @return true if there is no index
+     */
+    bool empty() const;
+};
+
+/**
+ * @brief Size-keyed pool of the large buffers of the pipeline (image data and histograms)
+ * Returned buffers are kept and handed out again for the next request with the same size and
+ * type, so that a series of images of the same size (a batch, a sequence) allocates its buffers
+ * only for the first image. Buffers which are still shared when they are returned are not
+ * kept. The pool is thread safe, buffers beyond the limit are freed (oldest first).
+ */
+class BufferPool
+{
+    public:
+        /// Counters of the pool
+        struct Stats
+        {
+            /// Number of requests served from the pool
+            size_t hits;
+            /// Number of requests which allocated a new buffer
+            size_t misses;
+            /// Bytes of the buffers kept in the pool
+            size_t pooledBytes;
+            /// Bytes of the buffers handed out and not returned yet
+            size_t outstandingBytes;
+            /// Maximum of pooled and outstanding bytes together
+            size_t highWaterBytes;
+        };
+
+        /**
+         * @brief Construct an empty pool with a limit of 4 GiB
+         */
+        BufferPool();
+
+        /**
+         * @brief Get a continuous buffer (the contents are undefined)
+         *
+         * @param[in] rows Number of rows
+         * @param[in] cols Number of columns
+         * @param[in] type Type of the buffer
+         * @return Buffer
+         */
+        cv::Mat get(const int rows, const int cols, const int type);
+
+        /**
+         * @brief Return a buffer, which is released in any case
+         *
+         * @param[in,out] mat Buffer (empty afterwards)
+         */
+        void put(cv::Mat &mat);
+
+        /**
+         * @brief Return several buffers (see put())
+         *
+         * @param[in,out] mats Buffers (the vector is empty afterwards)
+         */
+        void put(std::vector<cv::Mat> &mats);
+
+        /**
+         * @brief Set the maximum number of bytes kept in the pool
+         *
+         * @param[in] bytes Limit (0 to keep nothing)
+         */
+        void setLimit(const size_t bytes);
+
+        /**
+         * @brief Free all buffers kept in the pool
+         */
+        void clear();
+
+        /**
+         * @brief Get the counters
+         *
+         * @return Counters
+         */
+        Stats stats() const;
+
+    private:
+        void trim();
+
+        std::list<cv::Mat> free;
+        std::map<const uchar*, size_t> outstanding;
+        size_t limit;
+        Stats counters;
+        mutable std::mutex mutex;
+};
+
+/**
+ * @brief The buffer pool of the library
+ *
+ * @return Pool
+ */
+BufferPool &bufferPool();
+
+/**
+ * @brief Image with a pending per-channel affine transform
+ *
+ * The effective pixel values are max(data * scale + offset, lower) for each channel.
+ * Steps that only shift and scale the image update the pending transform instead of
+ * touching the pixels, the transform is applied by the next kernel reading the data
+ * (histograms, stretching or materialize()).
+ */
+struct PipelineImage
+{
+    /// Pixel data (CV_32FC1 or CV_32FC3)
+    cv::Mat data;
+    /// Pending scale for each channel (in the channel order of data)
+    cv::Scalar scale;
+    /// Pending offset for each channel
+    cv::Scalar offset;
+    /// Pending lower limit for each channel (-infinity if there is none)
+    cv::Scalar lower;
+    /// Unblurred histograms of the effective pixel values (see hist()), empty if not known
+    std::vector<cv::Mat> hists;
+    /// Number of effective pixel values below 0 for each channel (known together with hists)
+    cv::Scalar below;
+    /// Summary of data in tiles (see hist()), empty if not known
+    TileIndex tiles;
+
+    /**
+     * @brief Construct an empty image with an identity transform
+     */
+    PipelineImage();
+
+    /**
+     * @brief Construct an image with an identity transform
+     *
+     * @param[in] image Image data (shared, not copied)
+     */
+    explicit PipelineImage(const cv::Mat &image);
+
+    /**
+     * @brief Check whether there is a transform that has not been applied to the data yet
+     *
+     * @return true if the effective pixel values differ from data
+     */
+    bool pending() const;
+
+    /**
+     * @brief Mark the data as modified, which resets the pending transform and the histograms
+     */
+    void modified();
+
+    /**
+     * @brief Append an affine transform X = X * s + o to the pending transform
+     *
+     * @param[in] s Scale for each channel (has to be > 0)
+     * @param[in] o Offset for each channel
+     */
+    void affine(const cv::Scalar &s, const cv::Scalar &o);
+
+    /**
+     * @brief Append clipping the pixel values to be larger than a limit
+     * For a limit of 0 the histograms are kept (the values below 0 are added to the first bin).
+     *
+     * @param[in] limit Lower limit (the same for all channels)
+     */
+    void clampBelow(const double limit);
+
+    /**
+     * @brief Write the effective pixel values to an image
+     *
+     * @param[out] outImage Output image (may be data itself)
+     */
+    void apply(cv::OutputArray outImage) const;
+
+    /**
+     * @brief Apply the pending transform to data and reset it
+     */
+    void materialize();
+
+    /**
+     * @brief Summary of the effective pixel values in tiles
+     * The pending transform is monotonic, so it can be applied to the summary of data.
+     *
+     * @return Summary of the effective pixel values (empty if tiles is empty)
+     */
+    TileIndex effectiveTiles() const;
+
+    /**
+     * @brief Copy a part of the image with the same pending transform
+     * The histograms and the tile summary are not copied.
+     *
+     * @param[in] rect Part of the image
+     * @return Copy of the part
+     */
+    PipelineImage crop(const cv::Rect &rect) const;
+
+    /**
+     * @brief Replace data by every step-th pixel in both directions
+     * The pending transform and the histograms of the full image are kept.
+     *
+     * @param[in] step Subsampling step (nothing is done for 1)
+     */
+    void subsample(const int step);
+
+    /**
+     * @brief Return the data and the histograms to the buffer pool (see bufferPool()) and reset the image
+     */
+    void release();
+};
+
+/**
+ * @brief Parameters of a stretch that were solved on the statistics of an image
+ * The parameters are recorded while one image is processed (e.g. a downsampled preview) and can
+ * be replayed on another image (e.g. the full resolution image), which is then processed with
+ * exactly the same parameters and without any statistics passes.
+ */
+struct SolvedParams
+{
+    /// Affine steps (scale, offset) of the sky subtractions, each followed by clamping at 0
+    std::vector<std::pair<cv::Scalar, cv::Scalar> > skysubs;
+    /// Normalization offsets of the root stretches
+    std::vector<double> minima;
+    /// Maximum luminances of the colour corrections
+    std::vector<float> maxlums;
+    /// Sky subtractions of a similar image (e.g. the previous frame of a sequence), which are
+    /// applied before the sky subtractions are determined while recording
+    std::vector<std::pair<cv::Scalar, cv::Scalar> > seeds;
+    /// Switch between recording (false) and replaying (true)
+    bool replay;
+    /// Index of the next sky subtraction to replay
+    size_t nextSkysub;
+    /// Index of the next root stretch to replay
+    size_t nextStretch;
+    /// Index of the next colour correction to replay
+    size_t nextColorcorr;
+    /// Index of the next seed
+    size_t nextSeed;
+
+    /**
+     * @brief Construct empty parameters for recording
+     */
+    SolvedParams();
+
+    /**
+     * @brief Switch to replaying the recorded parameters from the start
+     */
+    void rewind();
+
+    /**
+     * @brief Switch to recording the parameters of the next image, starting its sky subtractions
+     * from the recorded ones
+     * From a close start the sky subtraction usually stops after one or two iterations.
+     */
+    void warmStart();
+};
+
+/**
+ * @brief Thread budget of the kernels, with its own threads which are optionally bound to CPUs
+ * The kernels of a thread with a current context (see setExecutionContext()) run on the threads
+ * of the context instead of OpenCV's global thread pool. Several images can be processed
+ * concurrently, each with its own context, without oversubscribing the machine. A context
+ * runs one loop at a time, loops started while it is busy (nested, or from another thread)
+ * run on the calling thread.
+ */
+class ExecutionContext
+{
+    public:
+        /**
+         * @brief Construct a context and start its threads
+         *
+         * @param[in] threads Number of threads including the calling thread (0 for the number of CPUs given, or of the machine)
+         * @param[in] cpus CPUs the threads are bound to (empty for no binding, only supported on Linux)
+         */
+        explicit ExecutionContext(const int threads, const std::vector<int> &cpus = std::vector<int>());
+
+        /**
+         * @brief Stop the threads
+         */
+        ~ExecutionContext();
+
+        ExecutionContext(const ExecutionContext &) = delete;
+        ExecutionContext &operator=(const ExecutionContext &) = delete;
+
+        /**
+         * @brief Get the number of threads
+         *
+         * @return Number of threads including the calling thread
+         */
+        int threads() const;
+
+        /**
+         * @brief Bind the calling thread to the CPUs of the context
+         */
+        void bind() const;
+
+        /**
+         * @brief Run a loop on the threads of the context (like cv::parallel_for_)
+         *
+         * @param[in] range Range of the loop
+         * @param[in] body Body of the loop
+         * @param[in] nstripes Number of stripes the range is split into (<= 0 for a default)
+         */
+        void parallelFor(const cv::Range &range, const cv::ParallelLoopBody &body, const double nstripes);
+
+    private:
+        void work();
+        bool runStripe();
+
+        std::vector<int> cpus;
+        std::vector<std::thread> workers;
+        std::mutex busy, mutex;
+        std::condition_variable wake, done;
+        const cv::ParallelLoopBody* body;
+        cv::Range range;
+        int stripes, next, finished;
+        size_t generation;
+        bool stop;
+        std::exception_ptr error;
+};
+
+/**
+ * @brief Make a context current for the kernels called from the calling thread
+ *
+ * @param[in] context Context (0 for OpenCV's thread pool), it has to outlive its use
+ * @return The previous context of the calling thread
+ */
+ExecutionContext* setExecutionContext(ExecutionContext* context);
+
+/**
+ * @brief Get the current context of the calling thread
+ *
+ * @return Context (0 for OpenCV's thread pool)
+ */
+ExecutionContext* executionContext();
+
+/**
+ * @brief Run a loop on the threads of the current context, or OpenCV's thread pool without one
+ *
+ * @param[in] range Range of the loop
+ * @param[in] body Body of the loop
+ * @param[in] nstripes Number of stripes the range is split into (<= 0 for a default)
+ */
+void parallelFor(const cv::Range &range, const cv::ParallelLoopBody &body, const double nstripes = -1.);
+
+/**
+ * @brief Number of threads the kernels of the calling thread run on
+ *
+ * @return Threads of the current context, or of OpenCV's thread pool
+ */
+int numThreads();
+
+/**
+ * @brief Parse a list of CPUs, e.g. 0-7,16-23
+ *
+ * @param[in] list List of CPU numbers and ranges
+ * @param[out] cpus CPUs
+ * @return Status (0==OK)
+ */
+int parseCpuList(const std::string &list, std::vector<int> &cpus);
+
+/**
+ * @brief Switches the fast approximations of pow and exp in the stretch curves on or off
+ * With fast math the root stretch, the tone curve, the S-curve and the colour correction use
+ * polynomial approximations of log2 and exp2 instead of the exact functions. The error of
+ * the curves stays below half a 16 bit step (see fastMathError()). It is off by default.
+ *
+ * @param[in] enable Switch for the fast approximations
+ */
+void setFastMath(const bool enable);
+
+/**
+ * @brief Switches the sampled histograms of the sky subtraction on or off
+ * On images with more than about 4 million pixels the iterations of CVskysub() and CVskysub1Ch()
+ * estimate the histograms from one pixel in each of about a million blocks, at a position varying
+ * from row to row, instead of binning all pixels. More pixels are sampled where the expected error
+ * of the sky level would exceed 2 (in 16bit), and all pixels are used where the histogram has a
+ * second peak of about the height of the maximum. It is off by default.
+ *
+ * @param[in] enable Switch for the sampled histograms
+ */
+void setSampledHists(const bool enable);
+
+/**
+ * @brief Switches the optional OpenCL kernels for two steps, the colour correction and setMin(), on or off
+ * This is not an OpenCL pipeline: only these two kernels run on the OpenCL device of OpenCV's
+ * T-API (e.g. a GPU, or a CPU with PoCL), each on a UMat view of the image data without copying
+ * it, while the data stays in host memory. As all other steps run on the CPU, the kernels
+ * are only used on devices sharing the host memory (CPUs and integrated GPUs); on a device with
+ * memory of its own the copies for each kernel would cost more than the kernel saves. OpenCL
+ * has to be enabled in OpenCV (cv::ocl::setUseOpenCL()). Where a kernel cannot be built or run,
+ * the CPU kernel is used. It is off by default.
+ *
+ * @param[in] enable Switch for the OpenCL kernels
+ * @return true if the OpenCL kernels are used
+ */
+bool setOpenCL(const bool enable);
+
+/**
+ * @brief Measures the maximum error of the fast approximations against the exact curves
+ * The root stretch (with its normalization), the tone curve, the S-curve and the colour
+ * enhancement factor are evaluated in double precision and with the approximations on a
+ * dense grid of pixel values between 0 and 1.
+ *
+ * @param[in] rootpower Root power of the stretch
+ * @param[in] xfactor Factor parameter for the S-curve
+ * @param[in] xoffset Offset parameter for the S-curve
+ * @return Maximum absolute error (in units where 1 is the maximum pixel value)
+ */
+double fastMathError(const double rootpower, const float xfactor, const float xoffset);
+
 /**
  * @brief
  *
@@ -49,6 +483,105 @@
  */
 void hist(cv::InputArray image, cv::OutputArray hist, const bool blur);
 
+/**
+ * @brief Calculates the histograms of all channels of an image in one pass
+ *
+ * The pending transform is applied on the fly. The histograms are the same as those
+ * of hist() for each channel of the materialized image.
+ *
+ * @param[in] image Input image
+ * @param[out] hists Output histograms (one per channel, in the channel order of the image)
+ * @param[in] blur Switch whether or not to blurr the histograms
+ */
+void hist(const PipelineImage &image, std::vector<cv::Mat> &hists, const bool blur);
+
+/**
+ * @brief Makes sure that the histograms of the image are known (see PipelineImage::hists)
+ * Unless they are known from an earlier pass they are calculated in one pass, in which the
+ * data is also summarized in tiles if the tiles are not known yet.
+ *
+ * @param[in,out] image Image
+ */
+void updateHists(PipelineImage &image);
+
+/**
+ * @brief Normalizes the image to the range from 0 to 1 (like cv::normalize with cv::NORM_MINMAX)
+ * This only updates the pending transform of the image.
+ *
+ * @param[in,out] image Image
+ */
+void normalizeMinMax(PipelineImage &image);
+
+/**
+ * @brief Applies the pending transform to a range of rows and quantizes them
+ * The values are scaled to the range of the output depth and rounded (or, with dithering,
+ * an 8x8 ordered dither threshold is used instead of rounding).
+ *
+ * @param[in] image Input image
+ * @param[in] row0 First row of the image to be quantized
+ * @param[in,out] rows Output rows (CV_8U or CV_16U with the channels of the image, allocated by the caller)
+ * @param[in] swapRB Switch whether to write the channels in RGB instead of BGR order
+ * @param[in] dither Switch for ordered dithering
+ */
+void quantize(const PipelineImage &image, const int row0, cv::Mat &rows, const bool swapRB = false,
+              const bool dither = false);
+
+/**
+ * @brief Widens a decoded image stripe by stripe into a 32 bit floating point image
+ * The minimum, maximum and (for 8 and 16 bit input) the histograms of the raw values are
+ * accumulated while widening, so that decoders can hand over each stripe as soon as it
+ * is decoded and the full decoded image never needs to be held in memory.
+ */
+class IngestStream
+{
+    public:
+        /**
+         * @brief Construct a new Ingest Stream object and allocate the output image
+         *
+         * @param[in] rows Number of rows of the image
+         * @param[in] cols Number of columns of the image
+         * @param[in] channels Number of channels (1 or 3)
+         * @param[in] depth Depth of the decoded data (CV_8U, CV_16U or CV_32F)
+         */
+        IngestStream(const int rows, const int cols, const int channels, const int depth);
+
+        /**
+         * @brief Widen a stripe of decoded rows
+         *
+         * @param[in] raw Decoded rows
+         * @param[in] row0 Row of the image where the stripe starts
+         * @param[in] swapRB Switch whether the decoded data is in RGB instead of BGR order
+         * @return The widened rows (part of the output image)
+         */
+        cv::Mat add(const cv::Mat &raw, const int row0, const bool swapRB = false);
+
+        /**
+         * @brief Hand over the output image, normalized (pending) and with its histograms
+         *
+         * @param[out] image Normalized image
+         */
+        void finish(PipelineImage &image);
+
+    private:
+        cv::Mat data;
+        int depth, nbins;
+        std::vector<double> counts;
+        float mins[4], maxs[4];
+        std::mutex mutex;
+};
+
+/**
+ * @brief Converts a decoded image to 32 bit floating point and normalizes it in a single pass
+ * The minimum and maximum are determined while widening the data, and for 8 and 16 bit
+ * input the histograms of the raw values are accumulated in the same pass. These are
+ * re-binned to the histograms of the normalized image, so that the first sky subtraction
+ * does not need to read the pixels again.
+ *
+ * @param[in] raw Decoded image (CV_8U, CV_16U or CV_32F with 1 or 3 channels)
+ * @param[out] image Normalized image (the normalization is left pending)
+ */
+void ingestImage(const cv::Mat &raw, PipelineImage &image);
+
 /**
  * @brief Helper function to display RGB histograms
  *
@@ -57,6 +590,16 @@ void hist(cv::InputArray image, cv::OutputArray hist, const bool blur);
  */
 void showHist(cv::InputArray im, const char* window);
 
+/**
+ * @brief Helper function to display RGB histograms of an image with a pending transform
+ * The histograms known from the last pass over the image are used if possible, the image
+ * is shown downsampled.
+ *
+ * @param[in] image Input image
+ * @param[in] window Name of the window
+ */
+void showHist(const PipelineImage &image, const char* window);
+
 
 /**
  * @brief Finds where the histogram reaches the skylevel
@@ -74,7 +617,7 @@ inline int skyDN(
 
 /**
  * @brief Set damp small pixel values in an image to avoid enhancing noise
- * The pixel values in the channels below a limit are damped by X = X * limit * zfac
+ * The pixel values in the channels below a limit are set to X = limit + X * zfac
  *
  * @param[in] inImage Input image
  * @param[out] outImage Output image
@@ -84,6 +627,18 @@ inline int skyDN(
  */
 void setMin(cv::InputArray inImage, cv::OutputArray outImage, const float minr, const float ming, const float minb);
 
+/**
+ * @brief Set damp small pixel values in an image to avoid enhancing noise
+ * The pending transform is applied in the same pass. Tiles which are entirely above or
+ * below the limits (according to the tiles of the image) take a cheap path.
+ *
+ * @param[in,out] image Image
+ * @param[in] minr Red limit
+ * @param[in] ming Green limit
+ * @param[in] minb Blue limit
+ */
+void setMin(PipelineImage &image, const float minr, const float ming, const float minb);
+
 /**
  * @brief Applies a simple gamma correction
  * X = X*12./(1/12.)^(X^0.4)
@@ -92,6 +647,14 @@ void setMin(cv::InputArray inImage, cv::OutputArray outImage, const float minr,
  */
 void toneCurve(cv::InputArray inImage, cv::OutputArray outImage);
 
+/**
+ * @brief Applies a simple gamma correction
+ * The pending transform is applied in the same pass.
+ *
+ * @param[in,out] image Image
+ */
+void toneCurve(PipelineImage &image);
+
 /**
  * @brief Subtracts for an image with a single channel the sky background and adjusts it to the requested skylevel
  *
@@ -104,6 +667,18 @@ void toneCurve(cv::InputArray inImage, cv::OutputArray outImage);
 void CVskysub1Ch(cv::InputArray inImage, cv::OutputArray outImage,
                  const float skylevelfactor, const float sky = 4096.0, const bool out = false);
 
+/**
+ * @brief Subtracts for an image with a single channel the sky background and adjusts it to the requested skylevel
+ * Only the pending transform of the image is updated.
+ *
+ * @param[in,out] image Image
+ * @param[in] skylevelfactor Skylevel will be considered to be the skylevelfactor times the value corresponding to the histogram maximum
+ * @param[in] sky Target sky value (in 16bit, i.e. between 0 and 65535)
+ * @param[in] out Switch progress information output
+ */
+void CVskysub1Ch(PipelineImage &image, const float skylevelfactor, const float sky = 4096.0,
+                 const bool out = false);
+
 /**
  * @brief Subtracts the sky background in an image and adjusts it to the requested skylevel
  *
@@ -120,6 +695,89 @@ void CVskysub(cv::InputArray inImage, cv::OutputArray outImage,
               const float skyLG = 4096.0,
               const float skyLB = 4096.0, const bool out = false);
 
+/**
+ * @brief Subtracts the sky background in an image and adjusts it to the requested skylevel
+ * Only the pending transform of the image is updated, the histograms are calculated with
+ * the transform applied on the fly.
+ *
+ * @param[in,out] image Image
+ * @param[in] skylevelfactor Skylevel will be considered to be the skylevelfactor times the value corresponding to the histogram maximum
+ * @param[in] skyLR Target red sky value (in 16bit, i.e. between 0 and 65535)
+ * @param[in] skyLG Target green sky value (in 16bit, i.e. between 0 and 65535)
+ * @param[in] skyLB Target blue sky value (in 16bit, i.e. between 0 and 65535)
+ * @param[in] out Switch progress information output
+ */
+void CVskysub(PipelineImage &image, const float skylevelfactor, const float skyLR = 4096.0,
+              const float skyLG = 4096.0, const float skyLB = 4096.0, const bool out = false);
+
+/**
+ * @brief Subtracts the sky background in an image and a crop of it
+ * The background is determined on the image, the same subtraction is applied to the crop.
+ *
+ * @param[in,out] image Image the statistics are taken from (the full frame, possibly subsampled)
+ * @param[in,out] roi Crop, nothing is done with it if it is empty
+ * @param[in] skylevelfactor Skylevel will be considered to be the skylevelfactor times the value corresponding to the histogram maximum
+ * @param[in] skyLR Target red sky value (in 16bit, i.e. between 0 and 65535)
+ * @param[in] skyLG Target green sky value (in 16bit, i.e. between 0 and 65535)
+ * @param[in] skyLB Target blue sky value (in 16bit, i.e. between 0 and 65535)
+ * @param[in] out Switch progress information output
+ * @param[in,out] params Sky subtraction to record (starting from a seed if there is one) or to replay
+ *            instead of determining it (may be 0)
+ */
+void CVskysub(PipelineImage &image, PipelineImage &roi, const float skylevelfactor,
+              const float skyLR = 4096.0, const float skyLG = 4096.0, const float skyLB = 4096.0,
+              const bool out = false, SolvedParams *params = 0);
+
+
+/**
+ * @brief Settings of the stretch iterations (see autoRootpower())
+ */
+struct StretchSettings
+{
+    /// Skylevel will be considered to be the skylevelfactor times the value corresponding to the histogram maximum
+    float skylevelfactor;
+    /// Target red sky value (in 16bit)
+    float skyLR;
+    /// Target green sky value (in 16bit)
+    float skyLG;
+    /// Target blue sky value (in 16bit)
+    float skyLB;
+    /// Number of iterations of the root stretch
+    int rootiter;
+    /// Root power of the second iteration (<= 0 to use the same root power in all iterations)
+    double rootpower2;
+    /// Number of iterations of the S-curve
+    int scurveiter;
+    /// Factor parameter for the S-curve in odd iterations
+    float scurvepower1;
+    /// Offset parameter for the S-curve in odd iterations
+    float scurveoffset1;
+    /// Factor parameter for the S-curve in even iterations
+    float scurvepower2;
+    /// Offset parameter for the S-curve in even iterations
+    float scurveoffset2;
+
+    /**
+     * @brief Construct new settings with the defaults of the command line
+     */
+    StretchSettings();
+};
+
+/**
+ * @brief Solves for the root power with which a percentile of the stretched image reaches a target level
+ * Only the histograms are used: the root stretches, S-curves and sky subtractions following
+ * the first sky subtraction are monotonic maps of the pixel values in each channel, so they
+ * are applied to the values of the histogram bins to predict the histograms of the result.
+ * The root power is searched between 1 and 1000.
+ *
+ * @param[in] image Image after the first sky subtraction
+ * @param[in] settings Settings of the stretch iterations
+ * @param[in] percentile Percentile of the pixel values of all channels (in %)
+ * @param[in] target Target level of the percentile (between 0 and 1)
+ * @return Root power
+ */
+double autoRootpower(const PipelineImage &image, const StretchSettings &settings, const double percentile,
+                     const double target);
 
 /**
  * @brief Set the Black Point object
@@ -133,7 +791,7 @@ void setBlackPoint(cv::InputArray inImage, cv::OutputArray outImage, float bp);
 
 /**
  * @brief Applies a root stretch
- *
+ * The root is calculated in single precision for all root powers (see stretching() for PipelineImage).
  *
  * @param[in] inImage Input image
  * @param[out] outImage Output image
@@ -142,6 +800,29 @@ void setBlackPoint(cv::InputArray inImage, cv::OutputArray outImage, float bp);
 void stretching(
     cv::InputArray inImage, cv::OutputArray outImage, const double rootpower);
 
+/**
+ * @brief Applies a root stretch
+ * The pending transform of the image is applied in the same pass as the root, the final
+ * normalization is left pending.
+ *
+ * @param[in,out] image Image
+ * @param[in] rootpower Root power of the stretch
+ */
+void stretching(PipelineImage &image, const double rootpower);
+
+/**
+ * @brief Applies a root stretch to an image and a crop of it
+ * Both are normalized with the minimum of the image (or of the crop if it is lower, which only
+ * happens with a subsampled image).
+ *
+ * @param[in,out] image Image the statistics are taken from (the full frame, possibly subsampled)
+ * @param[in,out] roi Crop, nothing is done with it if it is empty
+ * @param[in] rootpower Root power of the stretch
+ * @param[in,out] params Normalization to record or to replay (may be 0)
+ */
+void stretching(PipelineImage &image, PipelineImage &roi, const double rootpower,
+                SolvedParams *params = 0);
+
 
 /**
  * @brief Applies an S-Curve stretch
@@ -154,6 +835,16 @@ void stretching(
 void scurve(cv::InputArray inImage, cv::OutputArray outImage, const float xfactor,
             const float xoffset);
 
+/**
+ * @brief Applies an S-Curve stretch
+ * The pending transform is applied in the same pass.
+ *
+ * @param[in,out] image Image
+ * @param[in] xfactor Factor parameter for the S-curve
+ * @param[in] xoffset Offset parameter for the S-curve
+ */
+void scurve(PipelineImage &image, const float xfactor, const float xoffset);
+
 /**
  * @brief Applies a colour correcetion
  * This essentially uses the colours before the images is stretched to correct for the
@@ -174,4 +865,45 @@ void colorcorr(cv::InputArray inImage, cv::InputArray ref, cv::OutputArray outIm
                const float skyLB = 4096.0, const float colorenhance =
                    1.0, const bool verbose = false);
 
+/**
+ * @brief Applies a colour correcetion
+ *
+ * @param[in,out] image Image (background subtracted and stretched)
+ * @param[in] ref Referene image for the colours (CV_32FC3, or CV_16UC3 as written by quantize())
+ * @param[in] skyLR Red target sky level that which was used in the background subtraction
+ * @param[in] skyLG Green target sky level that which was used in the background subtraction
+ * @param[in] skyLB Blue target sky level that which was used in the background subtraction
+ * @param[in] colorenhance Colour enhancement factor
+ * @param[in] verbose Switch for verbose option
+ * @param[in] refTiles Summary of the reference image, tiles where the reference is at the sky
+ *            level in all channels are not corrected (the colour ratios saturate there)
+ */
+void colorcorr(PipelineImage &image, cv::InputArray ref, const float skyLR = 4096.0,
+               const float skyLG = 4096.0, const float skyLB = 4096.0,
+               const float colorenhance = 1.0, const bool verbose = false,
+               const TileIndex &refTiles = TileIndex());
+
+/**
+ * @brief Applies a colour correcetion to an image and a crop of it
+ * Both are corrected with the maximum luminance of the image (or of the crop if it is higher,
+ * which only happens with a subsampled image).
+ *
+ * @param[in,out] image Image the statistics are taken from (the full frame, possibly subsampled)
+ * @param[in] ref Referene image for the colours of the image (CV_32FC3, or CV_16UC3 as written by
+ *            quantize() to save memory)
+ * @param[in,out] roi Crop, nothing is done with it if it is empty
+ * @param[in] roiRef Referene image for the colours of the crop
+ * @param[in] skyLR Red target sky level that which was used in the background subtraction
+ * @param[in] skyLG Green target sky level that which was used in the background subtraction
+ * @param[in] skyLB Blue target sky level that which was used in the background subtraction
+ * @param[in] colorenhance Colour enhancement factor
+ * @param[in] verbose Switch for verbose option
+ * @param[in] refTiles Summary of the reference image of the image
+ * @param[in,out] params Maximum luminance to record or to replay (may be 0)
+ */
+void colorcorr(PipelineImage &image, cv::InputArray ref, PipelineImage &roi, cv::InputArray roiRef,
+               const float skyLR = 4096.0, const float skyLG = 4096.0, const float skyLB = 4096.0,
+               const float colorenhance = 1.0, const bool verbose = false,
+               const TileIndex &refTiles = TileIndex(), SolvedParams *params = 0);
+
 #endif /* libj3colorstretch_hpp */
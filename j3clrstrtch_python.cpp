@@ -0,0 +1,497 @@
+/*******************************************************************************
+  Copyright(c) 2020 Joachim Janz. All rights reserved.
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation; either version 2 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU Library General Public License
+  along with this library; see the file COPYING.LIB.  If not, write to
+  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+  Boston, MA 02110-1301, USA.
+
+  The full GNU General Public License is included in this distribution in the
+  file called LICENSE.
+
+*******************************************************************************/
+
+/**
+ * @file j3clrstrtch_python.cpp
+ * @brief Python bindings of the stretch library
+ *
+ * The images are float32 NumPy arrays (or any other object with a C contiguous float buffer)
+ * of shape (h, w) or (h, w, 3) in BGR order, as used by cv2. They are wrapped without copying:
+ * all steps work in place on the buffer of the array. Other shapes, including planar arrays of
+ * shape (3, h, w), raise a ValueError, as they could only be processed on a copy. The GIL is released while an image is
+ * processed, so several images can be stretched concurrently from Python threads. An image
+ * itself is only used by one step at a time, other calls raise a RuntimeError meanwhile.
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include "opencv2/core.hpp"
+#include "opencv2/core/ocl.hpp"
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <string>
+
+#include "j3clrstrtch.hpp"
+
+/**
+ * @brief Python image object: a PipelineImage on the buffer of an array
+ */
+struct PyImage
+{
+    PyObject_HEAD
+    /// Buffer of the array, it keeps the array alive
+    Py_buffer view;
+    /// Image on the buffer (0 before initialization)
+    PipelineImage* image;
+    /// Switch set while a step runs on the image without the GIL (only accessed with the GIL)
+    bool busy;
+};
+
+/**
+ * @brief Get the buffer of an image array and wrap it as cv::Mat
+ *
+ * @param[in] obj Array
+ * @param[out] view Buffer, to be released with PyBuffer_Release() on success
+ * @param[out] mat Matrix on the buffer
+ * @param[in] writable Switch to request a writable buffer
+ * @return Status (0==OK, -1 with a Python exception set)
+ */
+static int getImageBuffer(PyObject* obj, Py_buffer* view, cv::Mat &mat, const bool writable)
+{
+    if (PyObject_GetBuffer(obj, view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT | (writable ? PyBUF_WRITABLE : 0)) < 0)
+        return -1;
+
+    const char* format = view->format ? view->format : "B";
+    const size_t len = std::strlen(format);
+    const bool isfloat = view->itemsize == 4 && len > 0 && format[len - 1] == 'f' && format[0] != '>' &&
+                         format[0] != '!';
+    const bool isimage = view->ndim == 2 || (view->ndim == 3 && (view->shape[2] == 1 || view->shape[2] == 3));
+    if (isfloat && view->ndim == 3 && view->shape[0] == 3 && view->shape[2] != 3 && view->shape[2] != 1)
+    {
+        // converting would need a copy, so the caller decides about it
+        PyBuffer_Release(view);
+        PyErr_SetString(PyExc_ValueError, "planar arrays of shape (3, h, w) are not supported, convert them with "
+                        "numpy.ascontiguousarray(numpy.moveaxis(array, 0, -1)) (a copy)");
+        return -1;
+    }
+    if (!isfloat || !isimage)
+    {
+        PyBuffer_Release(view);
+        PyErr_SetString(PyExc_ValueError, "expected a C contiguous float32 array of shape (h, w) or (h, w, 3)");
+        return -1;
+    }
+
+    const int cn = view->ndim == 3 ? (int)view->shape[2] : 1;
+    mat = cv::Mat((int)view->shape[0], (int)view->shape[1], CV_MAKETYPE(CV_32F, cn), view->buf);
+    return 0;
+}
+
+/// Thread budget of the steps (see set_threads), empty for OpenCV's thread pool
+static std::shared_ptr<ExecutionContext> context;
+
+/**
+ * @brief Check that an image is not used by a step running in another thread
+ *
+ * @param[in] self Image
+ * @return true if the image is free, otherwise a Python exception is set
+ */
+static bool idle(PyImage* self)
+{
+    if (self->busy)
+        PyErr_SetString(PyExc_RuntimeError, "image is in use");
+    return !self->busy;
+}
+
+/**
+ * @brief Run a step on an image without the GIL and turn C++ exceptions into Python exceptions
+ * The image is marked as busy meanwhile.
+ *
+ * @param[in] self Image
+ * @param[in] step Step to run
+ * @return None or 0 with a Python exception set
+ */
+template <typename Step>
+static PyObject* runStep(PyImage* self, const Step &step)
+{
+    if (!idle(self)) return 0;
+    self->busy = true;
+
+    std::string error;
+    // a context replaced while the step runs is kept alive by this reference
+    std::shared_ptr<ExecutionContext> stepContext = context;
+    Py_BEGIN_ALLOW_THREADS
+    ExecutionContext* previous = setExecutionContext(stepContext.get());
+    try
+    {
+        step();
+    }
+    catch (const std::exception &e)
+    {
+        error = e.what();
+    }
+    setExecutionContext(previous);
+    Py_END_ALLOW_THREADS
+    self->busy = false;
+
+    if (!error.empty())
+    {
+        PyErr_SetString(PyExc_RuntimeError, error.c_str());
+        return 0;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject* Image_new(PyTypeObject* type, PyObject* /*args*/, PyObject* /*kwds*/)
+{
+    PyImage* self = reinterpret_cast<PyImage*>(type->tp_alloc(type, 0));
+    if (self)
+    {
+        std::memset(&self->view, 0, sizeof(self->view));
+        self->image = 0;
+        self->busy = false;
+    }
+    return reinterpret_cast<PyObject*>(self);
+}
+
+static int Image_init(PyImage* self, PyObject* args, PyObject* kwds)
+{
+    static const char* kwlist[] = {"array", "normalize", 0};
+    PyObject* array;
+    int normalize = 1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|p", const_cast<char**>(kwlist), &array, &normalize))
+        return -1;
+
+    Py_buffer view;
+    cv::Mat mat;
+    if (getImageBuffer(array, &view, mat, true) < 0)
+        return -1;
+    // a step running on the old image would use the deleted one
+    if (!idle(self))
+    {
+        PyBuffer_Release(&view);
+        return -1;
+    }
+
+    if (self->image)
+    {
+        delete self->image;
+        PyBuffer_Release(&self->view);
+    }
+    self->view = view;
+    self->image = new PipelineImage(mat);
+    if (normalize)
+        normalizeMinMax(*self->image);
+    return 0;
+}
+
+static void Image_dealloc(PyImage* self)
+{
+    if (self->image)
+    {
+        delete self->image;
+        PyBuffer_Release(&self->view);
+    }
+    // instances of heap types hold a reference to their type
+    PyTypeObject* type = Py_TYPE(self);
+    type->tp_free(reinterpret_cast<PyObject*>(self));
+    Py_DECREF(type);
+}
+
+/**
+ * @brief Check that an image object was initialized
+ *
+ * @param[in] self Image
+ * @return true if the image was initialized, otherwise a Python exception is set
+ */
+static bool initialized(PyImage* self)
+{
+    if (!self->image)
+        PyErr_SetString(PyExc_ValueError, "image is not initialized");
+    return self->image != 0;
+}
+
+/**
+ * @brief Check that an image can be used by a step (initialized and not in use)
+ *
+ * @param[in] self Image
+ * @return true if the image can be used, otherwise a Python exception is set
+ */
+static bool available(PyImage* self)
+{
+    return initialized(self) && idle(self);
+}
+
+static PyObject* Image_tone_curve(PyImage* self, PyObject* /*unused*/)
+{
+    if (!available(self)) return 0;
+    PipelineImage &image = *self->image;
+    return runStep(self, [&]()
+    {
+        toneCurve(image);
+    });
+}
+
+static PyObject* Image_skysub(PyImage* self, PyObject* args, PyObject* kwds)
+{
+    static const char* kwlist[] = {"skylevelfactor", "sky_r", "sky_g", "sky_b", 0};
+    float skylevelfactor = 0.06f, skyLR = 4096.f, skyLG = 4096.f, skyLB = 4096.f;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|ffff", const_cast<char**>(kwlist), &skylevelfactor, &skyLR,
+                                     &skyLG, &skyLB))
+        return 0;
+    if (!available(self)) return 0;
+    PipelineImage &image = *self->image;
+    return runStep(self, [&]()
+    {
+        CVskysub(image, skylevelfactor, skyLR, skyLG, skyLB);
+    });
+}
+
+static PyObject* Image_stretch(PyImage* self, PyObject* args, PyObject* kwds)
+{
+    static const char* kwlist[] = {"rootpower", 0};
+    double rootpower = 6.0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|d", const_cast<char**>(kwlist), &rootpower))
+        return 0;
+    if (!available(self)) return 0;
+    PipelineImage &image = *self->image;
+    return runStep(self, [&]()
+    {
+        stretching(image, rootpower);
+    });
+}
+
+static PyObject* Image_scurve(PyImage* self, PyObject* args, PyObject* kwds)
+{
+    static const char* kwlist[] = {"xfactor", "xoffset", 0};
+    float xfactor = 5.0f, xoffset = 0.42f;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|ff", const_cast<char**>(kwlist), &xfactor, &xoffset))
+        return 0;
+    if (!available(self)) return 0;
+    PipelineImage &image = *self->image;
+    return runStep(self, [&]()
+    {
+        scurve(image, xfactor, xoffset);
+    });
+}
+
+static PyObject* Image_set_min(PyImage* self, PyObject* args, PyObject* kwds)
+{
+    static const char* kwlist[] = {"min_r", "min_g", "min_b", 0};
+    float minr = 0.f, ming = 0.f, minb = 0.f;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|fff", const_cast<char**>(kwlist), &minr, &ming, &minb))
+        return 0;
+    if (!available(self)) return 0;
+    PipelineImage &image = *self->image;
+    return runStep(self, [&]()
+    {
+        setMin(image, minr, ming, minb);
+    });
+}
+
+static PyObject* Image_colorcorr(PyImage* self, PyObject* args, PyObject* kwds)
+{
+    static const char* kwlist[] = {"ref", "sky_r", "sky_g", "sky_b", "colorenhance", 0};
+    PyObject* refobj;
+    float skyLR = 4096.f, skyLG = 4096.f, skyLB = 4096.f, colorenhance = 1.0f;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|ffff", const_cast<char**>(kwlist), &refobj, &skyLR, &skyLG,
+                                     &skyLB, &colorenhance))
+        return 0;
+
+    // the buffer is taken first, as getting it may run Python code in which another thread could
+    // start a step on the image
+    Py_buffer view;
+    cv::Mat ref;
+    if (getImageBuffer(refobj, &view, ref, false) < 0)
+        return 0;
+    if (!available(self))
+    {
+        PyBuffer_Release(&view);
+        return 0;
+    }
+    PipelineImage &image = *self->image;
+    if (ref.size() != image.data.size() || ref.channels() != 3 || image.data.channels() != 3)
+    {
+        PyBuffer_Release(&view);
+        PyErr_SetString(PyExc_ValueError, "colorcorr needs colour images of the same size");
+        return 0;
+    }
+
+    PyObject* ret = runStep(self, [&]()
+    {
+        colorcorr(image, ref, skyLR, skyLG, skyLB, colorenhance);
+    });
+    PyBuffer_Release(&view);
+    return ret;
+}
+
+static PyObject* Image_apply(PyImage* self, PyObject* /*unused*/)
+{
+    if (!available(self)) return 0;
+    PipelineImage &image = *self->image;
+    return runStep(self, [&]()
+    {
+        image.materialize();
+    });
+}
+
+static PyObject* Image_get_array(PyImage* self, void* /*closure*/)
+{
+    if (!initialized(self)) return 0;
+    Py_INCREF(self->view.obj);
+    return self->view.obj;
+}
+
+static PyMethodDef Image_methods[] =
+{
+    {"tone_curve", reinterpret_cast<PyCFunction>(Image_tone_curve), METH_NOARGS, "Applies the tone curve"},
+    {
+        "skysub", reinterpret_cast<PyCFunction>(reinterpret_cast<void (*)(void)>(Image_skysub)),
+        METH_VARARGS | METH_KEYWORDS,
+        "skysub(skylevelfactor=0.06, sky_r=4096, sky_g=4096, sky_b=4096)\n\nSubtracts the sky background (target levels in 16bit)"
+    },
+    {
+        "stretch", reinterpret_cast<PyCFunction>(reinterpret_cast<void (*)(void)>(Image_stretch)),
+        METH_VARARGS | METH_KEYWORDS, "stretch(rootpower=6.0)\n\nApplies a root stretch"
+    },
+    {
+        "scurve", reinterpret_cast<PyCFunction>(reinterpret_cast<void (*)(void)>(Image_scurve)),
+        METH_VARARGS | METH_KEYWORDS, "scurve(xfactor=5.0, xoffset=0.42)\n\nApplies an S-curve"
+    },
+    {
+        "set_min", reinterpret_cast<PyCFunction>(reinterpret_cast<void (*)(void)>(Image_set_min)),
+        METH_VARARGS | METH_KEYWORDS, "set_min(min_r=0, min_g=0, min_b=0)\n\nSets the minimum of each channel (between 0 and 1)"
+    },
+    {
+        "colorcorr", reinterpret_cast<PyCFunction>(reinterpret_cast<void (*)(void)>(Image_colorcorr)),
+        METH_VARARGS | METH_KEYWORDS,
+        "colorcorr(ref, sky_r=4096, sky_g=4096, sky_b=4096, colorenhance=1.0)\n\nApplies the colour correction with the colours of ref (float32, same shape)"
+    },
+    {
+        "apply", reinterpret_cast<PyCFunction>(Image_apply), METH_NOARGS,
+        "Applies the pending transform, afterwards the array holds the result"
+    },
+    {0, 0, 0, 0}
+};
+
+static PyGetSetDef Image_getset[] =
+{
+    {const_cast<char*>("array"), reinterpret_cast<getter>(Image_get_array), 0, const_cast<char*>("Array of the image"), 0},
+    {0, 0, 0, 0, 0}
+};
+
+static PyType_Slot Image_slots[] =
+{
+    {Py_tp_new, reinterpret_cast<void*>(Image_new)},
+    {Py_tp_init, reinterpret_cast<void*>(Image_init)},
+    {Py_tp_dealloc, reinterpret_cast<void*>(Image_dealloc)},
+    {Py_tp_methods, Image_methods},
+    {Py_tp_getset, Image_getset},
+    {
+        Py_tp_doc, const_cast<char*>("Image(array, normalize=True)\n\nImage on the buffer of a float32 array, "
+                                     "normalized to the range from 0 to 1 unless normalize is False")
+    },
+    {0, 0}
+};
+
+static PyType_Spec Image_spec =
+{
+    "j3clrstrtch.Image", sizeof(PyImage), 0, Py_TPFLAGS_DEFAULT, Image_slots
+};
+
+static PyObject* set_fast_math(PyObject* /*module*/, PyObject* args)
+{
+    int enable;
+    if (!PyArg_ParseTuple(args, "p", &enable))
+        return 0;
+    setFastMath(enable != 0);
+    Py_RETURN_NONE;
+}
+
+static PyObject* set_sampled_hists(PyObject* /*module*/, PyObject* args)
+{
+    int enable;
+    if (!PyArg_ParseTuple(args, "p", &enable))
+        return 0;
+    setSampledHists(enable != 0);
+    Py_RETURN_NONE;
+}
+
+static PyObject* set_opencl(PyObject* /*module*/, PyObject* args)
+{
+    int enable;
+    if (!PyArg_ParseTuple(args, "p", &enable))
+        return 0;
+    cv::ocl::setUseOpenCL(enable != 0);
+    return PyBool_FromLong(setOpenCL(enable != 0));
+}
+
+static PyObject* set_threads(PyObject* /*module*/, PyObject* args)
+{
+    int threads;
+    const char* cpuList = 0;
+    if (!PyArg_ParseTuple(args, "i|z", &threads, &cpuList))
+        return 0;
+    std::vector<int> cpus;
+    if (cpuList && parseCpuList(cpuList, cpus) < 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "invalid CPU list");
+        return 0;
+    }
+    if (threads > 0 || !cpus.empty())
+        context = std::make_shared<ExecutionContext>(threads, cpus);
+    else
+        context.reset();
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef module_methods[] =
+{
+    {"set_fast_math", set_fast_math, METH_VARARGS, "Switches the fast approximations of pow and exp on or off"},
+    {"set_sampled_hists", set_sampled_hists, METH_VARARGS,
+     "Switches the sampled histograms of the sky subtraction on large images on or off"},
+    {"set_opencl", set_opencl, METH_VARARGS,
+     "Switches the optional OpenCL kernels for two steps, colorcorr and set_min, on or off, returns whether\n"
+     "they are used (the other steps and the data stay on the CPU)"},
+    {"set_threads", set_threads, METH_VARARGS,
+     "set_threads(n, cpus=None) runs the steps on n threads of their own (0 for OpenCV's thread pool), optionally\n"
+     "bound to CPUs, e.g. '0-7'. Steps called concurrently from several Python threads share the budget."},
+    {0, 0, 0, 0}
+};
+
+static PyModuleDef module =
+{
+    PyModuleDef_HEAD_INIT, "j3clrstrtch",
+    "Stretching of astronomical images while preserving the colours.\n\n"
+    "Image(array, normalize=True) wraps a float32 array of shape (h, w) or (h, w, 3) in BGR order without\n"
+    "copying, all steps work in place on the array. The steps leave an affine transform pending, after\n"
+    "apply() the array holds the result. Other shapes, including planar (3, h, w) arrays, raise a ValueError;\n"
+    "numpy.ascontiguousarray(numpy.moveaxis(array, 0, -1)) converts a planar array (as a copy).",
+    -1, module_methods, 0, 0, 0, 0
+};
+
+PyMODINIT_FUNC PyInit_j3clrstrtch(void)
+{
+    PyObject* m = PyModule_Create(&module);
+    if (!m)
+        return 0;
+    PyObject* type = PyType_FromSpec(&Image_spec);
+    if (!type || PyModule_AddObject(m, "Image", type) < 0)
+    {
+        Py_XDECREF(type);
+        Py_DECREF(m);
+        return 0;
+    }
+    return m;
+}
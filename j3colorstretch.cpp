@@ -23,13 +23,53 @@
 
 #include "opencv2/core.hpp"
 #include "opencv2/highgui.hpp"
+#include "opencv2/imgproc.hpp"
+#include "opencv2/videoio.hpp"
 #include <opencv2/core/ocl.hpp>
 
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <fstream>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#ifdef HAVE_JPEG
+#include <jpeglib.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_TIFF
+#include <tiffio.h>
+#endif
 
 #include "j3clrstrtch.hpp"
 
+#ifndef J3CS_VERSION
+#define J3CS_VERSION "unknown"
+#endif
+
 
 /**
  * @brief Trim white space from string
@@ -57,6 +97,8 @@ struct CustomCLP2
         cv::CommandLineParser _clp;
         /// Vector to hold positional arguments
         std::vector<std::string> pos_args;
+        /// Vector to hold all values of the (repeatable) output argument
+        std::vector<std::string> outputs;
 
     public:
         /**
@@ -73,6 +115,10 @@ struct CustomCLP2
             {
                 std::string s(argv[i]);
                 s = trim(s);
+                const size_t k = s.find_first_not_of('-');
+                if (k > 0 && k != std::string::npos &&
+                        (s.compare(k, 2, "o=") == 0 || s.compare(k, 7, "output=") == 0))
+                    outputs.push_back(s.substr(s.find('=') + 1));
                 if (s[0] == '-')
                     continue;
 
@@ -168,289 +214,2655 @@ struct CustomCLP2
 };
 
 /**
- * @brief Scale image to 16 bit range and write tiff file
+ * @brief Interface for encoders which receive the quantized image stripe by stripe
  *
- * @param[in] ofile File name
- * @param[in] output Image to be written
- * @return Status (0==OK)
  */
-int writeTif(const char* ofile, cv::Mat output)
+class StripeWriter
 {
-    cv::Mat out;
-    if (output.channels() == 3)
-    {
-        output.convertTo(out, CV_16UC3, 65535.);
-    }
-    if (output.channels() == 1)
-    {
-        output.convertTo(
-            out, CV_16UC1, 1, 65535.);
-    }
+    public:
+        virtual ~StripeWriter() {}
 
-    cv::imwrite(ofile, out);
-    return 0;
-}
+        /**
+         * @brief Start writing an image
+         *
+         * @param[in] width Width of the image
+         * @param[in] height Height of the image
+         * @param[in] channels Number of channels (1 or 3)
+         * @param[in] depth Depth of the samples (CV_8U or CV_16U)
+         * @return Status (0==OK)
+         */
+        virtual int open(const int width, const int height, const int channels, const int depth) = 0;
+
+        /**
+         * @brief Write the next stripe of rows
+         * All stripes but the last one have stripeRows() rows.
+         *
+         * @param[in] rows Quantized rows (continuous)
+         * @return Status (0==OK)
+         */
+        virtual int write(const cv::Mat &rows) = 0;
+
+        /**
+         * @brief Finish writing the image
+         *
+         * @return Status (0==OK)
+         */
+        virtual int close() = 0;
+
+        /**
+         * @brief Number of rows in each stripe
+         *
+         * @return Number of rows
+         */
+        virtual int stripeRows() const
+        {
+            return 64;
+        }
+
+        /**
+         * @brief Whether the channels are expected in RGB rather than in OpenCV's BGR order
+         *
+         * @return true for RGB
+         */
+        virtual bool rgb() const
+        {
+            return true;
+        }
+};
 
 
 /**
- * @brief Scale image to 8 bit range and write jpeg file
+ * @brief Compresses data with the LZW variant of the TIFF specification
  *
- * @param[in] ofile File name
- * @param[in] output Image to be written
- * @return Status (0==OK)
+ * @param[in] src Input data
+ * @param[in] n Number of bytes
+ * @param[out] dst Compressed data
  */
-int writeJpg(const char* ofile, cv::Mat output)
+void lzwEncode(const uchar* src, const size_t n, std::vector<uchar> &dst)
 {
-    cv::Mat out;
-    if (output.channels() == 3)
+    const int clearCode = 256;
+    const int eoiCode = 257;
+    const int firstCode = 258;
+    const int maxEntries = 4094;
+    const int hsize = 8192;
+
+    dst.clear();
+    dst.reserve(n / 2 + 64);
+
+    std::vector<int> hkey(hsize, -1);
+    std::vector<short> hcode(hsize);
+
+    unsigned long bitbuf = 0;
+    int nbitsbuf = 0;
+    int nbits = 9;
+    int freeEnt = firstCode;
+
+    auto put = [&](int code)
     {
-        output.convertTo(out, CV_8UC3, 255.);
-    }
-    if (output.channels() == 1)
+        bitbuf = (bitbuf << nbits) | code;
+        nbitsbuf += nbits;
+        while (nbitsbuf >= 8)
+        {
+            nbitsbuf -= 8;
+            dst.push_back((uchar)(bitbuf >> nbitsbuf));
+        }
+    };
+    // the code width grows after entry 511, 1023 and 2047 have been added
+    auto added = [&]()
     {
-        output.convertTo(
-            out, CV_8UC1, 1, 255.);
-    }
+        freeEnt++;
+        if (freeEnt == maxEntries)
+        {
+            put(clearCode);
+            std::fill(hkey.begin(), hkey.end(), -1);
+            freeEnt = firstCode;
+            nbits = 9;
+        }
+        else if (freeEnt > (1 << nbits) - 1)
+        {
+            nbits++;
+        }
+    };
 
-    cv::imwrite(ofile, out);
-    return 0;
+    put(clearCode);
+    if (n > 0)
+    {
+        int ent = src[0];
+        for (size_t i = 1; i < n; i++)
+        {
+            const int c = src[i];
+            const int key = (ent << 8) | c;
+            unsigned int h = ((unsigned int)key * 2654435761u) >> 19;
+            while (hkey[h] != -1 && hkey[h] != key)
+                h = (h + 1) & (hsize - 1);
+
+            if (hkey[h] == key)
+            {
+                ent = hcode[h];
+                continue;
+            }
+            put(ent);
+            hkey[h] = key;
+            hcode[h] = (short)freeEnt;
+            ent = c;
+            added();
+        }
+        put(ent);
+        // the decoder adds an entry after the last code as well
+        added();
+    }
+    put(eoiCode);
+    if (nbitsbuf > 0)
+        dst.push_back((uchar)(bitbuf << (8 - nbitsbuf)));
 }
 
+
 /**
- * @brief Read image and convert to 32 bit floating point
+ * @brief Compresses data with the PackBits scheme, each row separately
  *
- * @param[in] file File name
- * @param[in] image cv::Mat to hold the image
- * @return Status (0==OK)
+ * @param[in] src Input data
+ * @param[in] n Number of bytes
+ * @param[in] rowbytes Number of bytes in each row
+ * @param[out] dst Compressed data
  */
-int readImage(const char* file, cv::Mat &image)
+void packBitsEncode(const uchar* src, const size_t n, const size_t rowbytes, std::vector<uchar> &dst)
 {
-    image = cv::imread(file, cv::IMREAD_COLOR | cv::IMREAD_ANYDEPTH);
-    if (image.empty())
+    dst.clear();
+    dst.reserve(n + n / 128 + 16);
+    for (size_t row = 0; row < n; row += rowbytes)
     {
-        std::cout << "Error reading image." << std::endl;
-        return -1;
+        const uchar* p = src + row;
+        const size_t len = std::min(rowbytes, n - row);
+        size_t i = 0;
+        while (i < len)
+        {
+            // length of the run starting at i
+            size_t run = 1;
+            while (i + run < len && run < 128 && p[i + run] == p[i])
+                run++;
+            if (run > 1)
+            {
+                dst.push_back((uchar)(257 - run));
+                dst.push_back(p[i]);
+                i += run;
+                continue;
+            }
+            // literal bytes up to the next run of at least two bytes
+            size_t lit = 1;
+            while (i + lit < len && lit < 128 && !(i + lit + 1 < len && p[i + lit] == p[i + lit + 1]))
+                lit++;
+            dst.push_back((uchar)(lit - 1));
+            dst.insert(dst.end(), p + i, p + i + lit);
+            i += lit;
+        }
     }
+}
 
-    if (image.channels() == 1)
-    {
-        image.convertTo(image, CV_32FC1);
-    }
-    else
+
+/**
+ * @brief Applies the horizontal differencing predictor of the TIFF specification in place
+ *
+ * @param[in,out] data Rows of samples
+ * @param[in] rows Number of rows
+ * @param[in] cols Number of pixels in each row
+ * @param[in] cn Number of channels
+ * @param[in] bits Bits per sample (8 or 16)
+ */
+void horizontalDifferencing(uchar* data, const int rows, const int cols, const int cn, const int bits)
+{
+    for (int row = 0; row < rows; row++)
     {
-        image.convertTo(image, CV_32FC3);
+        if (bits == 8)
+        {
+            uchar* p = data + (size_t)row * cols * cn;
+            for (int i = cols * cn - 1; i >= cn; i--)
+                p[i] = (uchar)(p[i] - p[i - cn]);
+        }
+        else
+        {
+            ushort* p = (ushort*)data + (size_t)row * cols * cn;
+            for (int i = cols * cn - 1; i >= cn; i--)
+                p[i] = (ushort)(p[i] - p[i - cn]);
+        }
     }
-    return 0;
 }
 
+
+/// TIFF compression schemes
+enum TiffCompression { TIFF_NONE = 1, TIFF_LZW = 5, TIFF_DEFLATE = 8, TIFF_PACKBITS = 32773 };
+
 /**
- * @brief Test whether file exists
+ * @brief Options for writing TIFF files
  *
- * @param filename Filename
- * @return true
- * @return false
  */
-bool fexists(const std::string &filename)
+struct TiffOptions
 {
-    std::ifstream ifile(filename.c_str());
-    return (bool)ifile;
-}
+    /// Compression scheme
+    TiffCompression compression;
+    /// Switch for the horizontal differencing predictor (only used with LZW and Deflate)
+    bool predictor;
+    /// Size of the (square) tiles, 0 for strips
+    int tile;
+    /// Switch to always write a BigTIFF file, otherwise it is used if the file could exceed 4 GB
+    bool bigtiff;
 
-int main(int argc, char** argv)
+    TiffOptions() : compression(TIFF_LZW), predictor(false), tile(0), bigtiff(false)
+    {}
+};
+
+
+/**
+ * @brief Class with the code for compressing the chunks of a TIFF file to be run by OpenCV's parallel_for_
+ *
+ */
+class ParallelCompress : public cv::ParallelLoopBody
 {
-    cv::String keys = "{help h usage   |        | print this message   }"
-                      "{o output  |        | output image (without the result will be displayed, supports jpg and tif)}"
-                      "{f               |       | force to overwrite output file}"
-                      "{tc tonecurve   |        | application of a tone curve}"
-                      "{sl skylevelfactor | 0.06 | sky level relative to the histogram peak  }"
-                      "{zerosky    | 4096.0    | desired zero point on sky, sets all channels}"
-                      "{zeroskyred    |        | desired zero point on sky, red channel}"
-                      "{zeroskygreen  |        | desired zero point on sky, green channel}"
-                      "{zeroskyblue   |        | desired zero point on sky, bue channel }"
-                      "{ri rootiter    | 1      | number of iterations on applying rootpower - sky }"
-                      "{rp rootpower   | 6.0    | power factor: 1/rootpower}"
-                      "{rp2 rootpower2 |        | use this power on iteration 2}"
-                      "{si scurveiter    | 0      | number of iterations on applying scurve - sky }"
-                      "{sc scurvepower   | 5.0    | scurve power odd iterations}"
-                      "{so scurveoffset  | 0.42    | scurve offset odd iterations}"
-                      "{sc2 scurvepower2 | 3.0    | scurve power  even iterations}"
-                      "{so2 scurveoffset2| 0.22   | scurve offset even iterations}"
-                      "{ccf color      | 1.0    | default enhancement value }" // PUT TOGETHER WITH COLOR FACTOR OF 1.2!!
-                      "{ncc nocolorcorrect |     | turn off color correction }"
-                      "{min    |        | set minimum in all channels (in 16bit)}"
-                      "{minr   |        | set minimum r (in 16bit)}"
-                      "{ming   |        | set minimum g (in 16bit)}"
-                      "{minb   |        | set minimum b (in 16bit)}"
-                      "{x no-display    |        | no display}"
-                      "{v verbose   |        | print some progress information }";
-    //                      "{bp blackpoint   |     0   | set blackpoint (in units..) }";
+    public:
+        /**
+         * @brief Construct a new Parallel Compress object
+         *
+         * @param rows Stripe of quantized rows
+         * @param rects Strips or tiles within the stripe
+         * @param chunkSize Size of each chunk (tiles are padded to the full size)
+         * @param options TIFF options
+         * @param scratch Scratch buffers (one for each chunk)
+         * @param out Compressed chunks
+         */
+        ParallelCompress (const cv::Mat &rows, const std::vector<cv::Rect> &rects, const cv::Size chunkSize,
+                          const TiffOptions &options, std::vector<std::vector<uchar> > &scratch,
+                          std::vector<std::vector<uchar> > &out) : rows(rows), rects(rects), chunkSize(chunkSize),
+            options(options), scratch(scratch), out(out)
+        {}
+        virtual void operator ()(const cv::Range &range) const override
+        {
+            const int cn = rows.channels();
+            const size_t esz = rows.elemSize();
+            const bool tiled = options.tile > 0;
+            const bool predictor = options.predictor &&
+                                   (options.compression == TIFF_LZW || options.compression == TIFF_DEFLATE);
+            for (int n = range.start; n < range.end; n++)
+            {
+                const cv::Rect &r = rects[n];
+                const size_t rowbytes = chunkSize.width * esz;
+                const uchar* data;
+                size_t size;
 
-    cv::ocl::setUseOpenCL(true);
+                if (!tiled && !predictor)
+                {
+                    // strips are continuous in the stripe
+                    data = rows.ptr<uchar>(r.y);
+                    size = r.height * rowbytes;
+                }
+                else
+                {
+                    // tiles are always padded to their full size, the last strip is not
+                    const int chunkRows = tiled ? chunkSize.height : r.height;
+                    std::vector<uchar> &buf = scratch[n];
+                    buf.assign(chunkRows * rowbytes, 0);
+                    for (int row = 0; row < r.height; row++)
+                    {
+                        const uchar* p = rows.ptr<uchar>(r.y + row) + r.x * esz;
+                        std::copy(p, p + r.width * esz, &buf[row * rowbytes]);
+                    }
+                    size = buf.size();
+                    if (predictor)
+                        horizontalDifferencing(&buf[0], chunkRows, chunkSize.width, cn, (int)(esz / cn * 8));
+                    data = &buf[0];
+                }
 
-    CustomCLP2 clp(argc, argv, keys);
+                std::vector<uchar> &dst = out[n];
+                if (options.compression == TIFF_LZW)
+                {
+                    lzwEncode(data, size, dst);
+                }
+                else if (options.compression == TIFF_PACKBITS)
+                {
+                    packBitsEncode(data, size, rowbytes, dst);
+                }
+#ifdef HAVE_ZLIB
+                else if (options.compression == TIFF_DEFLATE)
+                {
+                    uLongf len = compressBound(size);
+                    dst.resize(len);
+                    compress2(&dst[0], &len, data, size, Z_DEFAULT_COMPRESSION);
+                    dst.resize(len);
+                }
+#endif
+                else
+                {
+                    dst.assign(data, data + size);
+                }
+            }
+        }
+        ParallelCompress &operator=(const ParallelCompress &)
+        {
+            return *this;
+        };
+    private:
+        const cv::Mat &rows;
+        const std::vector<cv::Rect> &rects;
+        cv::Size chunkSize;
+        const TiffOptions &options;
+        std::vector<std::vector<uchar> > &scratch;
+        std::vector<std::vector<uchar> > &out;
+};
 
-    long int N = clp.n_positional_args();
-    if (clp.get<bool>("help") || N == 0)
-    {
-        clp.printMessage();
-        return 0;
-    }
 
-    const bool verbose = clp.get<bool>("verbose");
-    std::string ext = "";
-    cv::String outf ;
-    if (clp.has("o"))
-    {
-        outf = clp.get<cv::String>("o");
+/**
+ * @brief Writes a TIFF (or BigTIFF) file in strips or tiles
+ * The strips or tiles of each stripe are compressed in parallel and written in order
+ * as they arrive, the directory is appended at the end.
+ *
+ */
+class TiffWriter : public StripeWriter
+{
+    public:
+        /**
+         * @brief Construct a new Tiff Writer object
+         *
+         * @param[in] file File name
+         * @param[in] options Compression, predictor, tiling and BigTIFF options
+         */
+        TiffWriter(const char* file, const TiffOptions &options = TiffOptions()) : file(file),
+            options(options), fp(0), pos(0), width(0), height(0), channels(0), bits(0), big(false)
+        {}
 
-        ext = outf.substr(outf.find_last_of(".") + 1);
-        if (ext != "jpg" && ext != "jpeg" && ext != "tif" && ext != "tiff")
+        ~TiffWriter()
         {
-            std::cout << "    Unknown file extension" << std::endl;
-            return -1;
+            if (fp) std::fclose(fp);
         }
-        const std::string ofile = std::string(outf.c_str());
-        if ( fexists(ofile) && !clp.get<bool>("f"))
+
+        int open(const int w, const int h, const int cn, const int depth) override
         {
-            std::cout << "    File " << ofile << " exists" << std::endl;
-            return -1;
+#ifndef HAVE_ZLIB
+            if (options.compression == TIFF_DEFLATE)
+            {
+                std::cout << "    Deflate compression is not available (compiled without zlib)" << std::endl;
+                return -1;
+            }
+#endif
+            fp = std::fopen(file.c_str(), "wb");
+            if (!fp)
+            {
+                std::cout << "    Error opening " << file << std::endl;
+                return -1;
+            }
+            width = w;
+            height = h;
+            channels = cn;
+            bits = depth == CV_8U ? 8 : 16;
+            offsets.clear();
+            counts.clear();
+            pos = 0;
+
+            // compressed data can be larger than the raw data, so leave some margin
+            const uint64_t rawsize = (uint64_t)w * h * cn * bits / 8;
+            big = options.bigtiff || rawsize + rawsize / 8 > 0xFFFFFFFFull - (1ull << 24);
+
+            // the samples are written in the native byte order
+            const uint16_t one = 1;
+            const char* order = *(const uchar*)&one == 1 ? "II" : "MM";
+            putBytes(order, 2);
+            if (big)
+            {
+                put16(43);
+                put16(8);
+                put16(0);
+                put64(0); // offset of the directory, written in close()
+            }
+            else
+            {
+                put16(42);
+                put32(0);
+            }
+            return 0;
         }
-    }
 
-    float skylevelfactor = clp.get<float>("sl");
-    float skyLR = clp.get<float>("zerosky");
-    float skyLG = clp.get<float>("zerosky");
-    float skyLB = clp.get<float>("zerosky");
+        int write(const cv::Mat &rows) override
+        {
+            // strips or tiles within this stripe
+            std::vector<cv::Rect> rects;
+            cv::Size chunkSize;
+            if (options.tile > 0)
+            {
+                chunkSize = cv::Size(options.tile, options.tile);
+                for (int x = 0; x < rows.cols; x += options.tile)
+                    rects.push_back(cv::Rect(x, 0, std::min(options.tile, rows.cols - x), rows.rows));
+            }
+            else
+            {
+                chunkSize = cv::Size(rows.cols, rowsPerStrip());
+                for (int y = 0; y < rows.rows; y += chunkSize.height)
+                    rects.push_back(cv::Rect(0, y, rows.cols, std::min(chunkSize.height, rows.rows - y)));
+            }
 
-    if(clp.has("zeroskyred")) skyLR = clp.get<float>("zeroskyred");
-    if(clp.has("zeroskygreen")) skyLG = clp.get<float>("zeroskygreen");
-    if(clp.has("zeroskyblue")) skyLB = clp.get<float>("zeroskyblue");
+            const int n = (int)rects.size();
+            scratch.resize(n);
+            chunks.resize(n);
+            ParallelCompress parallelCompress(rows, rects, chunkSize, options, scratch, chunks);
+            parallelFor(cv::Range(0, n), parallelCompress);
 
-    //clp.errorCheck();
+            for (int i = 0; i < n; i++)
+            {
+                if (!big && pos + chunks[i].size() > 0xFFFFFFFFull)
+                {
+                    std::cout << "    Output exceeds 4 GB, use the bigtiff option" << std::endl;
+                    return -1;
+                }
+                offsets.push_back(pos);
+                counts.push_back(chunks[i].size());
+                putBytes(chunks[i].data(), chunks[i].size());
+                if (pos & 1) putBytes("", 1);
+            }
+            return std::ferror(fp) ? -1 : 0;
+        }
 
-    cv::Mat thisIma;
-    if(verbose) std::cout << "  Reading image" << clp.pos_args[0].c_str() << std::endl;
-    if(readImage(clp.pos_args[0].c_str(), thisIma) < 0)
-        return -1;
+        int close() override
+        {
+            const uint16_t offType = big ? LONG8_T : LONG_T;
+            const bool tiled = options.tile > 0;
 
-    cv::Mat output_norm;
-    cv::normalize(thisIma, output_norm, 1., 0., cv::NORM_MINMAX); // TBD factor
+            std::vector<Entry> entries;
+            entries.push_back(Entry(256, LONG_T, std::vector<uint64_t>(1, width)));
+            entries.push_back(Entry(257, LONG_T, std::vector<uint64_t>(1, height)));
+            entries.push_back(Entry(258, SHORT_T, std::vector<uint64_t>(channels, bits)));
+            entries.push_back(Entry(259, SHORT_T, std::vector<uint64_t>(1, options.compression)));
+            entries.push_back(Entry(262, SHORT_T, std::vector<uint64_t>(1, channels == 1 ? 1 : 2)));
+            if (!tiled) entries.push_back(Entry(273, offType, offsets));
+            entries.push_back(Entry(277, SHORT_T, std::vector<uint64_t>(1, channels)));
+            if (!tiled) entries.push_back(Entry(278, LONG_T, std::vector<uint64_t>(1, rowsPerStrip())));
+            if (!tiled) entries.push_back(Entry(279, offType, counts));
+            entries.push_back(Entry(284, SHORT_T, std::vector<uint64_t>(1, 1)));
+            if (options.predictor && (options.compression == TIFF_LZW || options.compression == TIFF_DEFLATE))
+                entries.push_back(Entry(317, SHORT_T, std::vector<uint64_t>(1, 2)));
+            if (tiled) entries.push_back(Entry(322, LONG_T, std::vector<uint64_t>(1, options.tile)));
+            if (tiled) entries.push_back(Entry(323, LONG_T, std::vector<uint64_t>(1, options.tile)));
+            if (tiled) entries.push_back(Entry(324, offType, offsets));
+            if (tiled) entries.push_back(Entry(325, offType, counts));
 
-    if(!clp.has("x"))    showHist(output_norm, "Input Image");
+            // arrays which do not fit into the directory entries
+            const size_t inlineBytes = big ? 8 : 4;
+            for (size_t i = 0; i < entries.size(); i++)
+            {
+                if (entries[i].values.size() * typeSize(entries[i].type) > inlineBytes)
+                {
+                    entries[i].offset = pos;
+                    for (size_t j = 0; j < entries[i].values.size(); j++)
+                        putValue(entries[i].type, entries[i].values[j]);
+                }
+            }
+            if (pos & 1) putBytes("", 1);
 
-    if (clp.has("tc"))
-    {
-        if(verbose) std::cout << "    Applying tonecurve" << std::endl;
-        toneCurve(output_norm, output_norm);
-    }
+            const uint64_t ifdOffset = pos;
+            if (big) put64(entries.size());
+            else put16((uint16_t)entries.size());
+            for (size_t i = 0; i < entries.size(); i++)
+            {
+                const Entry &e = entries[i];
+                put16(e.tag);
+                put16(e.type);
+                if (big) put64(e.values.size());
+                else put32((uint32_t)e.values.size());
 
-    CVskysub(output_norm, output_norm, skylevelfactor, skyLR, skyLG, skyLB, verbose);
-    cv::Mat colref;
-    if (!clp.has("ncc") && output_norm.channels() == 3)
-    {
-        colref = output_norm.clone();
-    }
+                const size_t bytes = e.values.size() * typeSize(e.type);
+                if (bytes > inlineBytes)
+                {
+                    if (big) put64(e.offset);
+                    else put32((uint32_t)e.offset);
+                }
+                else
+                {
+                    // values are left-justified in the value field
+                    for (size_t j = 0; j < e.values.size(); j++)
+                        putValue(e.type, e.values[j]);
+                    for (size_t j = bytes; j < inlineBytes; j++)
+                        putBytes("", 1);
+                }
+            }
+            if (big) put64(0);
+            else put32(0);
 
-    if(!clp.has("x"))    showHist(output_norm, "Skysub");
+            std::fseek(fp, big ? 8 : 4, SEEK_SET);
+            if (big) put64(ifdOffset);
+            else put32((uint32_t)ifdOffset);
 
-    float rootpower = clp.get<float>("rp");
-    float rootpower2 = rootpower;
-    if(clp.has("rp2"))
-    {
-        rootpower2 = clp.get<float>("rp2");
-    }
-    
-    for(int i = 0; i < clp.get<int>("ri"); i++)
-    {
-        float rtpwr = i != 1 ? rootpower : rootpower2;
-        if(verbose) std::cout << "    Image stretching iteration " << i + 1 << " (rootpower " << rtpwr << ")" <<  std::endl;
-        stretching(output_norm, output_norm, rootpower);
-        if(!clp.has("x"))    showHist(output_norm, "Stretched");
-        CVskysub(output_norm, output_norm, skylevelfactor, skyLR, skyLG, skyLB, verbose);
-        if(!clp.has("x"))    showHist(output_norm, "Skysub");
-    }
+            const bool failed = std::ferror(fp) != 0;
+            std::fclose(fp);
+            fp = 0;
+            return failed ? -1 : 0;
+        }
 
-    float scurvepower1 = clp.get<float>("sc");
-    float scurvepower2 = clp.get<float>("sc2");
-    float scurveoff1 = clp.get<float>("so");
-    float scurveoff2 = clp.get<float>("so2");
+        int stripeRows() const override
+        {
+            if (options.tile > 0)
+                return options.tile;
+            // several strips per stripe, so that they can be compressed in parallel
+            return rowsPerStrip() * 2 * std::max(1, numThreads());
+        }
 
-    for(int i = 0; i < clp.get<int>("si"); i++)
-    {
-        float spwr = i % 2 == 0 ? scurvepower1 : scurvepower2;
-        float soff = i % 2 == 0 ? scurveoff1 : scurveoff2;
-        if(verbose) std::cout << "    S-curve iteration " << i + 1 << " (Power: " << spwr << " offset: " << soff << ")" <<
-                                  std::endl;
-        scurve(output_norm, output_norm, spwr, soff);
-        if(!clp.has("x"))    showHist(output_norm, "S-curve");
-        CVskysub(output_norm, output_norm, skylevelfactor, skyLR, skyLG, skyLB, verbose);
-        if(!clp.has("x"))    showHist(output_norm, "Skysub");
-    }
+    private:
+        enum { SHORT_T = 3, LONG_T = 4, LONG8_T = 16 };
 
-    if(clp.has("minr") || clp.has("minb") || clp.has("ming") || clp.has("min"))
-    {
-        float minr = 0;
-        float ming = 0;
-        float minb = 0;
+        /// Directory entry
+        struct Entry
+        {
+            uint16_t tag, type;
+            std::vector<uint64_t> values;
+            uint64_t offset;
+            Entry(const uint16_t tag, const uint16_t type, const std::vector<uint64_t> &values) : tag(tag),
+                type(type), values(values), offset(0)
+            {}
+        };
+
+        int rowsPerStrip() const
+        {
+            // strips of about 64 kB
+            const int rowbytes = width * channels * bits / 8;
+            const int rows = rowbytes > 0 ? 65536 / rowbytes : 1;
+            return rows > 1 ? rows : 1;
+        }
+
+        static size_t typeSize(const uint16_t type)
+        {
+            return type == SHORT_T ? 2 : (type == LONG_T ? 4 : 8);
+        }
 
-        if(clp.has("min"))
+        void putBytes(const void* data, const size_t n)
         {
-            minr = clp.get<float>("min") / 65535.;
-            ming = clp.get<float>("min") / 65535.;
-            minb = clp.get<float>("min") / 65535.;
+            std::fwrite(data, 1, n, fp);
+            pos += n;
         }
-        if(clp.has("minr"))
+        void put16(const uint16_t v)
         {
-            minr = clp.get<float>("minr") / 65535.;
+            putBytes(&v, 2);
         }
-        if(clp.has("ming"))
+        void put32(const uint32_t v)
         {
-            ming = clp.get<float>("ming") / 65535.;
+            putBytes(&v, 4);
         }
-        if(clp.has("minb"))
+        void put64(const uint64_t v)
         {
-            minb = clp.get<float>("minb") / 65535.;
+            putBytes(&v, 8);
+        }
+        void putValue(const uint16_t type, const uint64_t v)
+        {
+            if (type == SHORT_T) put16((uint16_t)v);
+            else if (type == LONG_T) put32((uint32_t)v);
+            else put64(v);
         }
 
-        setMin(output_norm, output_norm, minr, ming, minb);
+        std::string file;
+        TiffOptions options;
+        std::FILE* fp;
+        uint64_t pos;
+        int width, height, channels, bits;
+        bool big;
+        std::vector<uint64_t> offsets, counts;
+        std::vector<std::vector<uchar> > scratch, chunks;
+};
 
-        if(!clp.has("x"))    showHist(output_norm, "Set min");
-    }
 
+#ifdef HAVE_JPEG
+/**
+ * @brief Writes a jpeg file with libjpeg stripe by stripe
+ *
+ */
+class JpegWriter : public StripeWriter
+{
+    public:
+        /**
+         * @brief Construct a new Jpeg Writer object
+         *
+         * @param[in] file File name
+         * @param[in] quality JPEG quality (0-100)
+         */
+        JpegWriter(const char* file, const int quality = 95) : file(file), quality(quality), fp(0)
+        {
+            cinfo.err = jpeg_std_error(&jerr);
+            jpeg_create_compress(&cinfo);
+        }
 
-    float colorcorrectionfactor = clp.get<float>("ccf");
+        ~JpegWriter()
+        {
+            jpeg_destroy_compress(&cinfo);
+            if (fp) std::fclose(fp);
+        }
 
-    if (!clp.has("ncc") && output_norm.channels() == 3)
-    {
-        colorcorr(output_norm, colref, output_norm,  skyLR, skyLG, skyLB, colorcorrectionfactor, verbose);
-        if(!clp.has("x"))    showHist(output_norm, "Color corrected");
-        CVskysub(output_norm, output_norm, skylevelfactor, skyLR, skyLG, skyLB, verbose);
-        if(!clp.has("x"))    showHist(output_norm, "Skubsub");
-    }
+        int open(const int width, const int height, const int channels, const int depth) override
+        {
+            CV_Assert(depth == CV_8U);
+            fp = std::fopen(file.c_str(), "wb");
+            if (!fp)
+            {
+                std::cout << "    Error opening " << file << std::endl;
+                return -1;
+            }
+            jpeg_stdio_dest(&cinfo, fp);
+            cinfo.image_width = width;
+            cinfo.image_height = height;
+            cinfo.input_components = channels;
+            cinfo.in_color_space = channels == 1 ? JCS_GRAYSCALE : JCS_RGB;
+            jpeg_set_defaults(&cinfo);
+            jpeg_set_quality(&cinfo, quality, TRUE);
+            jpeg_start_compress(&cinfo, TRUE);
+            return 0;
+        }
 
-    // TBD include option....
-    //if(clp.get<float>("bp")>0) {
-    //    setBlackPoint(output_norm, output_norm, clp.get<float>("bp")*4096/65535.);
-    //    if(!clp.has("x"))    showHist(output_norm,"Set blackpoint");
-    //}
-    if(verbose) std::cout << "  Writing " << outf.c_str() << std::endl;
+        int write(const cv::Mat &rows) override
+        {
+            for (int row = 0; row < rows.rows; row++)
+            {
+                JSAMPROW line = (JSAMPROW)rows.ptr<uchar>(row);
+                jpeg_write_scanlines(&cinfo, &line, 1);
+            }
+            return 0;
+        }
 
-    if (ext == "jpg" || ext == "jpeg")
-    {
-        writeJpg(outf.c_str(), output_norm);
-    }
-    else if (ext == "tif" || ext == "tiff")
-    {
-        writeTif(outf.c_str(), output_norm);
-    }
-    else
-    {
-        cv::Mat c3;
-        output_norm.convertTo(c3, CV_8UC3, 255.);
+        int close() override
+        {
+            jpeg_finish_compress(&cinfo);
+            const bool failed = std::ferror(fp) != 0;
+            std::fclose(fp);
+            fp = 0;
+            return failed ? -1 : 0;
+        }
 
-        cv::imshow("Output", c3);
+        int stripeRows() const override
+        {
+            return 16;
+        }
+
+    private:
+        std::string file;
+        int quality;
+        std::FILE* fp;
+        struct jpeg_compress_struct cinfo;
+        struct jpeg_error_mgr jerr;
+};
+#endif
+
+
+/**
+ * @brief Collects the stripes and writes them with cv::imwrite
+ * Used for formats for which there is no streaming encoder.
+ *
+ */
+class ImwriteWriter : public StripeWriter
+{
+    public:
+        /**
+         * @brief Construct a new Imwrite Writer object
+         *
+         * @param[in] file File name
+         * @param[in] params Parameters for cv::imwrite
+         */
+        ImwriteWriter(const char* file, const std::vector<int> &params = std::vector<int>()) : file(file),
+            params(params), row(0)
+        {}
+
+        int open(const int width, const int height, const int channels, const int depth) override
+        {
+            out.create(height, width, CV_MAKETYPE(depth, channels));
+            row = 0;
+            return 0;
+        }
+
+        int write(const cv::Mat &rows) override
+        {
+            cv::Mat dst = out.rowRange(row, row + rows.rows);
+            rows.copyTo(dst);
+            row += rows.rows;
+            return 0;
+        }
+
+        int close() override
+        {
+            return cv::imwrite(file, out, params) ? 0 : -1;
+        }
+
+        bool rgb() const override
+        {
+            return false;
+        }
+
+    private:
+        std::string file;
+        std::vector<int> params;
+        cv::Mat out;
+        int row;
+};
+
+
+/**
+ * @brief Quantize the image stripe by stripe and pass the stripes to an encoder
+ * The pending transform is applied while quantizing, so that neither the float nor the
+ * quantized image is materialized.
+ *
+ * @param[in] output Image to be written
+ * @param[in] writer Encoder
+ * @param[in] depth Output depth (CV_8U or CV_16U)
+ * @param[in] dither Switch for ordered dithering
+ * @return Status (0==OK)
+ */
+int writeImage(const PipelineImage &output, StripeWriter &writer, const int depth, const bool dither)
+{
+    const cv::Mat &data = output.data;
+    if (writer.open(data.cols, data.rows, data.channels(), depth) < 0)
+        return -1;
+
+    const int stripe = writer.stripeRows();
+    cv::Mat rows(stripe, data.cols, CV_MAKETYPE(depth, data.channels()));
+    for (int row0 = 0; row0 < data.rows; row0 += stripe)
+    {
+        const int n = std::min(stripe, data.rows - row0);
+        cv::Mat part = rows.rowRange(0, n);
+        quantize(output, row0, part, writer.rgb(), dither);
+        if (writer.write(part) < 0)
+            return -1;
+    }
+    return writer.close();
+}
+
+/**
+ * @brief Scale image to 16 bit range and write tiff file
+ *
+ * @param[in] ofile File name
+ * @param[in] output Image to be written
+ * @param[in] options Compression, predictor, tiling and BigTIFF options
+ * @return Status (0==OK)
+ */
+int writeTif(const char* ofile, const PipelineImage &output, const TiffOptions &options = TiffOptions())
+{
+    TiffWriter writer(ofile, options);
+    return writeImage(output, writer, CV_16U, false);
+}
+
+
+/**
+ * @brief Scale image to 8 bit range and write jpeg file
+ *
+ * @param[in] ofile File name
+ * @param[in] output Image to be written
+ * @param[in] dither Switch for ordered dithering
+ * @param[in] quality JPEG quality (0-100)
+ * @return Status (0==OK)
+ */
+int writeJpg(const char* ofile, const PipelineImage &output, const bool dither, const int quality)
+{
+#ifdef HAVE_JPEG
+    JpegWriter writer(ofile, quality);
+#else
+    std::vector<int> params;
+    params.push_back(cv::IMWRITE_JPEG_QUALITY);
+    params.push_back(quality);
+    ImwriteWriter writer(ofile, params);
+#endif
+    return writeImage(output, writer, CV_8U, dither);
+}
+
+/**
+ * @brief Output file with its options
+ *
+ */
+struct OutputSpec
+{
+    /// File name
+    std::string file;
+    /// File extension
+    std::string ext;
+    /// Width of the output (0 to keep the size)
+    int width;
+    /// Scale factor for the size of the output (used if width is 0)
+    double scale;
+    /// JPEG quality
+    int quality;
+    /// Switch for ordered dithering of 8 bit outputs
+    bool dither;
+    /// Options for tif outputs
+    TiffOptions tiff;
+
+    OutputSpec() : width(0), scale(1.0), quality(95), dither(false)
+    {}
+};
+
+/**
+ * @brief Parse an output argument of the form file[:width=N][:scale=F][:quality=Q][:dither]
+ * [:compression=none|lzw|deflate|packbits][:predictor][:tile=N][:bigtiff]
+ *
+ * @param[in] arg Argument
+ * @param[out] spec Output file with its options
+ * @return Status (0==OK)
+ */
+int parseOutput(const std::string &arg, OutputSpec &spec)
+{
+    std::vector<std::string> fields;
+    std::stringstream ss(arg);
+    std::string field;
+    while (std::getline(ss, field, ':'))
+        fields.push_back(field);
+    if (fields.empty())
+    {
+        std::cout << "    Missing output file name" << std::endl;
+        return -1;
+    }
+
+    spec = OutputSpec();
+    spec.file = fields[0];
+    spec.ext = spec.file.substr(spec.file.find_last_of(".") + 1);
+    if (spec.ext != "jpg" && spec.ext != "jpeg" && spec.ext != "tif" && spec.ext != "tiff")
+    {
+        std::cout << "    Unknown file extension" << std::endl;
+        return -1;
+    }
+
+    for (size_t i = 1; i < fields.size(); i++)
+    {
+        const std::string key = fields[i].substr(0, fields[i].find('='));
+        const std::string value = fields[i].find('=') == std::string::npos ? "" :
+                                  fields[i].substr(fields[i].find('=') + 1);
+        if (key == "width")
+            spec.width = atoi(value.c_str());
+        else if (key == "scale")
+            spec.scale = atof(value.c_str());
+        else if (key == "quality")
+            spec.quality = atoi(value.c_str());
+        else if (key == "dither")
+            spec.dither = true;
+        else if (key == "compression" && value == "none")
+            spec.tiff.compression = TIFF_NONE;
+        else if (key == "compression" && value == "lzw")
+            spec.tiff.compression = TIFF_LZW;
+        else if (key == "compression" && value == "deflate")
+            spec.tiff.compression = TIFF_DEFLATE;
+        else if (key == "compression" && value == "packbits")
+            spec.tiff.compression = TIFF_PACKBITS;
+        else if (key == "predictor")
+            spec.tiff.predictor = true;
+        else if (key == "tile")
+            spec.tiff.tile = atoi(value.c_str());
+        else if (key == "bigtiff")
+            spec.tiff.bigtiff = true;
+        else
+        {
+            std::cout << "    Unknown output option " << fields[i] << std::endl;
+            return -1;
+        }
+    }
+    // tiles have to be multiples of 16 pixels
+    if (spec.width < 0 || spec.scale <= 0. || spec.quality < 0 || spec.quality > 100 ||
+            spec.tiff.tile < 0 || spec.tiff.tile % 16 != 0)
+    {
+        std::cout << "    Invalid output option in " << arg << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Temporary name of a file while it is written
+ * The name is in the same directory, so that the file can be renamed into place, and keeps
+ * the extension, which selects the encoder.
+ *
+ * @param[in] file File name
+ * @return Temporary file name
+ */
+std::string partialFile(const std::string &file)
+{
+    const size_t slash = file.find_last_of('/');
+    const size_t dot = file.find_last_of('.');
+    std::ostringstream ss;
+    if (dot != std::string::npos && (slash == std::string::npos || dot > slash))
+        ss << file.substr(0, dot) << ".part" << getpid() << file.substr(dot);
+    else
+        ss << file << ".part" << getpid();
+    return ss.str();
+}
+
+/**
+ * @brief Write an image to a file according to the options of the output
+ * Resized outputs are resized after the pending transform is applied. The file is written
+ * under a temporary name and renamed, so an existing file is replaced and never rewritten in
+ * place (it may be linked to an entry of the result cache).
+ *
+ * @param[in] output Image to be written
+ * @param[in] spec Output file with its options
+ * @return Status (0==OK)
+ */
+int writeOutput(const PipelineImage &output, const OutputSpec &spec)
+{
+    PipelineImage image = output;
+    if (spec.width > 0 || spec.scale != 1.0)
+    {
+        const double f = spec.width > 0 ? (double)spec.width / output.data.cols : spec.scale;
+        const cv::Size size(std::max(1, cvRound(output.data.cols * f)), std::max(1, cvRound(output.data.rows * f)));
+        // the clamp of the pending transform does not commute with the interpolation, so the
+        // transform is applied first and the resized output is the resized full resolution one
+        cv::Mat applied = output.data;
+        if (output.pending())
+        {
+            applied = bufferPool().get(output.data.rows, output.data.cols, output.data.type());
+            output.apply(applied);
+        }
+        cv::Mat resized;
+        cv::resize(applied, resized, size, 0, 0, f < 1. ? cv::INTER_AREA : cv::INTER_LINEAR);
+        if (output.pending()) bufferPool().put(applied);
+        image = PipelineImage(resized);
+    }
+
+    const std::string part = partialFile(spec.file);
+    int ret;
+    if (spec.ext == "jpg" || spec.ext == "jpeg")
+    {
+        ret = writeJpg(part.c_str(), image, spec.dither, spec.quality);
+    }
+    else
+    {
+        ret = writeTif(part.c_str(), image, spec.tiff);
+    }
+
+    if (ret == 0 && std::rename(part.c_str(), spec.file.c_str()) != 0)
+    {
+        std::cout << "    Error renaming " << part << " to " << spec.file << std::endl;
+        ret = -1;
+    }
+    if (ret != 0) std::remove(part.c_str());
+    return ret;
+}
+
+/**
+ * @brief Write all outputs, each output is encoded in its own thread
+ *
+ * @param[in] output Image to be written
+ * @param[in] outputs Output files with their options
+ * @param[in] verbose Switch for verbose output
+ * @return Status (0==OK)
+ */
+int writeOutputs(const PipelineImage &output, const std::vector<OutputSpec> &outputs, const bool verbose)
+{
+    std::vector<int> status(outputs.size(), 0);
+    std::vector<std::thread> threads;
+    // the encoders share the thread budget of the caller
+    ExecutionContext* context = executionContext();
+    for (size_t i = 0; i < outputs.size(); i++)
+    {
+        if(verbose) std::cout << "  Writing " << outputs[i].file << std::endl;
+        threads.push_back(std::thread([&, i]()
+        {
+            setExecutionContext(context);
+            status[i] = writeOutput(output, outputs[i]);
+        }));
+    }
+
+    int ret = 0;
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        threads[i].join();
+        if (status[i] < 0)
+        {
+            std::cout << "    Error writing " << outputs[i].file << std::endl;
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+/// Function which receives the widened rows of an image as they are read and the row where they start
+typedef std::function<void(const cv::Mat &rows, const int row0)> StripeCallback;
+
+#ifdef HAVE_TIFF
+/**
+ * @brief Read the header of a tif file
+ *
+ * @param[in] tif Open tif file
+ * @param[out] width Width of the image
+ * @param[out] height Height of the image
+ * @param[out] spp Samples per pixel
+ * @param[out] bps Bits per sample
+ * @param[out] rowsperstrip Rows per strip (at most height)
+ * @return true if the file can be read strip by strip (see readTif)
+ */
+bool tifHeader(TIFF* tif, uint32 &width, uint32 &height, uint16 &spp, uint16 &bps, uint32 &rowsperstrip)
+{
+    width = height = rowsperstrip = 0;
+    bps = spp = 0;
+    uint16 planar = 0, photometric = 0, format = 0, orientation = 0;
+    TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
+    TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height);
+    TIFFGetField(tif, TIFFTAG_PHOTOMETRIC, &photometric);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_BITSPERSAMPLE, &bps);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &spp);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_PLANARCONFIG, &planar);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLEFORMAT, &format);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_ORIENTATION, &orientation);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_ROWSPERSTRIP, &rowsperstrip);
+    rowsperstrip = std::min(rowsperstrip, height);
+
+    const bool rgb = spp == 3 && photometric == PHOTOMETRIC_RGB;
+    const bool mono = spp == 1 && photometric == PHOTOMETRIC_MINISBLACK;
+    return !TIFFIsTiled(tif) && (rgb || mono) && (bps == 8 || bps == 16) && planar == PLANARCONFIG_CONTIG &&
+           format == SAMPLEFORMAT_UINT && orientation == ORIENTATION_TOPLEFT && width > 0 && height > 0;
+}
+
+/**
+ * @brief Read a tif file strip by strip and widen each strip directly into the output image
+ * Only one strip of decoded data is held in memory at any time. Files which are not RGB or
+ * mono with 8 or 16 bit unsigned samples in contiguous strips are not handled here.
+ *
+ * @param[in] file File name
+ * @param[out] image PipelineImage to hold the normalized image
+ * @param[in] callback Optional function receiving each widened strip
+ * @return Status (0==OK, 1==not handled, -1==error)
+ */
+int readTif(const char* file, PipelineImage &image, const StripeCallback &callback = StripeCallback())
+{
+    TIFFSetWarningHandler(0);
+    TIFF* tif = TIFFOpen(file, "r");
+    if (!tif)
+        return 1;
+
+    uint32 width, height, rowsperstrip;
+    uint16 bps, spp;
+    if (!tifHeader(tif, width, height, spp, bps, rowsperstrip))
+    {
+        TIFFClose(tif);
+        return 1;
+    }
+
+    const int depth = bps == 8 ? CV_8U : CV_16U;
+    std::vector<uchar> buf(TIFFStripSize(tif));
+    IngestStream ingest(height, width, spp, depth);
+
+    const uint32 nstrips = TIFFNumberOfStrips(tif);
+    for (uint32 strip = 0; strip < nstrips; strip++)
+    {
+        const uint32 row0 = strip * rowsperstrip;
+        if (row0 >= height)
+            break;
+        const int n = (int)std::min(rowsperstrip, height - row0);
+        if (TIFFReadEncodedStrip(tif, strip, buf.data(), -1) < 0)
+        {
+            std::cout << "Error reading image." << std::endl;
+            TIFFClose(tif);
+            return -1;
+        }
+
+        // tif files are in RGB order, the image is widened into BGR
+        cv::Mat raw(n, width, CV_MAKETYPE(depth, spp), buf.data());
+        cv::Mat rows = ingest.add(raw, row0, true);
+        if (callback) callback(rows, row0);
+    }
+    TIFFClose(tif);
+
+    ingest.finish(image);
+    return 0;
+}
+#endif
+
+/**
+ * @brief Read image, convert to 32 bit floating point and normalize it
+ * Widening, normalization and the first histograms are done in a single pass (see ingestImage).
+ * Tif files are read strip by strip if possible (see readTif).
+ *
+ * @param[in] file File name
+ * @param[out] image PipelineImage to hold the normalized image
+ * @param[in] callback Optional function receiving the widened rows (in strips for tif files,
+ *            otherwise all at once)
+ * @return Status (0==OK)
+ */
+int readImage(const char* file, PipelineImage &image, const StripeCallback &callback = StripeCallback())
+{
+#ifdef HAVE_TIFF
+    const std::string f(file);
+    std::string ext = f.substr(f.find_last_of(".") + 1);
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    if (ext == "tif" || ext == "tiff")
+    {
+        const int status = readTif(file, image, callback);
+        if (status <= 0)
+            return status;
+    }
+#endif
+
+    // mono images stay single channel and are processed with the mono kernels
+    cv::Mat raw = cv::imread(file, cv::IMREAD_ANYCOLOR | cv::IMREAD_ANYDEPTH);
+    if (raw.empty())
+    {
+        std::cout << "Error reading image." << std::endl;
+        return -1;
+    }
+    if (raw.channels() == 4)
+    {
+        cv::cvtColor(raw, raw, cv::COLOR_BGRA2BGR);
+    }
+    else if (raw.channels() == 2)
+    {
+        cv::extractChannel(raw, raw, 0);
+    }
+
+    if (raw.depth() != CV_8U && raw.depth() != CV_16U && raw.depth() != CV_32F)
+    {
+        raw.convertTo(raw, CV_32F);
+    }
+    ingestImage(raw, image);
+    if (callback) callback(image.data, 0);
+    return 0;
+}
+
+/**
+ * @brief Read the size of an image from the header of the file without decoding it
+ * Tif, png and jpg files are understood.
+ *
+ * @param[in] file File name
+ * @param[out] size Size of the image
+ * @param[out] channels Number of channels of the image as it is read by readImage()
+ * @param[out] decoded Bytes of the decoded image, which is held while it is widened (0 if the
+ *             file is read strip by strip)
+ * @return Status (0==OK, -1==unknown format)
+ */
+int imageHeader(const std::string &file, cv::Size &size, int &channels, size_t &decoded)
+{
+    std::string ext = file.substr(file.find_last_of(".") + 1);
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+#ifdef HAVE_TIFF
+    if (ext == "tif" || ext == "tiff")
+    {
+        TIFFSetWarningHandler(0);
+        TIFF* tif = TIFFOpen(file.c_str(), "r");
+        if (!tif)
+            return -1;
+        uint32 width, height, rowsperstrip;
+        uint16 bps, spp;
+        const bool strips = tifHeader(tif, width, height, spp, bps, rowsperstrip);
+        TIFFClose(tif);
+        size = cv::Size(width, height);
+        channels = spp >= 3 ? 3 : 1;
+        decoded = strips ? 0 : (size_t)width * height * spp * std::max(1, bps / 8);
+        return width > 0 && height > 0 ? 0 : -1;
+    }
+#endif
+
+    std::ifstream in(file.c_str(), std::ios::binary);
+    unsigned char b[26];
+    if (!in.read((char*)b, sizeof(b)))
+        return -1;
+
+    static const unsigned char png[8] = {0x89, 'P', 'N', 'G', 0x0d, 0x0a, 0x1a, 0x0a};
+    if (std::memcmp(b, png, 8) == 0 && std::memcmp(b + 12, "IHDR", 4) == 0)
+    {
+        size = cv::Size(b[16] << 24 | b[17] << 16 | b[18] << 8 | b[19], b[20] << 24 | b[21] << 16 | b[22] << 8 | b[23]);
+        // grey, -, rgb, palette, grey with alpha, -, rgb with alpha
+        static const int samples[7] = {1, 0, 3, 3, 2, 0, 4};
+        const int color = b[25] < 7 ? b[25] : 1;
+        channels = color == 0 || color == 4 ? 1 : 3;
+        decoded = (size_t)size.area() * samples[color] * (b[24] == 16 ? 2 : 1);
+        return samples[color] > 0 ? 0 : -1;
+    }
+
+    if (b[0] == 0xff && b[1] == 0xd8)
+    {
+        // the size is in the first start of frame segment
+        in.seekg(2);
+        int c;
+        while ((c = in.get()) == 0xff)
+        {
+            int marker;
+            while ((marker = in.get()) == 0xff) {}
+            if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd8))
+                continue;
+            if (!in.read((char*)b, 2))
+                return -1;
+            const int length = b[0] << 8 | b[1];
+            if (marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc)
+            {
+                if (!in.read((char*)b, 6))
+                    return -1;
+                size = cv::Size(b[3] << 8 | b[4], b[1] << 8 | b[2]);
+                channels = b[5] >= 3 ? 3 : 1;
+                decoded = (size_t)size.area() * b[5];
+                return 0;
+            }
+            in.seekg(length - 2, std::ios::cur);
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Parse a region of interest of the form x,y,w,h
+ *
+ * @param[in] arg Argument
+ * @param[in] size Size of the image
+ * @param[out] rect Region of interest (clipped to the image)
+ * @return Status (0==OK)
+ */
+int parseRoi(const std::string &arg, const cv::Size &size, cv::Rect &rect)
+{
+    std::vector<int> values;
+    std::stringstream ss(arg);
+    std::string field;
+    while (std::getline(ss, field, ','))
+        values.push_back(std::atoi(field.c_str()));
+    if (values.size() != 4 || values[2] <= 0 || values[3] <= 0)
+    {
+        std::cout << "    Invalid ROI " << arg << " (x,y,w,h)" << std::endl;
+        return -1;
+    }
+
+    rect = cv::Rect(values[0], values[1], values[2], values[3]) & cv::Rect(cv::Point(0, 0), size);
+    if (rect.area() == 0)
+    {
+        std::cout << "    ROI " << arg << " is outside of the image" << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Parse a number of bytes with an optional unit (K, M, G or T, powers of 1024)
+ *
+ * @param[in] arg Argument, e.g. 512M
+ * @param[out] bytes Number of bytes
+ * @return Status (0==OK)
+ */
+int parseBytes(const std::string &arg, size_t &bytes)
+{
+    char* end;
+    const double value = std::strtod(arg.c_str(), &end);
+    const std::string unit(end);
+    const size_t power = unit.empty() ? 0 : std::string("KMGT").find((char)std::toupper(unit[0])) + 1;
+    if (end == arg.c_str() || value <= 0. || unit.size() > 1 || (power == 0 && !unit.empty()))
+    {
+        std::cout << "    Invalid size " << arg << " (e.g. 512M or 2G)" << std::endl;
+        return -1;
+    }
+    bytes = (size_t)(value * std::pow(1024., (double)power));
+    return 0;
+}
+
+/**
+ * @brief CPUs of a NUMA node
+ *
+ * @param[in] node Number of the node
+ * @param[out] cpus CPUs of the node
+ * @return Status (0==OK)
+ */
+int numaCpus(const int node, std::vector<int> &cpus)
+{
+    std::ostringstream file;
+    file << "/sys/devices/system/node/node" << node << "/cpulist";
+    std::ifstream in(file.str().c_str());
+    std::string list;
+    if (!std::getline(in, list) || parseCpuList(list, cpus) < 0)
+    {
+        std::cout << "    NUMA node " << node << " not found" << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Test whether file exists
+ *
+ * @param filename Filename
+ * @return true
+ * @return false
+ */
+bool fexists(const std::string &filename)
+{
+    std::ifstream ifile(filename.c_str());
+    return (bool)ifile;
+}
+
+/**
+ * @brief Options of the stretch steps
+ */
+struct PipelineOptions
+{
+    /// Sky subtraction and iteration settings
+    StretchSettings stretch;
+    /// Switch for the tone curve before the first sky subtraction
+    bool tonecurve;
+    /// Root power of the stretch
+    float rootpower;
+    /// Switch for solving the root power with autoRootpower()
+    bool autoRoot;
+    /// Percentile of the pixel values for autoRootpower() (in %)
+    float autoPercentile;
+    /// Target level of the percentile for autoRootpower() (between 0 and 1)
+    float autoTarget;
+    /// Switch for the colour correction (only applied to colour images)
+    bool colorcorrect;
+    /// Colour enhancement factor
+    float colorenhance;
+    /// Switch for setMin()
+    bool setmin;
+    /// Minimum of the red channel (between 0 and 1)
+    float minr;
+    /// Minimum of the green channel (between 0 and 1)
+    float ming;
+    /// Minimum of the blue channel (between 0 and 1)
+    float minb;
+    /// Switch for showing the histograms after each step
+    bool display;
+    /// Switch for progress information
+    bool verbose;
+    /// Switch for keeping the reference of the colour correction in 16 bit to save memory
+    bool compactRef;
+    /// Switch for the fast approximations (checked again for a solved root power)
+    bool fastMath;
+
+    PipelineOptions() : tonecurve(false), rootpower(6.0), autoRoot(false), autoPercentile(99.0),
+        autoTarget(0.5), colorcorrect(true), colorenhance(1.0), setmin(false), minr(0), ming(0), minb(0),
+        display(false), verbose(false), compactRef(false), fastMath(false)
+    {}
+};
+
+/**
+ * @brief Maximum error of the fast approximations for the curves of a run (see fastMathError())
+ *
+ * @param rootpower Root power of the stretch
+ * @param settings Settings with the second root power and the S-curves
+ * @return Maximum error (between 0 and 1)
+ */
+static double fastMathBound(const float rootpower, const StretchSettings &settings)
+{
+    double err = 0.;
+    const float rootpowers[2] = {rootpower, settings.rootpower2 > 0. ? (float)settings.rootpower2 : rootpower};
+    for (int i = 0; i < 2; i++)
+    {
+        double e = fastMathError(rootpowers[i], settings.scurvepower1, settings.scurveoffset1);
+        err = e > err ? e : err;
+        e = fastMathError(rootpowers[i], settings.scurvepower2, settings.scurveoffset2);
+        err = e > err ? e : err;
+    }
+    return err;
+}
+
+/**
+ * @brief Stretches an image
+ *
+ * @param[in,out] image Image (with a ROI the image the statistics are taken from)
+ * @param[in,out] roi Crop processed with the statistics of image (may be empty)
+ * @param[in,out] options Options, a solved root power replaces the automatic one
+ * @param[in,out] params Solved parameters to record or to replay (may be 0)
+ */
+void stretchImage(PipelineImage &image, PipelineImage &roi, PipelineOptions &options, SolvedParams *params)
+{
+    const bool verbose = options.verbose;
+    const StretchSettings &settings = options.stretch;
+
+    if(options.display)    showHist(image, "Input Image");
+
+    if (options.tonecurve)
+    {
+        if(verbose) std::cout << "    Applying tonecurve" << std::endl;
+        toneCurve(image);
+        if (!roi.data.empty()) toneCurve(roi);
+    }
+
+    CVskysub(image, roi, settings.skylevelfactor, settings.skyLR, settings.skyLG, settings.skyLB, verbose, params);
+    const bool colorcorrect = options.colorcorrect && image.data.channels() == 3;
+    cv::Mat colref, roiColref;
+    TileIndex colrefTiles;
+    if (colorcorrect)
+    {
+        // the compact reference is quantized like a 16 bit output
+        const int type = options.compactRef ? CV_16UC3 : image.data.type();
+        colref = bufferPool().get(image.data.rows, image.data.cols, type);
+        if (options.compactRef) quantize(image, 0, colref, false, false);
+        else image.apply(colref);
+        colrefTiles = image.effectiveTiles();
+        if (!roi.data.empty())
+        {
+            roiColref = bufferPool().get(roi.data.rows, roi.data.cols, type);
+            if (options.compactRef) quantize(roi, 0, roiColref, false, false);
+            else roi.apply(roiColref);
+        }
+    }
+
+    if(options.display)    showHist(image, "Skysub");
+
+    if (options.autoRoot)
+    {
+        // the stretch iterations are predicted on the histograms only
+        options.rootpower = autoRootpower(image, settings, options.autoPercentile, options.autoTarget);
+        options.autoRoot = false;
+        std::cout << "  Automatic root power " << options.rootpower << std::endl;
+
+        // the approximations were only checked for the root powers of the command line
+        const double err = options.fastMath ? fastMathBound(options.rootpower, settings) : 0.;
+        if (err >= 0.5 / 65535.)
+        {
+            std::cout << "    WARNING: fast math error " << err * 65535. << " (in 16bit) too large, using exact functions" <<
+                      std::endl;
+            setFastMath(false);
+            options.fastMath = false;
+        }
+    }
+    const float rootpower = options.rootpower;
+    const float rootpower2 = settings.rootpower2 > 0. ? settings.rootpower2 : rootpower;
+
+    for(int i = 0; i < settings.rootiter; i++)
+    {
+        float rtpwr = i != 1 ? rootpower : rootpower2;
+        if(verbose) std::cout << "    Image stretching iteration " << i + 1 << " (rootpower " << rtpwr << ")" <<  std::endl;
+        stretching(image, roi, rtpwr, params);
+        if(options.display)    showHist(image, "Stretched");
+        CVskysub(image, roi, settings.skylevelfactor, settings.skyLR, settings.skyLG, settings.skyLB, verbose, params);
+        if(options.display)    showHist(image, "Skysub");
+    }
+
+    for(int i = 0; i < settings.scurveiter; i++)
+    {
+        float spwr = i % 2 == 0 ? settings.scurvepower1 : settings.scurvepower2;
+        float soff = i % 2 == 0 ? settings.scurveoffset1 : settings.scurveoffset2;
+        if(verbose) std::cout << "    S-curve iteration " << i + 1 << " (Power: " << spwr << " offset: " << soff << ")" <<
+                                  std::endl;
+        scurve(image, spwr, soff);
+        if (!roi.data.empty()) scurve(roi, spwr, soff);
+        if(options.display)    showHist(image, "S-curve");
+        CVskysub(image, roi, settings.skylevelfactor, settings.skyLR, settings.skyLG, settings.skyLB, verbose, params);
+        if(options.display)    showHist(image, "Skysub");
+    }
+
+    if (options.setmin)
+    {
+        setMin(image, options.minr, options.ming, options.minb);
+        if (!roi.data.empty()) setMin(roi, options.minr, options.ming, options.minb);
+
+        if(options.display)    showHist(image, "Set min");
+    }
+
+    if (colorcorrect)
+    {
+        colorcorr(image, colref, roi, roiColref, settings.skyLR, settings.skyLG, settings.skyLB,
+                  options.colorenhance, verbose, colrefTiles, params);
+        bufferPool().put(colref);
+        bufferPool().put(roiColref);
+        if(options.display)    showHist(image, "Color corrected");
+        CVskysub(image, roi, settings.skylevelfactor, settings.skyLR, settings.skyLG, settings.skyLB, verbose, params);
+        if(options.display)    showHist(image, "Skubsub");
+    }
+}
+
+/**
+ * @brief Stretches an image in bands of rows with parameters solved beforehand
+ * Each band is a view of the image and is stretched in place with the replayed parameters, so
+ * only the colour reference of a single band has to be allocated.
+ *
+ * @param[in,out] image Image
+ * @param[in] options Options of the stretch
+ * @param[in,out] params Solved parameters
+ * @param[in] bandRows Number of rows of each band
+ */
+void stretchBands(PipelineImage &image, const PipelineOptions &options, SolvedParams &params, const int bandRows)
+{
+    PipelineOptions bandOptions = options;
+    bandOptions.verbose = false;
+    bandOptions.display = false;
+
+    PipelineImage band, none;
+    for (int row0 = 0; row0 < image.data.rows; row0 += bandRows)
+    {
+        band = PipelineImage(image.data.rowRange(row0, std::min(row0 + bandRows, image.data.rows)));
+        band.scale = image.scale;
+        band.offset = image.offset;
+        band.lower = image.lower;
+        params.rewind();
+        stretchImage(band, none, bandOptions, &params);
+    }
+
+    // all bands end with the same pending transform
+    image.modified();
+    image.scale = band.scale;
+    image.offset = band.offset;
+    image.lower = band.lower;
+}
+
+/**
+ * @brief Print the counters of the buffer pool
+ */
+void printPoolStats()
+{
+    const BufferPool::Stats stats = bufferPool().stats();
+    std::cout << "  Buffer pool: " << stats.hits << " hits, " << stats.misses << " misses, high water " <<
+              stats.highWaterBytes / (1 << 20) << " MiB" << std::endl;
+}
+
+/**
+ * @brief 64 bit hash of a block of bytes (not cryptographic)
+ *
+ * @param[in] p Bytes
+ * @param[in] n Number of bytes
+ * @param[in] h Hash of the preceding bytes (or any seed)
+ * @return Hash
+ */
+static uint64_t hashBytes(const char* p, const size_t n, uint64_t h)
+{
+    const uint64_t k1 = 0x9e3779b97f4a7c15ULL, k2 = 0xc2b2ae3d27d4eb4fULL;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        uint64_t w;
+        std::memcpy(&w, p + i, 8);
+        h ^= w * k1;
+        h = ((h << 31) | (h >> 33)) * k2;
+    }
+    for (; i < n; i++)
+    {
+        h ^= (uint64_t)(unsigned char)p[i] * k1;
+        h = ((h << 31) | (h >> 33)) * k2;
+    }
+    h ^= h >> 29;
+    return h;
+}
+
+/**
+ * @brief Hash of the contents of a file
+ *
+ * @param[in] file File name
+ * @param[out] h Hash
+ * @return Status (0==OK)
+ */
+int hashFile(const std::string &file, uint64_t &h)
+{
+    std::ifstream in(file.c_str(), std::ios::binary);
+    if (!in)
+    {
+        std::cout << "Error reading image." << std::endl;
+        return -1;
+    }
+    // the chunks are a multiple of 8 bytes, so the hash does not depend on the chunking
+    std::vector<char> buffer(1 << 20);
+    h = 0;
+    uint64_t size = 0;
+    while (in)
+    {
+        in.read(buffer.data(), buffer.size());
+        h = hashBytes(buffer.data(), in.gcount(), h);
+        size += in.gcount();
+    }
+    h = hashBytes(reinterpret_cast<const char*>(&size), sizeof(size), h);
+    return 0;
+}
+
+/**
+ * @brief Describe everything that determines the outputs of a run
+ *
+ * @param[in] input Hash of the input file
+ * @param[in] options Options of the stretch
+ * @param[in] extra Further options (e.g. ROI and fast math)
+ * @return Description
+ */
+std::string describeRun(const uint64_t input, const PipelineOptions &options, const std::string &extra)
+{
+    const StretchSettings &st = options.stretch;
+    std::ostringstream ss;
+    ss.precision(9);
+    ss << "j3colorstretch " << J3CS_VERSION << " input " << input << " sky " << st.skylevelfactor << " " <<
+       st.skyLR << " " << st.skyLG << " " << st.skyLB << " tc " << options.tonecurve << " root " <<
+       st.rootiter << " " << options.rootpower << " " << st.rootpower2 << " auto " << options.autoRoot <<
+       " " << options.autoPercentile << " " << options.autoTarget << " scurve " << st.scurveiter << " " <<
+       st.scurvepower1 << " " << st.scurveoffset1 << " " << st.scurvepower2 << " " << st.scurveoffset2 <<
+       " cc " << options.colorcorrect << " " << options.colorenhance << " min " << options.setmin << " " <<
+       options.minr << " " << options.ming << " " << options.minb << " " << extra;
+    return ss.str();
+}
+
+/**
+ * @brief File of an output in the result cache
+ *
+ * @param[in] dir Directory of the cache
+ * @param[in] run Description of the run (see describeRun())
+ * @param[in] spec Output
+ * @param[in] preview Switch for a preview output
+ * @return File name
+ */
+std::string cacheFile(const std::string &dir, const std::string &run, const OutputSpec &spec, const bool preview)
+{
+    std::ostringstream ss;
+    ss.precision(9);
+    ss << run << " preview " << preview << " output " << spec.ext << " " << spec.width << " " << spec.scale << " " <<
+       spec.quality << " " << spec.dither << " " << spec.tiff.compression << " " << spec.tiff.predictor << " " <<
+       spec.tiff.tile << " " << spec.tiff.bigtiff;
+    const std::string key = ss.str();
+
+    char name[17];
+    std::snprintf(name, sizeof(name), "%016llx", (unsigned long long)hashBytes(key.data(), key.size(), 0));
+    return dir + "/" + name + "." + spec.ext;
+}
+
+/**
+ * @brief Test whether two names refer to the same file
+ *
+ * @param[in] a File name
+ * @param[in] b File name
+ * @return true if both exist and are the same file (e.g. hard links)
+ */
+bool sameFile(const std::string &a, const std::string &b)
+{
+    struct stat sa, sb;
+    return stat(a.c_str(), &sa) == 0 && stat(b.c_str(), &sb) == 0 && sa.st_dev == sb.st_dev &&
+           sa.st_ino == sb.st_ino;
+}
+
+/**
+ * @brief Copy a file to a new name
+ * The copy is written under a temporary name and renamed, so an existing file with the new
+ * name is replaced at once and never holds a partial copy.
+ *
+ * @param[in] from Existing file
+ * @param[in] to New file
+ * @return Status (0==OK)
+ */
+int copyFile(const std::string &from, const std::string &to)
+{
+    const std::string part = partialFile(to);
+    bool ok;
+    {
+        std::ifstream in(from.c_str(), std::ios::binary);
+        std::ofstream out(part.c_str(), std::ios::binary);
+        out << in.rdbuf();
+        out.close();
+        ok = in && out;
+    }
+    if (ok && std::rename(part.c_str(), to.c_str()) == 0)
+        return 0;
+    std::remove(part.c_str());
+    return -1;
+}
+
+/**
+ * @brief Hard-link a file to a new name, or copy it if linking is not possible
+ * An existing file with the new name is replaced (see copyFile()).
+ *
+ * @param[in] from Existing file
+ * @param[in] to New file
+ * @return Status (0==OK)
+ */
+int linkOrCopy(const std::string &from, const std::string &to)
+{
+    const std::string part = partialFile(to);
+    std::remove(part.c_str());
+    if (link(from.c_str(), part.c_str()) == 0)
+    {
+        if (std::rename(part.c_str(), to.c_str()) == 0)
+            return 0;
+        std::remove(part.c_str());
+    }
+    return copyFile(from, to);
+}
+
+/**
+ * @brief Creates the directory of the result cache if needed and checks that it can be used
+ * Missing parent directories are created as well.
+ *
+ * @param[in] dir Directory of the cache
+ * @return Status (0==OK)
+ */
+int prepareCache(const std::string &dir)
+{
+    for (size_t pos = dir.find('/', 1); ; pos = dir.find('/', pos + 1))
+    {
+        const std::string part = dir.substr(0, pos);
+        if (mkdir(part.c_str(), 0777) != 0 && errno != EEXIST)
+        {
+            std::cout << "    Cannot create the cache directory " << part << ": " << std::strerror(errno) << std::endl;
+            return -1;
+        }
+        if (pos == std::string::npos)
+            break;
+    }
+
+    struct stat st;
+    if (stat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+    {
+        std::cout << "    Cache " << dir << " is not a directory" << std::endl;
+        return -1;
+    }
+    if (access(dir.c_str(), W_OK | X_OK) != 0)
+    {
+        std::cout << "    Cache directory " << dir << " is not writable" << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Options of a run that are not options of the stretch
+ */
+struct RunOptions
+{
+    /// Directory of the result cache (empty for none)
+    std::string cache;
+    /// Region of interest x,y,w,h (empty for the full image)
+    std::string roi;
+    /// Subsampling step of the full image for the statistics with a region of interest
+    int roiSample;
+    /// Downsampling step of the preview
+    int previewStep;
+    /// Switch to overwrite existing outputs
+    bool force;
+    /// Switch for ordered dithering of the displayed result
+    bool dither;
+    /// Switch for the fast approximations
+    bool fastMath;
+    /// Switch for the sampled histograms of the sky subtraction
+    bool sampledHists;
+    /// Switch for the optional OpenCL kernels for two steps (their results may differ from the CPU kernels in the last bits)
+    bool openCL;
+    /// Memory budget in bytes (0 for none, see planMemory())
+    size_t maxMem;
+
+    RunOptions() : roiSample(1), previewStep(4), force(false), dither(false), fastMath(false), sampledHists(false),
+        openCL(false), maxMem(0)
+    {}
+};
+
+/**
+ * @brief Execution strategy within a memory budget (see planMemory())
+ */
+struct MemoryPlan
+{
+    /// Strategies in the order of preference
+    enum Strategy
+    {
+        /// The whole image with a 32 bit colour reference
+        IN_CORE,
+        /// The whole image with a 16 bit colour reference
+        REDUCED,
+        /// Parameters solved on a subsampled image and replayed on bands of rows (see stretchBands())
+        TILED
+    };
+
+    /// Strategy
+    Strategy strategy;
+    /// Estimated peak of the image buffers in bytes
+    size_t estimate;
+    /// Subsampling step of the image the parameters are solved on (TILED)
+    int solveStep;
+    /// Number of rows of each band (TILED)
+    int bandRows;
+
+    MemoryPlan() : strategy(IN_CORE), estimate(0), solveStep(1), bandRows(0)
+    {}
+};
+
+/**
+ * @brief Name of a strategy
+ *
+ * @param[in] strategy Strategy
+ * @return Name
+ */
+const char* strategyName(const MemoryPlan::Strategy strategy)
+{
+    return strategy == MemoryPlan::IN_CORE ? "in-core" : (strategy == MemoryPlan::REDUCED ? "reduced precision" : "tiled");
+}
+
+/**
+ * @brief Peak resident size of the process
+ *
+ * @return Bytes
+ */
+size_t peakMemory()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss;
+#else
+    return (size_t)usage.ru_maxrss * 1024;
+#endif
+}
+
+/**
+ * @brief Estimates the peak memory of the image buffers and picks the first strategy within the budget
+ * The estimate is the maximum over reading (decoded and widened image), solving (preview or
+ * subsampled image), stretching (image and colour reference) and writing (resized outputs,
+ * which are encoded concurrently).
+ *
+ * @param[in] size Size of the image
+ * @param[in] channels Number of channels
+ * @param[in] decoded Bytes of the decoded image held while it is widened
+ * @param[in] outputs Outputs
+ * @param[in] previews Outputs of the preview
+ * @param[in] options Options of the stretch
+ * @param[in] run Further options with the budget
+ * @param[in] tiling Switch whether the tiled execution is possible
+ * @param[out] plan Plan (with the smallest estimate if no strategy fits)
+ * @return Status (0==OK, -1==the budget is too small)
+ */
+int planMemory(const cv::Size &size, const int channels, const size_t decoded, const std::vector<OutputSpec> &outputs,
+               const std::vector<OutputSpec> &previews, const PipelineOptions &options, const RunOptions &run,
+               const bool tiling, MemoryPlan &plan)
+{
+    const size_t pixel = channels * sizeof(float);
+    const size_t image = (size_t)size.area() * pixel;
+    const bool cc = options.colorcorrect && channels == 3;
+    // histograms with their blurred copies
+    const size_t fixed = (size_t)8 * 65536 * sizeof(float) * channels;
+
+    // with a ROI the crop is stretched, the full image (possibly subsampled) only gives the statistics,
+    // the full image stays allocated (or in the buffer pool)
+    cv::Size outSize = size;
+    size_t full = image, stats = image, crop = 0;
+    if (!run.roi.empty())
+    {
+        cv::Rect rect;
+        if (parseRoi(run.roi, size, rect) < 0)
+            return -1;
+        outSize = rect.size();
+        crop = (size_t)rect.area() * pixel;
+        stats = image / ((size_t)run.roiSample * run.roiSample);
+        full = image + (run.roiSample > 1 ? stats : 0) + crop;
+    }
+    const size_t preview = previews.empty() ? 0 : stats / ((size_t)run.previewStep * run.previewStep);
+
+    size_t writing = outputs.empty() ? (size_t)outSize.area() * channels : 0;
+    for (size_t i = 0; i < outputs.size(); i++)
+    {
+        if (outputs[i].width <= 0 && outputs[i].scale == 1.0)
+            continue;
+        // the pending transform is applied to a full size copy before resizing
+        const double f = outputs[i].width > 0 ? (double)outputs[i].width / outSize.width : outputs[i].scale;
+        writing += (size_t)outSize.area() * pixel;
+        writing += (size_t)(std::max(1, cvRound(outSize.width * f)) * std::max(1, cvRound(outSize.height * f))) * pixel;
+    }
+    const size_t reading = image + decoded;
+
+    for (int s = MemoryPlan::IN_CORE; s <= MemoryPlan::TILED; s++)
+    {
+        // without colour correction there is no reference to save
+        if (s != MemoryPlan::IN_CORE && (!cc || (s == MemoryPlan::TILED && (!tiling || crop))))
+            continue;
+
+        const double ref = !cc ? 0. : (s == MemoryPlan::REDUCED ? 0.5 : 1.);
+        size_t solving, stretching;
+        plan.solveStep = 1;
+        plan.bandRows = 0;
+        if (s != MemoryPlan::TILED)
+        {
+            solving = full + (size_t)(preview * (1. + ref));
+            stretching = full + (size_t)((stats + crop) * ref);
+        }
+        else
+        {
+            // the finest subsampling with which the solve fits, and bands of whole tiles
+            int step = previews.empty() ? 2 : run.previewStep;
+            while (previews.empty() && step < 16 && image + 2 * image / ((size_t)step * step) + fixed > run.maxMem)
+                step++;
+            const size_t row = (size_t)size.width * pixel;
+            const size_t left = run.maxMem > image + fixed ? run.maxMem - image - fixed : 0;
+            plan.solveStep = step;
+            plan.bandRows = std::min(size.height, std::max(64, (int)std::min(left / row, (size_t)INT_MAX) / 64 * 64));
+            solving = image + 2 * image / ((size_t)step * step);
+            stretching = image + plan.bandRows * row;
+        }
+
+        plan.strategy = (MemoryPlan::Strategy)s;
+        plan.estimate = std::max(std::max(reading, solving), std::max(stretching, full + writing)) + fixed;
+        if (plan.estimate <= run.maxMem)
+        {
+            std::cout << "  Memory plan: " << strategyName(plan.strategy) << ", estimated " << (plan.estimate >> 20) <<
+                      " MiB of " << (run.maxMem >> 20) << " MiB" << std::endl;
+            if (plan.strategy == MemoryPlan::TILED)
+                std::cout << "  Parameters solved on a subsample with step " << plan.solveStep <<
+                          ", the output is approximate and depends on --max-mem" << std::endl;
+            // buffers kept for earlier images of another size would count against the budget
+            if (bufferPool().stats().pooledBytes + plan.estimate > run.maxMem)
+                bufferPool().clear();
+            return 0;
+        }
+    }
+    std::cout << "    The image needs an estimated " << (plan.estimate >> 20) << " MiB (" <<
+              strategyName(plan.strategy) << "), more than --max-mem" << std::endl;
+    return -1;
+}
+
+/**
+ * @brief Stretches an image file and writes the outputs (or displays the result without outputs)
+ *
+ * @param[in] input Input file
+ * @param[in] outputs Outputs
+ * @param[in] previews Outputs of the preview (the parameters are solved on the preview if not empty)
+ * @param[in,out] options Options of the stretch, a solved root power replaces the automatic one
+ * @param[in] run Further options
+ * @return Status (0==OK)
+ */
+int processFile(const std::string &input, const std::vector<OutputSpec> &outputs,
+                const std::vector<OutputSpec> &previews, PipelineOptions &options, const RunOptions &run)
+{
+    const bool verbose = options.verbose;
+
+    // outputs of runs with the same input, options and version are linked from the cache
+    // all outputs with the preview last
+    std::vector<OutputSpec> all = outputs;
+    all.insert(all.end(), previews.begin(), previews.end());
+
+    std::string key;
+    if (!run.cache.empty() && !outputs.empty())
+    {
+        uint64_t hash;
+        if (hashFile(input, hash) < 0)
+            return -1;
+        std::ostringstream extra;
+        extra << "fm " << run.fastMath << " sh " << run.sampledHists << " ocl " << run.openCL << " roi " << run.roi <<
+              " " << run.roiSample << " " << run.previewStep << " mem " << run.maxMem;
+        key = describeRun(hash, options, extra.str());
+
+        std::vector<std::string> entries;
+        for (size_t i = 0; i < all.size(); i++)
+            entries.push_back(cacheFile(run.cache, key, all[i], i >= outputs.size()));
+        bool cached = true;
+        for (size_t i = 0; i < all.size(); i++)
+            cached = cached && fexists(entries[i]);
+        if (cached)
+        {
+            // outputs which are still the linked cache entries are left as they are
+            int ret = 0;
+            for (size_t i = 0; i < all.size(); i++)
+            {
+                if (sameFile(entries[i], all[i].file))
+                    continue;
+                if (fexists(all[i].file) && !run.force)
+                {
+                    std::cout << "    File " << all[i].file << " exists" << std::endl;
+                    return -1;
+                }
+                ret |= linkOrCopy(entries[i], all[i].file);
+            }
+            std::cout << "  Outputs found in the cache" << std::endl;
+            return ret;
+        }
+    }
+
+    for (size_t i = 0; i < all.size(); i++)
+    {
+        if ( fexists(all[i].file) && !run.force)
+        {
+            std::cout << "    File " << all[i].file << " exists" << std::endl;
+            return -1;
+        }
+    }
+
+    // the strategy is planned from the header if possible, so that reading is within the budget as well
+    MemoryPlan plan;
+    cv::Size size;
+    int channels;
+    size_t decoded;
+    const bool header = run.maxMem > 0 && imageHeader(input, size, channels, decoded) == 0;
+    if (header && planMemory(size, channels, decoded, outputs, previews, options, run, true, plan) < 0)
+        return -1;
+
+    // affine steps (normalization, sky subtraction) are kept pending and applied by the next kernel
+    PipelineImage output_norm;
+    if(verbose) std::cout << "  Reading image" << input << std::endl;
+    if(readImage(input.c_str(), output_norm) < 0)
+        return -1;
+
+    if (run.maxMem > 0 && !header && planMemory(output_norm.data.size(), output_norm.data.channels(), 0,
+            outputs, previews, options, run, true, plan) < 0)
+        return -1;
+    options.compactRef = plan.strategy == MemoryPlan::REDUCED;
+
+    // with a ROI all per-pixel work is done on the crop, output_norm (the full image, possibly
+    // subsampled) only provides the statistics of the steps
+    PipelineImage roi;
+    if (!run.roi.empty())
+    {
+        cv::Rect rect;
+        if (parseRoi(run.roi, output_norm.data.size(), rect) < 0)
+            return -1;
+        roi = output_norm.crop(rect);
+        output_norm.subsample(run.roiSample);
+    }
+
+    const bool tiled = plan.strategy == MemoryPlan::TILED;
+    if (!previews.empty() || tiled)
+    {
+        // all parameters are solved on the preview (or a subsampled image for the tiled execution)
+        // and replayed on the full resolution image, so the preview is the downsampled final image
+        PipelineImage preview = output_norm;
+        preview.subsample(previews.empty() ? plan.solveStep : run.previewStep);
+        PipelineImage none;
+        SolvedParams params;
+        stretchImage(preview, none, options, &params);
+        if (!previews.empty())
+        {
+            if (writeOutputs(preview, previews, verbose) < 0)
+                return -1;
+            std::cout << "  Preview ready" << std::endl;
+        }
+        preview.release();
+
+        params.rewind();
+        options.display = false;
+        if (!roi.data.empty())
+        {
+            output_norm.release();
+            output_norm = roi;
+            roi = PipelineImage();
+        }
+        if (tiled)
+        {
+            if(verbose) std::cout << "  Stretching in bands of " << plan.bandRows << " rows" << std::endl;
+            stretchBands(output_norm, options, params, plan.bandRows);
+        }
+        else
+        {
+            stretchImage(output_norm, roi, options, &params);
+        }
+    }
+    else
+    {
+        stretchImage(output_norm, roi, options, 0);
+    }
+
+    // TBD include option....
+    //if(clp.get<float>("bp")>0) {
+    //    setBlackPoint(output_norm, output_norm, clp.get<float>("bp")*4096/65535.);
+    //    if(!clp.has("x"))    showHist(output_norm,"Set blackpoint");
+    //}
+    const PipelineImage &result = roi.data.empty() ? output_norm : roi;
+    if (!outputs.empty())
+    {
+        if (writeOutputs(result, outputs, verbose) < 0)
+            return -1;
+
+        // the cache gets copies, as the outputs may be replaced by later runs or edited
+        for (size_t i = 0; i < all.size() && !key.empty(); i++)
+        {
+            if (copyFile(all[i].file, cacheFile(run.cache, key, all[i], i >= outputs.size())) < 0)
+                std::cout << "    WARNING: could not store " << all[i].file << " in the cache " << run.cache << std::endl;
+        }
+    }
+    else
+    {
+        cv::Mat c3(result.data.size(), CV_MAKETYPE(CV_8U, result.data.channels()));
+        quantize(result, 0, c3, false, run.dither);
+
+        cv::imshow("Output", c3);
         cv::waitKey(0);
     }
+
+    // the buffers are reused by the next image
+    roi.release();
+    output_norm.release();
+    if(verbose) printPoolStats();
+    if (run.maxMem > 0)
+        std::cout << "  Memory: estimated " << (plan.estimate >> 20) << " MiB for the images, peak resident " <<
+                  (peakMemory() >> 20) << " MiB" << std::endl;
+    return 0;
+}
+
+/**
+ * @brief Absolute name of a file in an existing directory
+ *
+ * @param[in] file File name
+ * @return Absolute file name with the directory resolved (file itself if the directory does not exist)
+ */
+std::string absolutePath(const std::string &file)
+{
+    const size_t slash = file.find_last_of('/');
+    const std::string dir = slash == std::string::npos ? "." : (slash == 0 ? "/" : file.substr(0, slash));
+    char resolved[PATH_MAX];
+    if (realpath(dir.c_str(), resolved) == NULL)
+        return file;
+    return std::string(resolved) + "/" + file.substr(slash + 1);
+}
+
+/**
+ * @brief Output for an input file, %s in the output file name is replaced by the input name without extension
+ *
+ * @param[in] spec Output with %s in the file name
+ * @param[in] input Input file
+ * @return Output for the input file
+ */
+OutputSpec outputFor(const OutputSpec &spec, const std::string &input)
+{
+    std::string name = input.substr(input.find_last_of('/') + 1);
+    name = name.substr(0, name.find_last_of('.'));
+
+    OutputSpec out = spec;
+    const size_t k = out.file.find("%s");
+    if (k != std::string::npos)
+        out.file.replace(k, 2, name);
+    return out;
+}
+
+/**
+ * @brief Test whether a file written to a watched directory is an input image
+ * Only extensions which OpenCV reads are taken, and temporary files of partialFile() (of this
+ * or another process) are ignored, as they are renamed into place when complete.
+ *
+ * @param[in] name File name
+ * @return true for an input image
+ */
+bool isWatchedImage(const std::string &name)
+{
+    const size_t dot = name.find_last_of('.');
+    if (dot == std::string::npos)
+        return false;
+    std::string ext = name.substr(dot + 1);
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    const char* const readable[] = {"tif", "tiff", "png", "jpg", "jpeg", "jpe", "jp2", "webp", "bmp", "dib", "pbm",
+                                    "pgm", "ppm", "pnm", "pfm", "sr", "ras", "exr", "hdr", "pic"
+                                   };
+    const int n = sizeof(readable) / sizeof(readable[0]);
+    if (std::find(readable, readable + n, ext) == readable + n)
+        return false;
+
+    // name.part<pid>.ext
+    const size_t part = name.rfind(".part", dot);
+    return part == std::string::npos || part + 5 == dot ||
+           name.find_first_not_of("0123456789", part + 5) != dot;
+}
+
+/**
+ * @brief Stretches every image file which is written to or moved into a directory
+ * The files are queued by a thread reading inotify events as soon as they are closed after
+ * writing (or moved into the directory) and stretched one after the other in this process,
+ * with the options prepared once. With --auto the root power solved on the first frame is kept.
+ * When more than queue files are waiting, the previews of the oldest ones are skipped, so that the
+ * previews keep up with the newest frames; their outputs are still written. Only files with the
+ * extension of an image are taken, and temporary files of outputs being written are ignored.
+ * This function only returns on errors.
+ *
+ * @param[in] dir Directory
+ * @param[in] queue Maximum number of waiting files with previews
+ * @param[in] outputs Outputs, %s in the file names is replaced by the input name
+ * @param[in] previews Outputs of the preview, %s in the file names is replaced by the input name
+ * @param[in,out] options Options of the stretch
+ * @param[in] run Further options
+ * @return Status (0==OK)
+ */
+int watchDirectory(const std::string &dir, const int queue, const std::vector<OutputSpec> &outputs,
+                   const std::vector<OutputSpec> &previews, PipelineOptions &options, const RunOptions &run)
+{
+    for (size_t i = 0; i < outputs.size() + previews.size(); i++)
+    {
+        const OutputSpec &spec = i < outputs.size() ? outputs[i] : previews[i - outputs.size()];
+        if (spec.file.find("%s") == std::string::npos)
+        {
+            std::cout << "    Output " << spec.file << " needs %s for the name of the input with --watch" << std::endl;
+            return -1;
+        }
+    }
+
+#ifdef __linux__
+    const int fd = inotify_init();
+    if (fd < 0 || inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+        std::cout << "    Cannot watch " << dir << std::endl;
+        return -1;
+    }
+    const std::string absdir = absolutePath(dir + "/.");
+
+    // waiting files with the switch for their previews
+    std::deque<std::pair<std::string, bool> > pending;
+    // outputs of this process are not taken as inputs
+    std::set<std::string> written;
+    std::mutex mutex;
+    std::condition_variable added;
+
+    std::thread reader([&]()
+    {
+        std::vector<char> buffer(64 * (sizeof(struct inotify_event) + NAME_MAX + 1));
+        while (true)
+        {
+            const ssize_t n = read(fd, buffer.data(), buffer.size());
+            if (n <= 0)
+                break;
+            for (ssize_t k = 0; k < n; )
+            {
+                const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(buffer.data() + k);
+                k += sizeof(struct inotify_event) + event->len;
+                if (event->len == 0 || (event->mask & IN_ISDIR) || !isWatchedImage(event->name))
+                    continue;
+
+                const std::string file = absdir.substr(0, absdir.size() - 1) + event->name;
+                std::lock_guard<std::mutex> lock(mutex);
+                if (written.count(file))
+                    continue;
+                pending.push_back(std::make_pair(file, !previews.empty()));
+                for (size_t i = 0; (int)(i + queue) < (int)pending.size(); i++)
+                {
+                    if (pending[i].second)
+                    {
+                        std::cout << "  Skipping the preview of " << pending[i].first << std::endl;
+                        pending[i].second = false;
+                    }
+                }
+                added.notify_one();
+            }
+        }
+    });
+    reader.detach();
+
+    std::cout << "  Watching " << dir << std::endl;
+    while (true)
+    {
+        std::string file;
+        std::vector<OutputSpec> outs, prevs;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            added.wait(lock, [&]()
+            {
+                return !pending.empty();
+            });
+            file = pending.front().first;
+            const bool preview = pending.front().second;
+            pending.pop_front();
+
+            for (size_t i = 0; i < outputs.size(); i++)
+                outs.push_back(outputFor(outputs[i], file));
+            for (size_t i = 0; i < previews.size() && preview; i++)
+                prevs.push_back(outputFor(previews[i], file));
+            for (size_t i = 0; i < outs.size() + prevs.size(); i++)
+                written.insert(absolutePath(i < outs.size() ? outs[i].file : prevs[i - outs.size()].file));
+        }
+
+        std::cout << "  Processing " << file << std::endl;
+        if (processFile(file, outs, prevs, options, run) < 0)
+            std::cout << "    Error processing " << file << std::endl;
+    }
+#else
+    (void)dir;
+    (void)queue;
+    (void)options;
+    (void)run;
+    std::cout << "    --watch is only supported on Linux (inotify)" << std::endl;
+    return -1;
+#endif
+}
+
+/**
+ * @brief Test whether an output is a video file (avi, mp4, mkv or mov)
+ *
+ * @param[in] arg Output argument
+ * @return true for a video file
+ */
+bool isVideo(const std::string &arg)
+{
+    std::string ext = arg.substr(arg.find_last_of(".") + 1);
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    return ext == "avi" || ext == "mp4" || ext == "mkv" || ext == "mov";
+}
+
+/**
+ * @brief Name of a frame of a sequence
+ *
+ * @param[in] pattern File name with a printf conversion for the frame number, e.g. frame%04d.tif
+ * @param[in] index Frame number
+ * @return File name
+ */
+std::string frameName(const std::string &pattern, const int index)
+{
+    char name[PATH_MAX];
+    std::snprintf(name, sizeof(name), pattern.c_str(), index);
+    return name;
+}
+
+/**
+ * @brief Stretches the frames of a video or of numbered image files
+ * The sky subtractions of each frame start from those of the previous frame, so that they
+ * usually stop after one or two iterations. With --auto the root power is solved on the first
+ * frame and kept for all frames.
+ *
+ * @param[in] input Video file or numbered image files (with a printf conversion, e.g. frame%04d.tif)
+ * @param[in] outputs Image outputs with a printf conversion for the frame number
+ * @param[in] videos Video outputs
+ * @param[in] fps Frame rate of the video outputs (<= 0 for the one of the input video or 25)
+ * @param[in,out] options Options of the stretch
+ * @param[in] run Further options
+ * @return Status (0==OK)
+ */
+int processSequence(const std::string &input, const std::vector<OutputSpec> &outputs,
+                    const std::vector<std::string> &videos, const double fps, PipelineOptions &options,
+                    const RunOptions &run)
+{
+    const bool verbose = options.verbose;
+    for (size_t i = 0; i < outputs.size(); i++)
+    {
+        if (outputs[i].file.find('%') == std::string::npos)
+        {
+            std::cout << "    Output " << outputs[i].file << " needs a frame number (e.g. %04d) with --sequence" << std::endl;
+            return -1;
+        }
+    }
+
+    // numbered image files start at 0 or 1, anything else is opened as a video
+    const bool numbered = input.find('%') != std::string::npos;
+    int first = 0;
+    cv::VideoCapture capture;
+    if (numbered)
+    {
+        first = fexists(frameName(input, 0)) ? 0 : 1;
+    }
+    else if (!capture.open(input))
+    {
+        std::cout << "Error reading video " << input << std::endl;
+        return -1;
+    }
+    double rate = fps;
+    if (rate <= 0.)
+        rate = capture.isOpened() && capture.get(cv::CAP_PROP_FPS) > 0. ? capture.get(cv::CAP_PROP_FPS) : 25.;
+
+    std::vector<cv::VideoWriter> writers(videos.size());
+    SolvedParams params;
+    PipelineImage none;
+    int frame = 0;
+    for (;; frame++)
+    {
+        PipelineImage image;
+        if (numbered)
+        {
+            const std::string file = frameName(input, first + frame);
+            if (!fexists(file))
+                break;
+            if(verbose) std::cout << "  Reading frame " << file << std::endl;
+            if (readImage(file.c_str(), image) < 0)
+                return -1;
+        }
+        else
+        {
+            cv::Mat raw;
+            if (!capture.read(raw) || raw.empty())
+                break;
+            if(verbose) std::cout << "  Reading frame " << frame << std::endl;
+            ingestImage(raw, image);
+        }
+
+        if (frame == 0 && run.maxMem > 0)
+        {
+            // the frames are stretched whole, so only the precision of the colour reference can be reduced
+            RunOptions frameRun = run;
+            frameRun.roi.clear();
+            MemoryPlan plan;
+            if (planMemory(image.data.size(), image.data.channels(), 0, outputs, std::vector<OutputSpec>(), options,
+                           frameRun, false, plan) < 0)
+                return -1;
+            options.compactRef = plan.strategy == MemoryPlan::REDUCED;
+        }
+        if (frame > 0)
+            params.warmStart();
+        stretchImage(image, none, options, &params);
+
+        std::vector<OutputSpec> outs = outputs;
+        for (size_t i = 0; i < outs.size(); i++)
+        {
+            outs[i].file = frameName(outputs[i].file, first + frame);
+            if (fexists(outs[i].file) && !run.force)
+            {
+                std::cout << "    File " << outs[i].file << " exists" << std::endl;
+                return -1;
+            }
+        }
+        if (writeOutputs(image, outs, verbose) < 0)
+            return -1;
+
+        if (!writers.empty())
+        {
+            cv::Mat frame8(image.data.size(), CV_MAKETYPE(CV_8U, image.data.channels()));
+            quantize(image, 0, frame8, false, run.dither);
+            for (size_t i = 0; i < writers.size(); i++)
+            {
+                if (!writers[i].isOpened())
+                {
+                    std::string ext = videos[i].substr(videos[i].find_last_of(".") + 1);
+                    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+                    const int fourcc = ext == "avi" ? cv::VideoWriter::fourcc('M', 'J', 'P', 'G') :
+                                       cv::VideoWriter::fourcc('m', 'p', '4', 'v');
+                    if ((fexists(videos[i]) && !run.force) ||
+                            !writers[i].open(videos[i], fourcc, rate, frame8.size(), frame8.channels() == 3))
+                    {
+                        std::cout << "    Error writing " << videos[i] << std::endl;
+                        return -1;
+                    }
+                }
+                writers[i].write(frame8);
+            }
+        }
+        image.release();
+    }
+
+    if (frame == 0)
+    {
+        std::cout << "    No frames found in " << input << std::endl;
+        return -1;
+    }
+    if(verbose) std::cout << "  " << frame << " frames" << std::endl;
+    if(verbose) printPoolStats();
     return 0;
 }
 
+int main(int argc, char** argv)
+{
+    cv::String keys = "{help h usage   |        | print this message   }"
+                      "{o output  |        | output image (without the result will be displayed, supports jpg and tif), can be repeated, options can be appended as file:width=N:scale=F:quality=Q:dither, for tif also compression=none|lzw|deflate|packbits:predictor:tile=N:bigtiff}"
+                      "{f               |       | force to overwrite output file}"
+                      "{cache          |       | directory of a result cache, runs with the same input, options and version link the cached outputs}"
+                      "{fm fast-math    |       | fast approximations of pow and exp (error below half a 16 bit step)}"
+                      "{sampled-hist   |       | estimate the sky levels of large images from a sample of the pixels (falls back to all pixels if the error could exceed 2 in 16bit)}"
+                      "{opencl         |       | optional OpenCL kernels for two steps: the colour correction and the minimum run on the OpenCL device of OpenCV if it shares the host memory (e.g. an integrated GPU, or a CPU with PoCL), all other steps on the CPU}"
+                      "{tc tonecurve   |        | application of a tone curve}"
+                      "{sl skylevelfactor | 0.06 | sky level relative to the histogram peak  }"
+                      "{zerosky    | 4096.0    | desired zero point on sky, sets all channels}"
+                      "{zeroskyred    |        | desired zero point on sky, red channel}"
+                      "{zeroskygreen  |        | desired zero point on sky, green channel}"
+                      "{zeroskyblue   |        | desired zero point on sky, bue channel }"
+                      "{ri rootiter    | 1      | number of iterations on applying rootpower - sky }"
+                      "{rp rootpower   | 6.0    | power factor: 1/rootpower}"
+                      "{rp2 rootpower2 |        | use this power on iteration 2}"
+                      "{auto           |        | solve the root power from the histograms, so that auto-percentile reaches auto-target}"
+                      "{autop auto-percentile | 99.0 | percentile of the pixel values for --auto (in %)}"
+                      "{autot auto-target | 32768 | target level of the percentile for --auto (in 16bit)}"
+                      "{si scurveiter    | 0      | number of iterations on applying scurve - sky }"
+                      "{sc scurvepower   | 5.0    | scurve power odd iterations}"
+                      "{so scurveoffset  | 0.42    | scurve offset odd iterations}"
+                      "{sc2 scurvepower2 | 3.0    | scurve power  even iterations}"
+                      "{so2 scurveoffset2| 0.22   | scurve offset even iterations}"
+                      "{ccf color      | 1.0    | default enhancement value }" // PUT TOGETHER WITH COLOR FACTOR OF 1.2!!
+                      "{ncc nocolorcorrect |     | turn off color correction }"
+                      "{min    |        | set minimum in all channels (in 16bit)}"
+                      "{minr   |        | set minimum r (in 16bit)}"
+                      "{ming   |        | set minimum g (in 16bit)}"
+                      "{minb   |        | set minimum b (in 16bit)}"
+                      "{dither   |        | ordered dithering for 8 bit outputs}"
+                      "{p preview  |        | write a downsampled preview first (options as for output), the full image is processed with the parameters solved on the preview}"
+                      "{ps preview-step | 4 | downsampling step of the preview}"
+                      "{roi      |        | process and write only the crop x,y,w,h (in pixels), the statistics are taken from the full image}"
+                      "{rois roi-sample | 1 | use every n-th pixel of the full image for the statistics with --roi}"
+                      "{sequence       |        | stretch the frames of a video or numbered images (e.g. frame%04d.tif), outputs are videos (avi, mp4, mkv, mov) or numbered images}"
+                      "{fps            | 0      | frame rate of video outputs with --sequence (0 for the one of the input)}"
+                      "{watch          |        | stretch every image file written to the directory given instead of the image, %s in the output names is replaced by the image name}"
+                      "{watch-queue    | 2      | maximum number of waiting images with previews with --watch, the previews of older ones are skipped}"
+                      "{max-mem        |        | memory budget for the image buffers, e.g. 2G, in-core, reduced precision or tiled execution is chosen to stay within it (tiled output is approximate: its parameters are solved on a subsample, so it depends on the budget)}"
+                      "{threads        | 0      | number of threads (0 for all CPUs)}"
+                      "{cpus           |        | bind the threads to these CPUs, e.g. 0-7,16-23 (Linux only)}"
+                      "{numa-node      |        | bind the threads to the CPUs of this NUMA node (Linux only)}"
+                      "{x no-display    |        | no display}"
+                      "{v verbose   |        | print some progress information }";
+    //                      "{bp blackpoint   |     0   | set blackpoint (in units..) }";
+
+    CustomCLP2 clp(argc, argv, keys);
+
+    long int N = clp.n_positional_args();
+    if (clp.get<bool>("help") || N == 0)
+    {
+        clp.printMessage();
+        return 0;
+    }
+
+    const bool verbose = clp.get<bool>("verbose");
+    std::vector<OutputSpec> outputs;
+    std::vector<std::string> videos;
+    for (size_t i = 0; i < clp.outputs.size(); i++)
+    {
+        if (clp.has("sequence") && isVideo(clp.outputs[i]))
+        {
+            videos.push_back(clp.outputs[i]);
+            continue;
+        }
+        OutputSpec spec;
+        if (parseOutput(clp.outputs[i], spec) < 0)
+            return -1;
+        spec.dither = spec.dither || clp.has("dither");
+        outputs.push_back(spec);
+    }
+    std::vector<OutputSpec> previews;
+    if (clp.has("p"))
+    {
+        previews.resize(1);
+        if (parseOutput(clp.get<cv::String>("p"), previews[0]) < 0)
+            return -1;
+        previews[0].dither = previews[0].dither || clp.has("dither");
+    }
+
+    float skylevelfactor = clp.get<float>("sl");
+    float skyLR = clp.get<float>("zerosky");
+    float skyLG = clp.get<float>("zerosky");
+    float skyLB = clp.get<float>("zerosky");
+
+    if(clp.has("zeroskyred")) skyLR = clp.get<float>("zeroskyred");
+    if(clp.has("zeroskygreen")) skyLG = clp.get<float>("zeroskygreen");
+    if(clp.has("zeroskyblue")) skyLB = clp.get<float>("zeroskyblue");
+
+    setSampledHists(clp.has("sampled-hist"));
+
+    // OpenCV's T-API is only used by the OpenCL kernels of the library
+    cv::ocl::setUseOpenCL(clp.has("opencl"));
+    bool openCL = false;
+    if (clp.has("opencl"))
+    {
+        openCL = setOpenCL(true);
+        if (openCL)
+        {
+            if(verbose) std::cout << "  OpenCL device " << cv::ocl::Device::getDefault().name() << std::endl;
+        }
+        else
+        {
+            std::cout << "    WARNING: no OpenCL device sharing the host memory, using the CPU kernels" << std::endl;
+        }
+    }
+
+    //clp.errorCheck();
+
+    PipelineOptions options;
+    options.stretch.skylevelfactor = skylevelfactor;
+    options.stretch.skyLR = skyLR;
+    options.stretch.skyLG = skyLG;
+    options.stretch.skyLB = skyLB;
+    options.stretch.rootiter = clp.get<int>("ri");
+    options.stretch.rootpower2 = clp.has("rp2") ? clp.get<float>("rp2") : 0.;
+    options.stretch.scurveiter = clp.get<int>("si");
+    options.stretch.scurvepower1 = clp.get<float>("sc");
+    options.stretch.scurveoffset1 = clp.get<float>("so");
+    options.stretch.scurvepower2 = clp.get<float>("sc2");
+    options.stretch.scurveoffset2 = clp.get<float>("so2");
+    options.tonecurve = clp.has("tc");
+    options.rootpower = clp.get<float>("rp");
+    options.autoRoot = clp.has("auto");
+    options.autoPercentile = clp.get<float>("autop");
+    options.autoTarget = clp.get<float>("autot") / 65535.;
+    options.colorcorrect = !clp.has("ncc");
+    options.colorenhance = clp.get<float>("ccf");
+    options.setmin = clp.has("minr") || clp.has("minb") || clp.has("ming") || clp.has("min");
+    if(clp.has("min"))
+    {
+        options.minr = clp.get<float>("min") / 65535.;
+        options.ming = clp.get<float>("min") / 65535.;
+        options.minb = clp.get<float>("min") / 65535.;
+    }
+    if(clp.has("minr"))
+    {
+        options.minr = clp.get<float>("minr") / 65535.;
+    }
+    if(clp.has("ming"))
+    {
+        options.ming = clp.get<float>("ming") / 65535.;
+    }
+    if(clp.has("minb"))
+    {
+        options.minb = clp.get<float>("minb") / 65535.;
+    }
+    options.display = !clp.has("x");
+    options.verbose = verbose;
+
+    if (clp.has("fm"))
+    {
+        // check the approximations for the parameters of this run against the exact curves
+        const double err = fastMathBound(options.rootpower, options.stretch);
+        if (err < 0.5 / 65535.)
+        {
+            if(verbose) std::cout << "  Fast math (maximum error " << err * 65535. << " in 16bit)" << std::endl;
+            setFastMath(true);
+            options.fastMath = true;
+        }
+        else
+        {
+            std::cout << "    WARNING: fast math error " << err * 65535. << " (in 16bit) too large, using exact functions" <<
+                      std::endl;
+        }
+    }
+
+    RunOptions run;
+    run.cache = clp.has("cache") ? clp.get<cv::String>("cache") : cv::String();
+    if (!run.cache.empty() && prepareCache(run.cache) < 0)
+        return -1;
+    run.roi = clp.has("roi") ? clp.get<cv::String>("roi") : cv::String();
+    run.roiSample = clp.get<int>("rois");
+    run.previewStep = clp.get<int>("ps");
+    run.force = clp.get<bool>("f");
+    run.dither = clp.has("dither");
+    run.fastMath = options.fastMath;
+    run.sampledHists = clp.has("sampled-hist");
+    run.openCL = openCL;
+    if (clp.has("max-mem") && parseBytes(clp.get<cv::String>("max-mem"), run.maxMem) < 0)
+        return -1;
+
+    // the kernels run on the threads of their own context, OpenCV's functions (resizing,
+    // encoding) get the same budget
+    std::vector<int> cpus;
+    if (clp.has("cpus") && parseCpuList(clp.get<cv::String>("cpus"), cpus) < 0)
+    {
+        std::cout << "    Invalid CPU list " << clp.get<cv::String>("cpus") << std::endl;
+        return -1;
+    }
+    if (clp.has("numa-node") && numaCpus(clp.get<int>("numa-node"), cpus) < 0)
+        return -1;
+    std::unique_ptr<ExecutionContext> context;
+    if (clp.get<int>("threads") > 0 || !cpus.empty())
+    {
+        context.reset(new ExecutionContext(clp.get<int>("threads"), cpus));
+        context->bind();
+        setExecutionContext(context.get());
+        cv::setNumThreads(context->threads());
+        if(verbose) std::cout << "  " << context->threads() << " threads" << std::endl;
+    }
+
+    if (clp.has("sequence"))
+    {
+        if (outputs.empty() && videos.empty())
+        {
+            std::cout << "    --sequence needs at least one output" << std::endl;
+            return -1;
+        }
+        options.display = false;
+        return processSequence(clp.pos_args[0], outputs, videos, clp.get<double>("fps"), options, run);
+    }
+
+    if (clp.has("watch"))
+    {
+        if (outputs.empty())
+        {
+            std::cout << "    --watch needs at least one output" << std::endl;
+            return -1;
+        }
+        options.display = false;
+        return watchDirectory(clp.pos_args[0], clp.get<int>("watch-queue"), outputs, previews, options, run);
+    }
+
+    return processFile(clp.pos_args[0], outputs, previews, options, run);
+}
+
@@ -0,0 +1,73 @@
+#!/usr/bin/env bash
+
+# Copyright(c) 2020 Joachim Janz. All rights reserved.
+
+# Runs batch-stretch with several workers and a stand-in for j3colorstretch which kills its
+# worker on the first attempt of one image. The job of the killed worker has to be re-queued,
+# and each image has to be recorded exactly once as done in the manifest. A second run checks
+# that --threads N is passed on as given.
+#
+# Usage: test_batch.sh <batch-stretch>
+
+BATCH="$1"
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+mkdir -p "$WORK/bin" "$WORK/images"
+
+# copies the input to the output, records its arguments and kills its worker once on crash.tif
+cat > "$WORK/bin/j3colorstretch" <<'FAKE'
+#!/usr/bin/env bash
+echo "$*" >> "$(dirname -- "$0")/calls"
+out=
+for arg in "$@"; do
+  [[ $arg == --output=* ]] && out="${arg#--output=}"
+done
+if [[ $1 == */crash.tif ]] && mkdir "$(dirname -- "$0")/crashed" 2>/dev/null; then
+  kill -9 $PPID
+  exit 1
+fi
+sleep 0.2
+cp "$1" "$out"
+FAKE
+chmod +x "$WORK/bin/j3colorstretch"
+export PATH="$WORK/bin:$PATH"
+export J3CS_HEARTBEAT=1 J3CS_STALE_SECONDS=2
+
+for i in $(seq -w 1 15); do
+  echo "$i" > "$WORK/images/image$i.tif"
+done
+echo crash > "$WORK/images/crash.tif"
+
+status=0
+timeout 120 "$BATCH" --workers 4 "$WORK/images" tif jpg > "$WORK/log" 2>&1
+manifest=$(ls "$WORK"/images/.j3cs-jobs/*/manifest)
+
+if ! [ -d "$WORK/bin/crashed" ] || ! grep -q "Re-queuing crash.tif" "$WORK/log"; then
+  echo "FAILED: the job of the killed worker was not re-queued"
+  status=1
+fi
+for file in "$WORK"/images/*.tif; do
+  n=$(awk -v f="$file" '$3 == "done" && $4 == f' "$manifest" | wc -l)
+  if [ "$n" -ne 1 ]; then
+    echo "FAILED: $(basename -- "$file") recorded $n times as done"
+    status=1
+  fi
+  filename=$(basename -- "$file")
+  cmp -s "$file" "$WORK/images/${filename%.*}_j3cs.jpg" || { echo "FAILED: no output of $filename"; status=1; }
+done
+if grep -q " failed " "$manifest"; then
+  echo "FAILED: failed jobs in the manifest"
+  status=1
+fi
+
+# --threads N is kept, not followed by a share of the CPUs
+rm -f "$WORK/bin/calls"
+timeout 60 "$BATCH" --workers 2 "$WORK/images" tif jpg -f --threads 3 >> "$WORK/log" 2>&1
+if ! grep -q -- "--threads 3" "$WORK/bin/calls" || grep -q -- "--threads=" "$WORK/bin/calls"; then
+  echo "FAILED: --threads 3 was not passed on as given"
+  status=1
+fi
+
+[ "$status" -eq 0 ] || cat "$WORK/log"
+[ "$status" -eq 0 ] && echo "each image done once, the job of the killed worker re-queued"
+exit $status
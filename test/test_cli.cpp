@@ -0,0 +1,239 @@
+/*******************************************************************************
+  Copyright(c) 2020 Joachim Janz. All rights reserved.
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation; either version 2 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU Library General Public License
+  along with this library; see the file COPYING.LIB.  If not, write to
+  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+  Boston, MA 02110-1301, USA.
+
+  The full GNU General Public License is included in this distribution in the
+  file called LICENSE.
+
+*******************************************************************************/
+
+/**
+ * @file test_cli.cpp
+ * @brief Runs j3colorstretch on a synthetic image and checks its outputs
+ *
+ * Usage: test_cli <j3colorstretch> tiff|cache
+ *
+ * tiff: the tif outputs of all compressions, with the predictor, in tiles and as BigTIFF are
+ * read back with OpenCV and have to hold the same pixels as the uncompressed output, with the
+ * colours of the input in the right channels and the right orientation.
+ *
+ * cache: a run with --cache stores its outputs, the same run again finds them in the cache,
+ * a run with another option does not. A cache directory which cannot be created is reported.
+ */
+
+#include "opencv2/core.hpp"
+#include "opencv2/imgcodecs.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/// Path of the j3colorstretch executable
+static std::string program;
+
+/**
+ * @brief Writes a 16 bit input with sky noise, a red nebula in the left half and stars
+ *
+ * @param file File name
+ */
+static void writeInput(const std::string &file)
+{
+    const int rows = 200, cols = 300;
+    cv::Mat frame(rows, cols, CV_32FC3);
+    cv::RNG rng(41);
+    rng.fill(frame, cv::RNG::NORMAL, cv::Scalar(0.1, 0.1, 0.1), cv::Scalar::all(0.004));
+    for (int row = 0; row < rows; row++)
+    {
+        cv::Vec3f* p = frame.ptr<cv::Vec3f>(row);
+        for (int col = 0; col < cols / 2; col++)
+            p[col] += cv::Vec3f(0.005f, 0.01f, 0.05f);
+    }
+    for (int i = 0; i < 30; i++)
+        frame.at<cv::Vec3f>(rng.uniform(0, rows), rng.uniform(0, cols)) += cv::Vec3f(0.6f, 0.6f, 0.6f);
+
+    cv::Mat out;
+    frame.convertTo(out, CV_16UC3, 65535.);
+    cv::imwrite(file, out);
+}
+
+/**
+ * @brief Runs j3colorstretch
+ *
+ * @param args Arguments
+ * @param output Output of the run
+ * @return Exit status
+ */
+static int run(const std::string &args, std::string &output)
+{
+    const std::string command = "\"" + program + "\" -x " + args + " 2>&1";
+    FILE* p = popen(command.c_str(), "r");
+    if (!p) return -1;
+    output.clear();
+    char buf[4096];
+    size_t n;
+    while ((n = std::fread(buf, 1, sizeof(buf), p)) > 0)
+        output.append(buf, n);
+    return pclose(p);
+}
+
+/**
+ * @brief Reads a file
+ *
+ * @param file File name
+ * @return Contents
+ */
+static std::string contents(const std::string &file)
+{
+    std::ifstream in(file.c_str(), std::ios::binary);
+    std::ostringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+}
+
+/**
+ * @brief Writes the tif outputs and reads them back
+ *
+ * @return true if all outputs hold the expected pixels
+ */
+static bool testTiff()
+{
+    writeInput("tiff_input.tif");
+
+    const char* const variants[] =
+    {
+        "compression=none", "compression=lzw", "compression=deflate", "compression=packbits",
+        "compression=lzw:predictor", "compression=deflate:predictor", "compression=none:tile=64",
+        "compression=deflate:predictor:tile=64", "compression=lzw:bigtiff"
+    };
+    const int n = sizeof(variants) / sizeof(variants[0]);
+
+    std::string args = "-f tiff_input.tif";
+    for (int i = 0; i < n; i++)
+        args += " --output=tiff_out" + std::to_string(i) + ".tif:" + variants[i];
+    std::string output;
+    if (run(args, output) != 0)
+    {
+        std::cout << output << "FAILED: j3colorstretch " << args << std::endl;
+        return false;
+    }
+
+    bool ok = true;
+    const cv::Mat ref = cv::imread("tiff_out0.tif", cv::IMREAD_UNCHANGED);
+    if (ref.type() != CV_16UC3 || ref.rows != 200 || ref.cols != 300)
+    {
+        std::cout << "FAILED: uncompressed output is not a 300x200 16 bit colour image" << std::endl;
+        return false;
+    }
+
+    // the red nebula has to be in the red channel (BGR in OpenCV) of the left half
+    const cv::Scalar left = cv::mean(ref(cv::Rect(0, 0, 150, 200)));
+    const cv::Scalar right = cv::mean(ref(cv::Rect(150, 0, 150, 200)));
+    std::cout << "mean of the left half " << left[0] << " " << left[1] << " " << left[2] << ", of the right half " <<
+              right[0] << " " << right[1] << " " << right[2] << std::endl;
+    if (!(left[2] > left[0] && left[2] > right[2]))
+    {
+        std::cout << "FAILED: the nebula is not red in the left half of the output" << std::endl;
+        ok = false;
+    }
+
+    for (int i = 1; i < n; i++)
+    {
+        const std::string file = "tiff_out" + std::to_string(i) + ".tif";
+        const cv::Mat im = cv::imread(file, cv::IMREAD_UNCHANGED);
+        const bool same = im.type() == ref.type() && im.size() == ref.size() && cv::norm(im, ref, cv::NORM_INF) == 0.;
+        std::cout << variants[i] << ": " << (same ? "same pixels" : "FAILED") << std::endl;
+        ok = ok && same;
+    }
+    return ok;
+}
+
+/**
+ * @brief Runs j3colorstretch with a result cache
+ *
+ * @return true if the cache is hit and missed as expected
+ */
+static bool testCache()
+{
+    writeInput("cache_input.tif");
+    if (std::system("rm -rf cache_dir cache_file cache_out*.tif") != 0)
+        return false;
+
+    // the directory (and its parent) is created
+    const std::string cache = "cache_dir/results";
+    const std::string args = "-f cache_input.tif --cache=" + cache + " --output=";
+    std::string output;
+    bool ok = true;
+
+    if (run(args + "cache_out.tif", output) != 0 || output.find("found in the cache") != std::string::npos)
+    {
+        std::cout << output << "FAILED: first run" << std::endl;
+        ok = false;
+    }
+    const std::string first = contents("cache_out.tif");
+
+    if (run(args + "cache_out2.tif", output) != 0 || output.find("Outputs found in the cache") == std::string::npos)
+    {
+        std::cout << output << "FAILED: second run did not find the outputs in the cache" << std::endl;
+        ok = false;
+    }
+    if (first.empty() || contents("cache_out2.tif") != first)
+    {
+        std::cout << "FAILED: cached output differs" << std::endl;
+        ok = false;
+    }
+
+    if (run(args + "cache_out2.tif --rp=5", output) != 0 || output.find("found in the cache") != std::string::npos)
+    {
+        std::cout << output << "FAILED: run with another root power found outputs in the cache" << std::endl;
+        ok = false;
+    }
+    if (contents("cache_out2.tif") == first)
+    {
+        std::cout << "FAILED: run with another root power wrote the same output" << std::endl;
+        ok = false;
+    }
+
+    // a cache below a file cannot be created
+    std::ofstream("cache_file").put('x');
+    if (run("-f cache_input.tif --cache=cache_file/results --output=cache_out3.tif", output) == 0)
+    {
+        std::cout << output << "FAILED: cache below a file was accepted" << std::endl;
+        ok = false;
+    }
+
+    std::cout << (ok ? "cache hits and misses as expected" : "FAILED: cache") << std::endl;
+    return ok;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 3)
+    {
+        std::cout << "Usage: test_cli <j3colorstretch> tiff|cache" << std::endl;
+        return 2;
+    }
+    program = argv[1];
+    const std::string test = argv[2];
+    if (test == "tiff") return testTiff() ? 0 : 1;
+    if (test == "cache") return testCache() ? 0 : 1;
+    std::cout << "Unknown test " << test << std::endl;
+    return 2;
+}
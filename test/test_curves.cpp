@@ -0,0 +1,180 @@
+/*******************************************************************************
+  Copyright(c) 2020 Joachim Janz. All rights reserved.
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation; either version 2 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU Library General Public License
+  along with this library; see the file COPYING.LIB.  If not, write to
+  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+  Boston, MA 02110-1301, USA.
+
+  The full GNU General Public License is included in this distribution in the
+  file called LICENSE.
+
+*******************************************************************************/
+
+/**
+ * @file test_curves.cpp
+ * @brief Checks the root stretch, the tone curve and the S-curve against double precision
+ *
+ * The curves are applied with the exact functions (in single precision) and with the fast
+ * approximations to all pixel values between 0 and 1 in steps of a quarter of a 16 bit step,
+ * for mono and colour images. The error has to stay below half a 16 bit step for root powers
+ * from 1 to 150 and the S-curve parameters of the command line range.
+ */
+
+#include "j3clrstrtch.hpp"
+
+#include <cmath>
+#include <functional>
+#include <iostream>
+
+/// Largest allowed error (half a 16 bit step)
+static const double maxError = 0.5 / 65535.;
+
+/**
+ * @brief Creates an image holding all pixel values between 0 and 1 in each channel
+ * The channels hold the values in a different order.
+ *
+ * @param cn Number of channels
+ * @return Image
+ */
+static cv::Mat rampImage(const int cn)
+{
+    const int n = 4 * 65535;
+    cv::Mat image(1, n + 1, CV_MAKETYPE(CV_32F, cn));
+    float* p = image.ptr<float>(0);
+    for (int i = 0; i <= n; i++)
+    {
+        for (int c = 0; c < cn; c++)
+        {
+            const int j = c == 0 ? i : (c == 1 ? n - i : (int)((i * 7919LL) % (n + 1)));
+            *p++ = (float)j / n;
+        }
+    }
+    return image;
+}
+
+/**
+ * @brief Maximum error of a result against a reference function of the input
+ *
+ * @param in Input image
+ * @param out Result
+ * @param ref Reference in double precision
+ * @return Maximum absolute error
+ */
+static double maxDiff(const cv::Mat &in, const cv::Mat &out, const std::function<double(double)> &ref)
+{
+    CV_Assert(in.size() == out.size() && in.type() == out.type());
+    double err = 0.;
+    const float* p = in.ptr<float>(0);
+    const float* q = out.ptr<float>(0);
+    for (size_t i = 0; i < in.total() * in.channels(); i++)
+    {
+        const double e = std::fabs(q[i] - ref(p[i]));
+        err = e > err ? e : err;
+    }
+    return err;
+}
+
+/**
+ * @brief Reports the result of a check
+ *
+ * @param what Name of the check
+ * @param err Maximum error
+ * @return true if the error is small enough
+ */
+static bool check(const std::string &what, const double err)
+{
+    if (err < maxError) return true;
+    std::cout << "FAILED: " << what << " error " << err * 65535. << " (in 16bit)" << std::endl;
+    return false;
+}
+
+int main()
+{
+    bool ok = true;
+
+    for (int fast = 0; fast < 2; fast++)
+    {
+        setFastMath(fast != 0);
+        const std::string mode = fast ? "fast math" : "exact";
+
+        for (int cn = 1; cn <= 3; cn += 2)
+        {
+            const cv::Mat in = rampImage(cn);
+            double worst = 0.;
+
+            // the image contains 0, so the minimum of the root is that of 0
+            const double eps = 1.0 / 65535.0;
+            const double norm = 1. / (1. + 1.0 / 65535.);
+            for (int rootpower = 1; rootpower <= 150; rootpower++)
+            {
+                const double x = 1. / rootpower;
+                double mn = std::pow(eps * norm, x) - 4096.0 / 65535.;
+                mn = mn > 0. ? mn : 0.;
+
+                cv::Mat out;
+                stretching(in, out, rootpower);
+                const double err = maxDiff(in, out, [&](double v)
+                {
+                    return (std::pow((v + eps) * norm, x) - mn) / (1. - mn);
+                });
+                ok = check(mode + " root stretch, rootpower " + std::to_string(rootpower), err) && ok;
+                worst = err > worst ? err : worst;
+            }
+
+            {
+                PipelineImage image(in.clone());
+                toneCurve(image);
+                cv::Mat out;
+                image.apply(out);
+                const double err = maxDiff(in, out, [](double v)
+                {
+                    return v * 12. * std::exp(std::log(1. / 12.) * std::pow(v, 0.4));
+                });
+                ok = check(mode + " tone curve", err) && ok;
+                worst = err > worst ? err : worst;
+            }
+
+            for (int i = 0; i <= 18; i++)
+            {
+                for (int j = 0; j <= 18; j++)
+                {
+                    const float xfactor = 1.f + 0.5f * i;
+                    const float xoffset = 0.05f * j;
+                    const double scurvemax = xfactor / (1. + std::exp(-(1. - xoffset) * xfactor)) - (1. - xoffset);
+                    const double scurveminsc = (xfactor / (1. + std::exp(xoffset * xfactor)) - (1. - xoffset)) /
+                                               scurvemax;
+
+                    PipelineImage image(in.clone());
+                    scurve(image, xfactor, xoffset);
+                    cv::Mat out;
+                    image.apply(out);
+                    const double err = maxDiff(in, out, [&](double v)
+                    {
+                        double sc = xfactor / (1. + std::exp(-xfactor * (v - xoffset))) - (1. - xoffset);
+                        sc = (sc / scurvemax - scurveminsc) / (1. - scurveminsc);
+                        return sc > 0. ? sc : 0.;
+                    });
+                    ok = check(mode + " S-curve " + std::to_string(xfactor) + " " + std::to_string(xoffset), err) && ok;
+                    worst = err > worst ? err : worst;
+                }
+            }
+
+            std::cout << mode << ", " << cn << " channel(s): maximum error " << worst * 65535. << " (in 16bit)" <<
+                      std::endl;
+        }
+    }
+
+    setFastMath(false);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,148 @@
+/*******************************************************************************
+  Copyright(c) 2020 Joachim Janz. All rights reserved.
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation; either version 2 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU Library General Public License
+  along with this library; see the file COPYING.LIB.  If not, write to
+  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+  Boston, MA 02110-1301, USA.
+
+  The full GNU General Public License is included in this distribution in the
+  file called LICENSE.
+
+*******************************************************************************/
+
+
+/**
+ * @file test_opencl.cpp
+ * @brief Compares the OpenCL kernels of the colour correction and setMin() with the CPU
+ *
+ * Both steps are run on a synthetic frame (sky with noise, stars and a nebula) with and
+ * without OpenCL, with the tile summary, so that the kernels skip sky tiles as the CPU does.
+ * Exits with 77 (skipped) if there is no OpenCL device sharing the host memory.
+ */
+
+#include "j3clrstrtch.hpp"
+
+#include <cmath>
+#include <iostream>
+
+/// Largest allowed difference (half a 16 bit step)
+static const double maxError = 0.5 / 65535.;
+
+/**
+ * @brief Creates a synthetic linear frame at the sky level of the sky subtraction
+ *
+ * @param rows Number of rows
+ * @param cols Number of columns
+ * @return Frame (CV_32FC3)
+ */
+static cv::Mat syntheticFrame(const int rows, const int cols)
+{
+    const float sky = 4096.f / 65535.f;
+    cv::Mat frame(rows, cols, CV_32FC3);
+    cv::RNG rng(49);
+    rng.fill(frame, cv::RNG::UNIFORM, cv::Scalar::all(sky), cv::Scalar::all(sky + 8.f / 65535.f));
+
+    // nebula in the upper left quarter and stars in the lower half
+    for (int row = 0; row < rows / 2; row++)
+    {
+        cv::Vec3f* p = frame.ptr<cv::Vec3f>(row);
+        for (int col = 0; col < cols / 2; col++)
+        {
+            const float d = std::hypot((float)row / rows - 0.2f, (float)col / cols - 0.2f);
+            const float v = 0.05f * std::exp(-d * d / 0.01f);
+            p[col] += cv::Vec3f(0.3f * v, 0.6f * v, v);
+        }
+    }
+    for (int i = 0; i < 60; i++)
+        frame.at<cv::Vec3f>(rng.uniform(rows / 2, rows), rng.uniform(0, cols)) +=
+            cv::Vec3f(rng.uniform(0.1f, 0.5f), rng.uniform(0.1f, 0.5f), rng.uniform(0.1f, 0.5f));
+    return frame;
+}
+
+/**
+ * @brief Reports the result of a comparison
+ *
+ * @param what Name of the step
+ * @param a Result with OpenCL
+ * @param b Result on the CPU
+ * @return true if the results agree
+ */
+static bool check(const std::string &what, const cv::Mat &a, const cv::Mat &b)
+{
+    const double err = cv::norm(a, b, cv::NORM_INF);
+    std::cout << what << ": maximum difference " << err * 65535. << " (in 16bit)" << std::endl;
+    if (err < maxError) return true;
+    std::cout << "FAILED: " << what << " differs with OpenCL" << std::endl;
+    return false;
+}
+
+/**
+ * @brief Runs the colour correction of a stretched frame
+ *
+ * @param frame Linear frame
+ * @param ocl Use the OpenCL kernel
+ * @return Result
+ */
+static cv::Mat runColorcorr(const cv::Mat &frame, const bool ocl)
+{
+    setOpenCL(ocl);
+    PipelineImage reference(frame.clone());
+    updateHists(reference);
+    PipelineImage image(frame.clone());
+    stretching(image, 3.);
+    colorcorr(image, reference.data, 4096., 4096., 4096., 1.0, false, reference.effectiveTiles());
+    cv::Mat out;
+    image.apply(out);
+    return out;
+}
+
+/**
+ * @brief Runs setMin() with a pending transform
+ *
+ * @param frame Linear frame
+ * @param ocl Use the OpenCL kernel
+ * @return Result
+ */
+static cv::Mat runSetMin(const cv::Mat &frame, const bool ocl)
+{
+    setOpenCL(ocl);
+    PipelineImage image(frame.clone());
+    updateHists(image);
+    image.affine(cv::Scalar::all(1.1), cv::Scalar::all(-0.005));
+    setMin(image, 0.065f, 0.066f, 0.067f);
+    cv::Mat out;
+    image.apply(out);
+    return out;
+}
+
+int main()
+{
+    if (!setOpenCL(true))
+    {
+        std::cout << "no OpenCL device sharing the host memory" << std::endl;
+        return 77;
+    }
+
+    bool ok = true;
+    const cv::Mat frame = syntheticFrame(640, 960);
+    cv::Mat mono;
+    cv::extractChannel(frame, mono, 1);
+
+    ok = check("colorcorr", runColorcorr(frame, true), runColorcorr(frame, false)) && ok;
+    ok = check("setMin", runSetMin(frame, true), runSetMin(frame, false)) && ok;
+    ok = check("setMin (mono)", runSetMin(mono, true), runSetMin(mono, false)) && ok;
+
+    setOpenCL(false);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,91 @@
+"""Smoke test of the Python module j3clrstrtch.
+
+The steps have to work in place on the wrapped arrays, planar arrays have to be rejected, and
+images stretched concurrently from a thread pool have to give the same results as one by one.
+Exits with 77 (skipped) if NumPy is not installed.
+"""
+
+import sys
+from concurrent.futures import ThreadPoolExecutor
+
+try:
+    import numpy as np
+except ImportError:
+    print("NumPy is not installed")
+    sys.exit(77)
+
+import j3clrstrtch
+
+
+def frame(seed, channels=3):
+    """Synthetic linear frame: sky noise with a brighter region and stars."""
+    rng = np.random.default_rng(seed)
+    shape = (240, 320, channels) if channels == 3 else (240, 320)
+    data = rng.normal(0.1, 0.004, shape).astype(np.float32)
+    data[:, :160] += 0.03
+    for _ in range(20):
+        data[rng.integers(0, 240), rng.integers(0, 320)] += 0.6
+    return data
+
+
+def stretch(data):
+    """Runs the steps of j3colorstretch on an array in place."""
+    image = j3clrstrtch.Image(data)
+    image.skysub()
+    image.apply()
+    if data.ndim == 3:
+        ref = data.copy()
+    image.stretch(rootpower=6.0)
+    image.skysub()
+    if data.ndim == 3:
+        image.colorcorr(ref)
+        image.skysub()
+    image.apply()
+    return data
+
+
+def main():
+    failed = []
+
+    # in place: the result is in the buffer of the array passed in
+    for channels in (1, 3):
+        data = frame(1, channels)
+        before = data.copy()
+        address = data.ctypes.data
+        result = stretch(data)
+        if result is not data or data.ctypes.data != address:
+            failed.append("%d channel(s): the array was replaced" % channels)
+        if np.array_equal(data, before):
+            failed.append("%d channel(s): the array was not changed" % channels)
+        if not (np.isfinite(data).all() and data.min() >= 0.0):
+            failed.append("%d channel(s): result not finite or negative" % channels)
+
+    # planar arrays would need a copy
+    try:
+        j3clrstrtch.Image(np.zeros((3, 240, 320), np.float32))
+        failed.append("planar array accepted")
+    except ValueError as e:
+        print("planar array: ValueError (%s)" % e)
+
+    # concurrent steps on separate images from a thread pool
+    inputs = [frame(seed) for seed in range(8)]
+    expected = [stretch(data.copy()) for data in inputs]
+    for threads in (0, 2):
+        j3clrstrtch.set_threads(threads)
+        arrays = [data.copy() for data in inputs]
+        with ThreadPoolExecutor(max_workers=4) as pool:
+            results = list(pool.map(stretch, arrays))
+        for i, (result, array) in enumerate(zip(results, arrays)):
+            if result is not array or not np.array_equal(result, expected[i]):
+                failed.append("image %d differs when stretched concurrently (thread budget %d)" % (i, threads))
+    j3clrstrtch.set_threads(0)
+
+    for message in failed:
+        print("FAILED: " + message)
+    if not failed:
+        print("in place, planar arrays rejected, concurrent results as sequential")
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
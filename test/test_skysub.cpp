@@ -0,0 +1,97 @@
+/*******************************************************************************
+  Copyright(c) 2020 Joachim Janz. All rights reserved.
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation; either version 2 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU Library General Public License
+  along with this library; see the file COPYING.LIB.  If not, write to
+  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+  Boston, MA 02110-1301, USA.
+
+  The full GNU General Public License is included in this distribution in the
+  file called LICENSE.
+
+*******************************************************************************/
+
+/**
+ * @file test_skysub.cpp
+ * @brief Compares the sky subtraction with sampled histograms to the one with all pixels
+ *
+ * A synthetic 5 megapixel frame (Gaussian sky noise with a different level in each channel,
+ * and stars) is large enough for the sampled histograms. Both sky subtractions stop once the
+ * sky levels are within 5 (in 16bit) of the targets and the sample adds an error of at most 2,
+ * so the sky levels of the results may differ by up to 12.
+ */
+
+#include "j3clrstrtch.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+int main()
+{
+    const int rows = 1920, cols = 2560;
+    const cv::Scalar sky(5000. / 65535., 5500. / 65535., 6100. / 65535.);
+    const cv::Scalar noise(300. / 65535., 250. / 65535., 350. / 65535.);
+
+    cv::Mat frame(rows, cols, CV_32FC3);
+    cv::RNG rng(50);
+    rng.fill(frame, cv::RNG::NORMAL, sky, noise);
+    for (int i = 0; i < 2000; i++)
+    {
+        const cv::Point c(rng.uniform(0, cols), rng.uniform(0, rows));
+        const float peak = rng.uniform(0.05f, 0.8f);
+        for (int row = std::max(c.y - 3, 0); row < std::min(c.y + 4, rows); row++)
+        {
+            for (int col = std::max(c.x - 3, 0); col < std::min(c.x + 4, cols); col++)
+            {
+                const float r2 = (float)((row - c.y) * (row - c.y) + (col - c.x) * (col - c.x));
+                frame.at<cv::Vec3f>(row, col) += cv::Vec3f(1.f, 1.f, 1.f) * (peak * std::exp(-r2 / 2.f));
+            }
+        }
+    }
+
+    PipelineImage full(frame);
+    setSampledHists(false);
+    CVskysub(full, 0.06f, 4096., 4096., 4096.);
+
+    PipelineImage sampled(frame);
+    setSampledHists(true);
+    CVskysub(sampled, 0.06f, 4096., 4096., 4096.);
+    setSampledHists(false);
+
+    bool ok = true;
+    if (!sampled.hists.empty())
+    {
+        std::cout << "FAILED: the histograms were not sampled" << std::endl;
+        ok = false;
+    }
+    if (sampled.tiles.empty())
+    {
+        std::cout << "FAILED: no tile summary with sampled histograms" << std::endl;
+        ok = false;
+    }
+
+    // the sky level of the input mapped by the pending transforms of both results
+    for (int c = 0; c < 3; c++)
+    {
+        const double a = std::max(sky[c] * full.scale[c] + full.offset[c], full.lower[c]) * 65535.;
+        const double b = std::max(sky[c] * sampled.scale[c] + sampled.offset[c], sampled.lower[c]) * 65535.;
+        std::cout << "channel " << c << ": sky at " << a << " (all pixels) and " << b << " (sampled)" << std::endl;
+        if (std::fabs(a - b) > 12.)
+        {
+            std::cout << "FAILED: sky levels differ by " << std::fabs(a - b) << std::endl;
+            ok = false;
+        }
+    }
+    return ok ? 0 : 1;
+}
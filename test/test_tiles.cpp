@@ -0,0 +1,181 @@
+/*******************************************************************************
+  Copyright(c) 2020 Joachim Janz. All rights reserved.
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation; either version 2 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU Library General Public License
+  along with this library; see the file COPYING.LIB.  If not, write to
+  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+  Boston, MA 02110-1301, USA.
+
+  The full GNU General Public License is included in this distribution in the
+  file called LICENSE.
+
+*******************************************************************************/
+
+/**
+ * @file test_tiles.cpp
+ * @brief Checks that skipping tiles with the tile summary does not change the results
+ *
+ * The steps are run on a synthetic frame (sky with noise, stars and a nebula) once with the
+ * tile summary and once without it, which tests every pixel.
+ */
+
+#include "j3clrstrtch.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+/**
+ * @brief Creates a synthetic linear frame at the sky level of the sky subtraction
+ * About half of the tiles only contain sky, whose noise stays below the limit of the colour
+ * correction, the others contain stars or a part of a nebula.
+ *
+ * @param rows Number of rows
+ * @param cols Number of columns
+ * @return Frame (CV_32FC3)
+ */
+static cv::Mat syntheticFrame(const int rows, const int cols)
+{
+    const float sky = 4096.f / 65535.f;
+    cv::Mat frame(rows, cols, CV_32FC3);
+    cv::RNG rng(33);
+    rng.fill(frame, cv::RNG::UNIFORM, cv::Scalar::all(sky), cv::Scalar::all(sky + 8.f / 65535.f));
+
+    // nebula in the upper left quarter
+    for (int row = 0; row < rows / 2; row++)
+    {
+        cv::Vec3f* p = frame.ptr<cv::Vec3f>(row);
+        for (int col = 0; col < cols / 2; col++)
+        {
+            const float d = std::hypot((float)row / rows - 0.2f, (float)col / cols - 0.2f);
+            const float v = 0.05f * std::exp(-d * d / 0.01f);
+            p[col] += cv::Vec3f(0.3f * v, 0.6f * v, v);
+        }
+    }
+
+    // stars
+    for (int i = 0; i < 60; i++)
+    {
+        const cv::Point c(rng.uniform(0, cols), rng.uniform(rows / 2, rows));
+        const cv::Vec3f colour(rng.uniform(0.1f, 0.5f), rng.uniform(0.1f, 0.5f), rng.uniform(0.1f, 0.5f));
+        for (int row = std::max(c.y - 4, 0); row < std::min(c.y + 5, rows); row++)
+        {
+            for (int col = std::max(c.x - 4, 0); col < std::min(c.x + 5, cols); col++)
+            {
+                const float r2 = (float)((row - c.y) * (row - c.y) + (col - c.x) * (col - c.x));
+                frame.at<cv::Vec3f>(row, col) += colour * std::exp(-r2 / 3.f);
+            }
+        }
+    }
+    return frame;
+}
+
+/**
+ * @brief Maximum difference of two images
+ *
+ * @param a First image
+ * @param b Second image
+ * @return Maximum absolute difference
+ */
+static double maxDiff(const cv::Mat &a, const cv::Mat &b)
+{
+    return cv::norm(a, b, cv::NORM_INF);
+}
+
+/**
+ * @brief Reports the result of a comparison
+ * Only ties of two channels may round differently in the last bit (in the colour correction).
+ *
+ * @param what Name of the step
+ * @param err Maximum difference
+ * @return true if the results are identical
+ */
+static bool check(const std::string &what, const double err)
+{
+    std::cout << what << ": maximum difference " << err << std::endl;
+    if (err <= 1e-6) return true;
+    std::cout << "FAILED: " << what << " differs with the tile summary" << std::endl;
+    return false;
+}
+
+int main()
+{
+    bool ok = true;
+    const cv::Mat frame = syntheticFrame(640, 960);
+
+    // reference of the colour correction with its summary, as in j3colorstretch
+    PipelineImage reference(frame.clone());
+    updateHists(reference);
+    const TileIndex refTiles = reference.effectiveTiles();
+    CV_Assert(!refTiles.empty());
+
+    // make sure both paths are taken
+    int skyTiles = 0;
+    const float limit = 4096.f / 65535.f + 10.f / 65535.f;
+    for (int row = 0; row < refTiles.maxs.rows; row++)
+    {
+        for (int col = 0; col < refTiles.maxs.cols; col++)
+        {
+            const cv::Vec3f mx = refTiles.maxs.at<cv::Vec3f>(row, col);
+            skyTiles += mx[0] <= limit && mx[1] <= limit && mx[2] <= limit;
+        }
+    }
+    std::cout << skyTiles << " of " << refTiles.maxs.total() << " tiles at the sky level" << std::endl;
+    if (skyTiles == 0 || skyTiles == (int)refTiles.maxs.total())
+    {
+        std::cout << "FAILED: the frame does not have both kinds of tiles" << std::endl;
+        ok = false;
+    }
+
+    // stretched image with a pending normalization
+    for (int fast = 0; fast < 2; fast++)
+    {
+        setFastMath(fast != 0);
+        PipelineImage stretched(frame.clone());
+        stretching(stretched, 3.);
+
+        PipelineImage withTiles = stretched;
+        withTiles.data = stretched.data.clone();
+        colorcorr(withTiles, reference.data, 4096., 4096., 4096., 1.0, false, refTiles);
+        PipelineImage perPixel = stretched;
+        perPixel.data = stretched.data.clone();
+        colorcorr(perPixel, reference.data, 4096., 4096., 4096., 1.0, false, TileIndex());
+
+        cv::Mat a, b;
+        withTiles.apply(a);
+        perPixel.apply(b);
+        ok = check(fast ? "colorcorr (fast math)" : "colorcorr", maxDiff(a, b)) && ok;
+    }
+    setFastMath(false);
+
+    // minimum between the sky and the nebula, with and without a pending transform
+    for (int pending = 0; pending < 2; pending++)
+    {
+        PipelineImage withTiles(frame.clone());
+        updateHists(withTiles);
+        if (pending) withTiles.affine(cv::Scalar::all(1.1), cv::Scalar::all(-0.005));
+        PipelineImage perPixel = withTiles;
+        perPixel.data = withTiles.data.clone();
+        perPixel.tiles = TileIndex();
+
+        setMin(withTiles, 0.065f, 0.066f, 0.067f);
+        setMin(perPixel, 0.065f, 0.066f, 0.067f);
+
+        cv::Mat a, b;
+        withTiles.apply(a);
+        perPixel.apply(b);
+        ok = check(pending ? "setMin (pending transform)" : "setMin", maxDiff(a, b)) && ok;
+    }
+
+    return ok ? 0 : 1;
+}